@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "accel_cache.hh"
+
+#define CACHE_MAGIC "RTACCEL"
+#define CACHE_VERSION 2
+#define CACHE_DIR ".rtcache"
+#define ALIGN 64
+
+static long long align(long long off)
+{
+  return (off + ALIGN - 1) / ALIGN * ALIGN;
+}
+
+// write len bytes at offset off, padding up to it with zeros
+static int write_at(FILE *fp, long long off, const void *data, size_t len)
+{
+  while(ftell(fp) < off)
+    if(fputc(0, fp) == EOF) return -1;
+  return len && fwrite(data, len, 1, fp) != 1 ? -1 : 0;
+}
+
+// ############################## accel_cache ##############################
+accel_cache::accel_cache()
+{
+  map = 0;
+  size = 0;
+}
+
+accel_cache::~accel_cache()
+{
+  unmap();
+}
+
+void accel_cache::unmap()
+{
+  if(map) munmap(map, size);
+  map = 0;
+  size = 0;
+}
+
+void accel_cache::file_name(char *buf, size_t len, unsigned long long key,
+			    int width)
+{
+  const char *dir = getenv("RT_CACHE_DIR");
+  snprintf(buf, len, "%s/%016llx-%d.bvh", dir ? dir : CACHE_DIR, key, width);
+}
+
+int accel_cache::open(unsigned long long key, int width, int faces)
+{
+  char name[1024];
+  struct stat st;
+  unmap();
+  file_name(name, sizeof(name), key, width);
+  int fd = ::open(name, O_RDONLY);
+  if(fd == -1) return -1;
+  if(fstat(fd, &st) || st.st_size < (off_t)sizeof(cacheHeader))
+    {
+      close(fd);
+      return -1;
+    }
+  // map privately, so that the structures may be used in place
+  size = st.st_size;
+  map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED)
+    {
+      map = 0;
+      return -1;
+    }
+
+  // check that the file is from this build and for this mesh
+  const cacheHeader *h = (const cacheHeader *)map;
+  long long end = (long long)size;
+  if(memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic))
+     || h->version != CACHE_VERSION || h->key != key
+     || (int)h->width != width || h->faces != faces
+     || h->node_size != (int)sizeof(bvhNode)
+     || h->wide_node_size != wide_bvh::node_size(width)
+     || h->block_size != wide_bvh::block_size(width)
+     || h->num_nodes < 1 || h->num_prims != faces
+     || h->num_wide_nodes < 0 || h->num_blocks < 0
+     || h->nodes_off % ALIGN || h->indices_off % ALIGN
+     || h->wide_off % ALIGN || h->blocks_off % ALIGN
+     // the arrays follow the header in order, without overlapping
+     || h->nodes_off < (long long)sizeof(cacheHeader)
+     || h->nodes_off > end
+     || h->indices_off < h->nodes_off + (long long)h->num_nodes * h->node_size
+     || h->indices_off > end
+     || h->wide_off
+	< h->indices_off + (long long)h->num_prims * (long long)sizeof(int)
+     || h->wide_off > end
+     || h->blocks_off
+	< h->wide_off + (long long)h->num_wide_nodes * h->wide_node_size
+     || h->blocks_off > end
+     || h->blocks_off + (long long)h->num_blocks * h->block_size > end)
+    {
+      printf("accel_cache::open(): ignoring stale cache %s\n", name);
+      unmap();
+      return -1;
+    }
+  // the structures are used in place, so check every link in them
+  // before they are trusted
+  char *base = (char *)map;
+  if(!bvh::valid((const bvhNode *)(base + h->nodes_off), h->num_nodes,
+		 (const int *)(base + h->indices_off), h->num_prims, faces)
+     || (h->width
+	 && !wide_bvh::valid(h->width, base + h->wide_off,
+			     h->num_wide_nodes, base + h->blocks_off,
+			     h->num_blocks, faces)))
+    {
+      printf("accel_cache::open(): ignoring stale cache %s\n", name);
+      unmap();
+      return -1;
+    }
+  return 0;
+}
+
+void accel_cache::attach(bvh &tree, wide_bvh *wide)
+{
+  if(!map) return;
+  char *base = (char *)map;
+  const cacheHeader *h = (const cacheHeader *)map;
+  tree.attach((bvhNode *)(base + h->nodes_off), h->num_nodes,
+	      (int *)(base + h->indices_off), h->num_prims);
+  if(h->width && wide)
+    wide->attach(h->width, base + h->wide_off, h->num_wide_nodes,
+		base + h->blocks_off, h->num_blocks);
+}
+
+int accel_cache::save(unsigned long long key, int faces, const bvh &tree,
+		      const wide_bvh *wide)
+{
+  char name[1024], tmp[1100];
+  const char *dir = getenv("RT_CACHE_DIR");
+  int width = wide ? wide->get_width() : 0;
+  mkdir(dir ? dir : CACHE_DIR, 0777);
+  file_name(name, sizeof(name), key, width);
+  // unique to the thread too, as meshes may be loaded in parallel
+  snprintf(tmp, sizeof(tmp), "%s.%d.%lx", name, (int)getpid(),
+	   (unsigned long)pthread_self());
+
+  cacheHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+  h.version = CACHE_VERSION;
+  h.width = width;
+  h.key = key;
+  h.faces = faces;
+  h.node_size = sizeof(bvhNode);
+  h.wide_node_size = wide_bvh::node_size(width);
+  h.block_size = wide_bvh::block_size(width);
+  h.num_nodes = tree.size();
+  h.num_prims = tree.get_num_prims();
+  h.num_wide_nodes = wide ? wide->get_num_nodes() : 0;
+  h.num_blocks = wide ? wide->get_num_blocks() : 0;
+  h.nodes_off = align(sizeof(h));
+  h.indices_off = align(h.nodes_off + (long long)h.num_nodes * h.node_size);
+  h.wide_off = align(h.indices_off + (long long)h.num_prims * sizeof(int));
+  h.blocks_off =
+    align(h.wide_off + (long long)h.num_wide_nodes * h.wide_node_size);
+
+  // write to a temporary file and move it into place, so that readers
+  // never see a partial file
+  FILE *fp = fopen(tmp, "wb");
+  if(!fp)
+    {
+      printf("accel_cache::save(): Cannot write %s!\n", tmp);
+      return -1;
+    }
+  int ret = write_at(fp, 0, &h, sizeof(h));
+  ret |= write_at(fp, h.nodes_off, tree.get_nodes(),
+		  (size_t)h.num_nodes * h.node_size);
+  ret |= write_at(fp, h.indices_off, tree.get_indices(),
+		  (size_t)h.num_prims * sizeof(int));
+  if(wide)
+    {
+      ret |= write_at(fp, h.wide_off, wide->get_nodes(),
+		      (size_t)h.num_wide_nodes * h.wide_node_size);
+      ret |= write_at(fp, h.blocks_off, wide->get_blocks(),
+		      (size_t)h.num_blocks * h.block_size);
+    }
+  if(fclose(fp) || ret || rename(tmp, name))
+    {
+      printf("accel_cache::save(): Cannot write %s!\n", name);
+      unlink(tmp);
+      return -1;
+    }
+  return 0;
+}
+
+unsigned long long accel_cache::hash_file(const char *filename)
+{
+  unsigned long long hash = hash_bytes(0, 0);
+  unsigned char buf[65536];
+  size_t len;
+  FILE *fp = fopen(filename, "rb");
+  if(!fp) return 0;
+  while((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+    hash = hash_bytes(buf, len, hash);
+  fclose(fp);
+  return hash;
+}
+
+unsigned long long accel_cache::hash_bytes(const void *buf, size_t len,
+					   unsigned long long hash)
+{
+  // 64-bit FNV-1a
+  const unsigned char *p = (const unsigned char *)buf;
+  for(size_t i = 0; i < len; i++)
+    {
+      hash ^= p[i];
+      hash *= 1099511628211ULL;
+    }
+  return hash;
+}
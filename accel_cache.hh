@@ -0,0 +1,54 @@
+#ifndef _ACCEL_CACHE_HH
+#define _ACCEL_CACHE_HH 1
+
+#include <stddef.h>
+#include "bvh.hh"
+#include "wide_bvh.hh"
+
+// Header of a cache file.  Arrays follow it at the given offsets, each
+// aligned to a cache line, so that a mapped file can be used in place.
+struct cacheHeader
+{
+  char magic[8];
+  unsigned int version;
+  unsigned int width;		// width of the wide hierarchy, or 0
+  unsigned long long key;	// hash of the source mesh
+  int faces;
+  // sizes of the stored records, to reject files from other builds
+  int node_size, wide_node_size, block_size;
+  int num_nodes, num_prims, num_wide_nodes, num_blocks;
+  long long nodes_off, indices_off, wide_off, blocks_off;
+};
+
+// Acceleration structures for a mesh, persisted in a memory-mapped
+// file named after a hash of the mesh's contents.  Files live in the
+// directory named by RT_CACHE_DIR, or .rtcache by default.
+class accel_cache
+{
+public:
+  accel_cache();
+  ~accel_cache();
+  // map the cache file for key, returning 0 if it holds structures
+  // of the given width for a mesh of the given number of faces
+  int open(unsigned long long key, int width, int faces);
+  // point tree and wide at the mapped structures
+  void attach(bvh &tree, wide_bvh *wide);
+  // write structures to the cache file for key
+  static int save(unsigned long long key, int faces, const bvh &tree,
+		  const wide_bvh *wide);
+  // hash the contents of a file, or return 0 if it can't be read
+  static unsigned long long hash_file(const char *filename);
+  // hash len bytes, continuing from the hash of the bytes before them
+  static unsigned long long hash_bytes(const void *buf, size_t len,
+				       unsigned long long hash
+				       = 14695981039346656037ULL);
+protected:
+  void *map;
+  size_t size;
+  void unmap();
+  // get the name of the cache file for key and width
+  static void file_name(char *buf, size_t len, unsigned long long key,
+			int width);
+};
+
+#endif /* _ACCEL_CACHE_HH */
@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/time.h>
+
+#include "bench.hh"
+
+double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+char *generate_mesh(int rows, int cols)
+{
+  char *name = strdup("/tmp/bench_XXXXXX");
+  int fd = mkstemp(name);
+  FILE *fp = fd == -1 ? 0 : fdopen(fd, "w");
+  if(!fp)
+    {
+      printf("generate_mesh(): Cannot create %s!\n", name);
+      free(name);
+      return 0;
+    }
+  srand(1);
+  // vertices on a perturbed latitude-longitude grid, plus the poles
+  for(int i = 1; i < rows; i++)
+    for(int j = 0; j < cols; j++)
+      {
+	double theta = M_PI * i / rows, phi = 2 * M_PI * j / cols,
+	  r = 1.0 + 0.05 * rand() / RAND_MAX;
+	fprintf(fp, "v %f %f %f\n", r * sin(theta) * cos(phi),
+		r * cos(theta), r * sin(theta) * sin(phi));
+      }
+  int north = (rows - 1) * cols + 1, south = north + 1;
+  fprintf(fp, "v 0 1 0\nv 0 -1 0\n");
+  for(int j = 0; j < cols; j++)
+    {
+      int k = (j + 1) % cols;
+      fprintf(fp, "f %d %d %d\n", north, j + 1, k + 1);
+      for(int i = 1; i < rows - 1; i++)
+	{
+	  int a = (i - 1) * cols + j + 1, b = (i - 1) * cols + k + 1;
+	  fprintf(fp, "f %d %d %d\n", a, a + cols, b + cols);
+	  fprintf(fp, "f %d %d %d\n", a, b + cols, b);
+	}
+      fprintf(fp, "f %d %d %d\n", (rows - 2) * cols + j + 1, south,
+	      (rows - 2) * cols + k + 1);
+    }
+  fclose(fp);
+  return name;
+}
+
+void bench_mesh(const char *name, mesh &m, int rays)
+{
+  double min[3], max[3], center[3], radius = 0;
+  m.world_bounds(min, max);
+  for(int k = 0; k < 3; k++)
+    {
+      center[k] = 0.5 * (min[k] + max[k]);
+      radius += (max[k] - min[k]) * (max[k] - min[k]);
+    }
+  radius = sqrt(radius);
+
+  // rays from a sphere around the mesh toward points inside its box
+  point *orig = new point[rays];
+  vector *dir = new vector[rays];
+  srand(2);
+  for(int i = 0; i < rays; i++)
+    {
+      double z = 2.0 * rand() / RAND_MAX - 1, phi = 2 * M_PI * rand() / RAND_MAX,
+	s = sqrt(1 - z * z);
+      orig[i] = point(center[0] + radius * s * cos(phi),
+		      center[1] + radius * s * sin(phi),
+		      center[2] + radius * z);
+      point target(min[0] + (max[0] - min[0]) * rand() / RAND_MAX,
+		   min[1] + (max[1] - min[1]) * rand() / RAND_MAX,
+		   min[2] + (max[2] - min[2]) * rand() / RAND_MAX);
+      dir[i] = (target - orig[i]).normalize();
+    }
+
+  int widths[3] = { 0, 4, 8 };
+  for(int w = 0; w < 3; w++)
+    {
+      point vertex, normal;
+      int hits = 0;
+      m.set_width(widths[w]);
+      double start = now();
+      for(int i = 0; i < rays; i++)
+	if(m.fine_intersect(orig[i], dir[i], vertex, normal) != -1.0)
+	  hits++;
+      double elapsed = now() - start;
+      printf("%-12s %-8s %10.0f rays/s  (%d of %d hit)\n", name,
+	     widths[w] ? (widths[w] == 4 ? "wide4" : "wide8") : "scalar",
+	     rays / elapsed, hits, rays);
+    }
+  delete[] orig;
+  delete[] dir;
+}
+
+void bench_primary(const char *name, scene &scn, int size, double width)
+{
+  // the viewer's default camera
+  matrix inv = matrix::look_at(point(0,0,8), point(0,0,0),
+			       vector(0,1,0)).inverse();
+  double depth = 8.0, t;
+  int rays = size * size, hits = 0;
+  point *orig = new point[rays], *dir = new point[rays], vertex, normal;
+  // order the rays by tile, as the viewer traces them
+  int n = 0;
+  for(int i0 = 0; i0 < size; i0 += PACKET_DIM)
+    for(int j0 = 0; j0 < size; j0 += PACKET_DIM)
+      for(int j = j0; j < j0 + PACKET_DIM && j < size; j++)
+	for(int i = i0; i < i0 + PACKET_DIM && i < size; i++)
+	  {
+	    double u = 2 * width * (double)i / size - width,
+	      v = 2 * width * (double)j / size - width;
+	    orig[n] = inv * point(0,0,0);
+	    dir[n++] = (inv * vector(u, v, -depth)).normalize();
+	  }
+
+  double start = now();
+  for(int i = 0; i < rays; i++)
+    if(scn.nearest(orig[i], dir[i], 0, t, vertex, normal) != -1)
+      hits++;
+  double elapsed = now() - start;
+  printf("%-12s %-8s %10.0f rays/s  (%d of %d hit)\n", name, "single",
+	 rays / elapsed, hits, rays);
+
+  ray_packet packet;
+  hits = 0;
+  start = now();
+  for(int first = 0; first < rays; first += PACKET_SIZE)
+    {
+      int count = rays - first < PACKET_SIZE ? rays - first : PACKET_SIZE;
+      packet.reset(count);
+      for(int i = 0; i < count; i++)
+	packet.set_ray(i, orig[first + i], dir[first + i]);
+      packet.prepare();
+      scn.nearest(packet);
+      for(int i = 0; i < count; i++)
+	hits += packet.surface[i] != -1;
+    }
+  elapsed = now() - start;
+  printf("%-12s %-8s %10.0f rays/s  (%d of %d hit)\n", name, "packet",
+	 rays / elapsed, hits, rays);
+  delete[] orig;
+  delete[] dir;
+}
+
+void bench_threads(const char *name, scene &scn, int size, int max_threads)
+{
+  matrix inv = matrix::look_at(point(0,0,8), point(0,0,0),
+			       vector(0,1,0)).inverse();
+  FrameBuffer fb(size, size);
+  double base = 0.0;
+  for(int n = 1; ; n *= 2)
+    {
+      if(n > max_threads) n = max_threads;
+      renderer r(n);
+      r.set_camera(inv, 1.2, 8.0, 1);
+      double start = now();
+      r.render(&scn, &fb);
+      double elapsed = now() - start;
+      if(n == 1) base = elapsed;
+      printf("%-12s %2d threads %8.3f s  speedup %5.2f  (%lld steals)\n",
+	     name, r.get_pool()->size(), elapsed, base / elapsed,
+	     r.get_pool()->get_steals());
+      if(n == max_threads) break;
+    }
+}
+
+// root mean square difference of two frames
+static double rms_difference(FrameBuffer &a, FrameBuffer &b)
+{
+  double sum = 0;
+  for(int i = 0; i < a.GetWidth(); i++)
+    for(int j = 0; j < a.GetHeight(); j++)
+      {
+	Color d = a.GetPixel(i, j).color - b.GetPixel(i, j).color;
+	sum += d.r * d.r + d.g * d.g + d.b * d.b;
+      }
+  return sqrt(sum / (3.0 * a.GetWidth() * a.GetHeight()));
+}
+
+void bench_samples(const char *name, scene &scn, int size, double width)
+{
+  matrix inv = matrix::look_at(point(0,0,8), point(0,0,0),
+			       vector(0,1,0)).inverse();
+  FrameBuffer ref(size, size), fb(size, size);
+  renderer r;
+  r.set_camera(inv, width, 8.0, 1);
+  r.set_samples(64, 64);
+  r.render(&scn, &ref);
+  int budgets[2][2] = { { 16, 16 }, { BASE_SAMPLES, MAX_SAMPLES } };
+  for(int i = 0; i < 2; i++)
+    {
+      r.set_samples(budgets[i][0], budgets[i][1]);
+      r.reset_rays();
+      double start = now();
+      r.render(&scn, &fb);
+      double elapsed = now() - start;
+      printf("%-12s %-8s %6.2f rays/pixel %8.3f s  rms error %.5f\n", name,
+	     i ? "adaptive" : "16x", (double)r.get_rays() / (size * size),
+	     elapsed, rms_difference(fb, ref));
+    }
+}
+
+// remove dir and the files in it
+void remove_dir(const char *dir)
+{
+  DIR *d = opendir(dir);
+  if(!d) return;
+  char path[256];
+  for(dirent *e = readdir(d); e; e = readdir(d))
+    if(strcmp(e->d_name, ".") && strcmp(e->d_name, "..")
+       && snprintf(path, sizeof(path), "%s/%s", dir, e->d_name)
+       < (int)sizeof(path))
+      unlink(path);
+  closedir(d);
+  rmdir(dir);
+}
+
+int main(int argc, char* argv[])
+{
+  int rays = argc > 1 ? atoi(argv[1]) : 100000;
+  int threads = argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  int sizes[2][2] = { { 100, 250 }, { 400, 625 } };
+  // cache hierarchies in a directory of the bench's own, so that every
+  // run builds them and none are left behind in .rtcache
+  char cache[] = "/tmp/bench_cache_XXXXXX";
+  if(!mkdtemp(cache))
+    {
+      printf("Cannot create %s!\n", cache);
+      return -1;
+    }
+  setenv("RT_CACHE_DIR", cache, 1);
+  mesh teapot("teapot.obj");
+  bench_mesh("teapot", teapot, rays);
+  for(int i = 0; i < 2; i++)
+    {
+      char *file = generate_mesh(sizes[i][0], sizes[i][1]), label[32];
+      if(!file)
+	{
+	  remove_dir(cache);
+	  return -1;
+	}
+      mesh m(file);
+      unlink(file);
+      free(file);
+      snprintf(label, sizeof(label), "sphere%dk",
+	       2 * sizes[i][0] * sizes[i][1] / 1000);
+      bench_mesh(label, m, rays);
+    }
+  // primary rays of scene1.rtl, from the default view and zoomed in
+  scene scn("scene1.rtl");
+  bench_primary("scene1", scn, 512, 6.0);
+  bench_primary("scene1-zoom", scn, 512, 1.2);
+  // whole frames of the zoomed view on more and more threads
+  bench_threads("scene1-zoom", scn, 512, threads > 0 ? threads : 1);
+  // edges of the zoomed view supersampled adaptively and uniformly
+  bench_samples("scene1-zoom", scn, 256, 1.2);
+  remove_dir(cache);
+  return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef _BENCH_HH
+#define _BENCH_HH 1
+
+#include "mesh.hh"
+#include "scene.hh"
+#include "renderer.hh"
+
+// write a bumpy sphere of about 2 * rows * cols triangles to a
+// temporary obj file, returning its name (to be freed by the caller)
+char *generate_mesh(int rows, int cols);
+
+// trace random rays at a mesh with each traversal width, and print
+// the rate of each
+void bench_mesh(const char *name, mesh &m, int rays);
+
+// find the first hits of size x size primary rays from the default
+// camera, singly and in packets, and print the rate of each
+void bench_primary(const char *name, scene &scn, int size, double width);
+
+// render size x size frames with 1, 2, 4, ... up to max_threads
+// threads, and print the speedup of each over one thread
+void bench_threads(const char *name, scene &scn, int size, int max_threads);
+
+// render a size x size frame supersampled adaptively with the default
+// budget and uniformly with 16 samples per pixel, and print the rays
+// each traced and their difference from 64 samples per pixel
+void bench_samples(const char *name, scene &scn, int size, double width);
+
+// remove dir and the files in it
+void remove_dir(const char *dir);
+
+// wall clock time in seconds
+double now();
+
+// Here's the main
+int main(int argc, char* argv[]);
+
+#endif /* _BENCH_HH */
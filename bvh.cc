@@ -0,0 +1,487 @@
+#include <float.h>
+#include <stdlib.h>
+#include "bvh.hh"
+#include "ray_packet.hh"
+
+#define BINS 16
+#define MAX_LEAF 8
+#define MAX_DEPTH 128
+// below this depth nodes are split at the middle, so that however
+// badly spread the primitives are, leaves end within MAX_DEPTH
+#define MEDIAN_DEPTH (MAX_DEPTH - 32)
+// relative costs of stepping through a node and testing a primitive
+#define COST_TRAVERSE 1.0
+#define COST_INTERSECT 1.0
+
+static double half_area(const double *min, const double *max)
+{
+  double dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+  return dx * dy + dy * dz + dz * dx;
+}
+
+static void grow(double *min, double *max, const double *pmin,
+		 const double *pmax)
+{
+  for(int k = 0; k < 3; k++)
+    {
+      if(pmin[k] < min[k]) min[k] = pmin[k];
+      if(pmax[k] > max[k]) max[k] = pmax[k];
+    }
+}
+
+static void empty(double *min, double *max)
+{
+  for(int k = 0; k < 3; k++)
+    {
+      min[k] = DBL_MAX;
+      max[k] = -DBL_MAX;
+    }
+}
+
+// ############################ bvh_client ############################
+void bvh_client::intersect_packet(int prim, ray_packet &packet, int first,
+				  int last, void *data) const
+{
+  bvhRay ray;
+  double t;
+  for(int i = first; i < last && i < packet.size(); i++)
+    {
+      bvh::make_ray(ray, packet.get_orig(i), packet.get_dir(i));
+      t = intersect_primitive(prim, ray, packet.t[i], data);
+      if(t != -1.0 && t >= packet.tmin)
+	{
+	  packet.t[i] = t;
+	  packet.prim[i] = prim;
+	}
+    }
+}
+
+// ############################## bvh ##############################
+bvh::bvh()
+{
+  nodes = 0;
+  indices = 0;
+  num_nodes = num_prims = 0;
+  attached = 0;
+  prim_min = prim_max = 0;
+  parent = leaf = 0;
+  area_cost = built_cost = 0.0;
+}
+
+bvh::~bvh()
+{
+  deinit();
+}
+
+void bvh::deinit()
+{
+  if(nodes && !attached) delete[] nodes;
+  if(indices && !attached) delete[] indices;
+  attached = 0;
+  if(prim_min) delete[] prim_min;
+  if(prim_max) delete[] prim_max;
+  if(parent) delete[] parent;
+  if(leaf) delete[] leaf;
+  nodes = 0;
+  indices = 0;
+  num_nodes = num_prims = 0;
+  prim_min = prim_max = 0;
+  parent = leaf = 0;
+  area_cost = built_cost = 0.0;
+}
+
+void bvh::build(int n, const double (*min)[3], const double (*max)[3],
+		int refittable)
+{
+  double (*bmin)[3] = 0, (*bmax)[3] = 0;
+  if(refittable && n > 0)
+    {
+      // take a copy first, in case we're rebuilding from our own
+      bmin = new double[n][3];
+      bmax = new double[n][3];
+      for(int i = 0; i < n; i++)
+	for(int k = 0; k < 3; k++)
+	  {
+	    bmin[i][k] = min[i][k];
+	    bmax[i][k] = max[i][k];
+	  }
+      min = bmin;
+      max = bmax;
+    }
+  deinit();
+  if(n <= 0) return;
+  num_prims = n;
+  indices = new int[n];
+  nodes = new bvhNode[2 * n - 1];
+  double (*centroid)[3] = new double[n][3];
+  for(int i = 0; i < n; i++)
+    {
+      indices[i] = i;
+      for(int k = 0; k < 3; k++)
+	centroid[i][k] = 0.5 * (min[i][k] + max[i][k]);
+    }
+  num_nodes = 1;
+  build_node(0, 0, n, 0, min, max, centroid);
+  delete[] centroid;
+  if(!refittable) return;
+
+  prim_min = bmin;
+  prim_max = bmax;
+  parent = new int[num_nodes];
+  leaf = new int[n];
+  parent[0] = -1;
+  for(int i = 0; i < num_nodes; i++)
+    {
+      if(nodes[i].count)
+	for(int j = nodes[i].offset; j < nodes[i].offset + nodes[i].count; j++)
+	  leaf[indices[j]] = i;
+      else
+	parent[nodes[i].offset] = parent[nodes[i].offset + 1] = i;
+      area_cost += node_cost(i);
+    }
+  double area = half_area(nodes[0].min, nodes[0].max);
+  built_cost = area > 0.0 ? area_cost / area : 0.0;
+}
+
+void bvh::rebuild()
+{
+  if(prim_min) build(num_prims, prim_min, prim_max, 1);
+}
+
+void bvh::update(int prim, const double *min, const double *max)
+{
+  if(!leaf || prim < 0 || prim >= num_prims) return;
+  for(int k = 0; k < 3; k++)
+    {
+      prim_min[prim][k] = min[k];
+      prim_max[prim][k] = max[k];
+    }
+  // refit upward until a node's box comes out unchanged
+  for(int node = leaf[prim]; node != -1; node = parent[node])
+    {
+      bvhNode &nd = nodes[node];
+      double bmin[3], bmax[3];
+      empty(bmin, bmax);
+      if(nd.count)
+	for(int i = nd.offset; i < nd.offset + nd.count; i++)
+	  grow(bmin, bmax, prim_min[indices[i]], prim_max[indices[i]]);
+      else
+	for(int i = nd.offset; i < nd.offset + 2; i++)
+	  grow(bmin, bmax, nodes[i].min, nodes[i].max);
+      int same = 1;
+      for(int k = 0; k < 3; k++)
+	if(bmin[k] != nd.min[k] || bmax[k] != nd.max[k]) same = 0;
+      if(same) break;
+      area_cost -= node_cost(node);
+      for(int k = 0; k < 3; k++)
+	{
+	  nd.min[k] = bmin[k];
+	  nd.max[k] = bmax[k];
+	}
+      area_cost += node_cost(node);
+    }
+}
+
+double bvh::degradation() const
+{
+  double area = half_area(nodes[0].min, nodes[0].max);
+  if(!leaf || !built_cost || area <= 0.0) return 1.0;
+  return area_cost / area / built_cost;
+}
+
+double bvh::node_cost(int node) const
+{
+  const bvhNode &nd = nodes[node];
+  return half_area(nd.min, nd.max)
+    * (nd.count ? COST_INTERSECT * nd.count : COST_TRAVERSE);
+}
+
+void bvh::build_node(int node, int first, int count, int depth,
+		     const double (*min)[3], const double (*max)[3],
+		     const double (*centroid)[3])
+{
+  bvhNode &nd = nodes[node];
+  double cmin[3], cmax[3];
+  empty(nd.min, nd.max);
+  empty(cmin, cmax);
+  for(int i = first; i < first + count; i++)
+    {
+      grow(nd.min, nd.max, min[indices[i]], max[indices[i]]);
+      grow(cmin, cmax, centroid[indices[i]], centroid[indices[i]]);
+    }
+  nd.offset = first;
+  nd.count = count;
+  if(count == 1) return;
+
+  // bin the centroids along each axis and pick the cheapest split
+  double best_cost = DBL_MAX, area = half_area(nd.min, nd.max);
+  int best_axis = -1, best_bin = 0;
+  for(int k = 0; k < 3 && depth < MEDIAN_DEPTH; k++)
+    {
+      double extent = cmax[k] - cmin[k];
+      if(extent <= 0.0) continue;
+      double bmin[BINS][3], bmax[BINS][3];
+      int bcount[BINS];
+      for(int b = 0; b < BINS; b++)
+	{
+	  empty(bmin[b], bmax[b]);
+	  bcount[b] = 0;
+	}
+      double scale = BINS / extent;
+      for(int i = first; i < first + count; i++)
+	{
+	  int b = (int)((centroid[indices[i]][k] - cmin[k]) * scale);
+	  if(b >= BINS) b = BINS - 1;
+	  bcount[b]++;
+	  grow(bmin[b], bmax[b], min[indices[i]], max[indices[i]]);
+	}
+      // sweep from the right to get the area of each right-hand side
+      double rarea[BINS], rmin[3], rmax[3];
+      int rcount[BINS], n = 0;
+      empty(rmin, rmax);
+      for(int b = BINS - 1; b > 0; b--)
+	{
+	  grow(rmin, rmax, bmin[b], bmax[b]);
+	  n += bcount[b];
+	  rcount[b] = n;
+	  rarea[b] = n ? half_area(rmin, rmax) : 0.0;
+	}
+      // then sweep from the left, evaluating each split plane
+      double lmin[3], lmax[3];
+      empty(lmin, lmax);
+      n = 0;
+      for(int b = 0; b < BINS - 1; b++)
+	{
+	  grow(lmin, lmax, bmin[b], bmax[b]);
+	  n += bcount[b];
+	  if(!n || !rcount[b + 1]) continue;
+	  double cost = COST_TRAVERSE + COST_INTERSECT
+	    * (half_area(lmin, lmax) * n + rarea[b + 1] * rcount[b + 1])
+	    / area;
+	  if(cost < best_cost)
+	    {
+	      best_cost = cost;
+	      best_axis = k;
+	      best_bin = b;
+	    }
+	}
+    }
+
+  // make a leaf if splitting doesn't pay for itself
+  if(best_axis == -1
+     || (count <= MAX_LEAF && best_cost >= COST_INTERSECT * count))
+    {
+      if(count <= MAX_LEAF || best_axis != -1) return;
+      // all centroids coincide, or the tree is too deep, so split down
+      // the middle
+      best_axis = 0;
+    }
+
+  int mid = first;
+  if(depth < MEDIAN_DEPTH && cmax[best_axis] > cmin[best_axis])
+    {
+      double scale = BINS / (cmax[best_axis] - cmin[best_axis]);
+      int last = first + count - 1;
+      while(mid <= last)
+	{
+	  int b = (int)((centroid[indices[mid]][best_axis] - cmin[best_axis])
+			* scale);
+	  if(b >= BINS) b = BINS - 1;
+	  if(b <= best_bin) mid++;
+	  else
+	    {
+	      int tmp = indices[mid];
+	      indices[mid] = indices[last];
+	      indices[last--] = tmp;
+	    }
+	}
+    }
+  if(mid == first || mid == first + count) mid = first + count / 2;
+
+  int left = num_nodes;
+  num_nodes += 2;
+  nd.offset = left;
+  nd.count = 0;
+  build_node(left, first, mid - first, depth + 1, min, max, centroid);
+  build_node(left + 1, mid, first + count - mid, depth + 1, min, max,
+	     centroid);
+}
+
+double bvh::intersect(const bvh_client *client, const bvhRay &ray,
+		      void *data) const
+{
+  if(!num_nodes) return -1.0;
+  double tmax = DBL_MAX, t;
+  int stack[MAX_DEPTH], sp = 0, node = 0;
+  if(intersect_box(nodes[0], ray, tmax) == -1.0) return -1.0;
+  while(1)
+    {
+      const bvhNode &nd = nodes[node];
+      if(nd.count)
+	{
+	  for(int i = nd.offset; i < nd.offset + nd.count; i++)
+	    if((t = client->intersect_primitive(indices[i], ray, tmax, data))
+	       != -1.0)
+	      tmax = t;
+	}
+      else
+	{
+	  // visit the nearer child first and defer the other
+	  int l = nd.offset, r = nd.offset + 1;
+	  double tl = intersect_box(nodes[l], ray, tmax),
+	    tr = intersect_box(nodes[r], ray, tmax);
+	  if(tl != -1.0 && tr != -1.0)
+	    {
+	      if(tr < tl)
+		{
+		  int tmp = l;
+		  l = r;
+		  r = tmp;
+		}
+	      stack[sp++] = r;
+	      node = l;
+	      continue;
+	    }
+	  if(tl != -1.0)
+	    {
+	      node = l;
+	      continue;
+	    }
+	  if(tr != -1.0)
+	    {
+	      node = r;
+	      continue;
+	    }
+	}
+      if(!sp) break;
+      node = stack[--sp];
+    }
+  return tmax == DBL_MAX ? -1.0 : tmax;
+}
+
+void bvh::attach(bvhNode *nodes_, int num_nodes_, int *indices_,
+		 int num_prims_)
+{
+  deinit();
+  nodes = nodes_;
+  num_nodes = num_nodes_;
+  indices = indices_;
+  num_prims = num_prims_;
+  attached = 1;
+}
+
+int bvh::valid(const bvhNode *nodes_, int num_nodes_, const int *indices_,
+		int num_prims_, int faces)
+{
+  if(num_nodes_ < 1) return 0;
+  // children follow their parents, so depths can be found in order.
+  // Traversal stacks hold one more entry than the deepest node's depth.
+  int *depth = new int[num_nodes_], ret = 1;
+  for(int i = 0; i < num_nodes_; i++)
+    depth[i] = 0;
+  for(int i = 0; i < num_nodes_ && ret; i++)
+    {
+      const bvhNode &nd = nodes_[i];
+      if(nd.count < 0 || depth[i] >= MAX_DEPTH) ret = 0;
+      else if(!nd.count)
+	{
+	  if(nd.offset <= i || nd.offset >= num_nodes_ - 1) ret = 0;
+	  else
+	    for(int c = nd.offset; c < nd.offset + 2; c++)
+	      if(depth[c] < depth[i] + 1) depth[c] = depth[i] + 1;
+	}
+      else if(nd.offset < 0 || nd.count > num_prims_ - nd.offset)
+	ret = 0;
+    }
+  delete[] depth;
+  for(int i = 0; i < num_prims_ && ret; i++)
+    if(indices_[i] < 0 || indices_[i] >= faces) ret = 0;
+  return ret;
+}
+
+int bvh::occluded(const bvh_client *client, const bvhRay &ray, double tmax,
+		  void *data) const
+{
+  if(!num_nodes) return 0;
+  int stack[MAX_DEPTH], sp = 0;
+  stack[sp++] = 0;
+  while(sp)
+    {
+      const bvhNode &nd = nodes[stack[--sp]];
+      if(intersect_box(nd, ray, tmax) == -1.0) continue;
+      if(!nd.count)
+	{
+	  stack[sp++] = nd.offset + 1;
+	  stack[sp++] = nd.offset;
+	  continue;
+	}
+      for(int i = nd.offset; i < nd.offset + nd.count; i++)
+	if(client->intersect_primitive(indices[i], ray, tmax, data) != -1.0)
+	  return 1;
+    }
+  return 0;
+}
+
+int bvh::size() const
+{
+  return num_nodes;
+}
+
+const bvhNode *bvh::get_nodes() const
+{
+  return nodes;
+}
+
+const int *bvh::get_indices() const
+{
+  return indices;
+}
+
+int bvh::get_num_prims() const
+{
+  return num_prims;
+}
+
+int bvh::primitive(int i) const
+{
+  return indices[i];
+}
+
+void bvh::make_ray(bvhRay &ray, const point &orig, const point &dir)
+{
+  ray.orig[0] = orig.get_X();
+  ray.orig[1] = orig.get_Y();
+  ray.orig[2] = orig.get_Z();
+  ray.dir[0] = dir.get_x();
+  ray.dir[1] = dir.get_y();
+  ray.dir[2] = dir.get_z();
+  for(int k = 0; k < 3; k++)
+    ray.inv_dir[k] = ray.dir[k] ? 1.0 / ray.dir[k] : 0.0;
+}
+
+double bvh::intersect_box(const bvhNode &node, const bvhRay &ray, double tmax)
+{
+  double tmin = 0.0;
+  for(int k = 0; k < 3; k++)
+    {
+      // a ray parallel to the slab is either always or never inside it
+      if(!ray.dir[k])
+	{
+	  if(ray.orig[k] < node.min[k] || ray.orig[k] > node.max[k])
+	    return -1.0;
+	  continue;
+	}
+      double t0 = (node.min[k] - ray.orig[k]) * ray.inv_dir[k],
+	t1 = (node.max[k] - ray.orig[k]) * ray.inv_dir[k];
+      if(t0 > t1)
+	{
+	  double tmp = t0;
+	  t0 = t1;
+	  t1 = tmp;
+	}
+      if(t0 > tmin) tmin = t0;
+      if(t1 < tmax) tmax = t1;
+      if(tmin > tmax) return -1.0;
+    }
+  return tmin;
+}
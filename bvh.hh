@@ -0,0 +1,110 @@
+#ifndef _BVH_HH
+#define _BVH_HH 1
+
+#include "point.hh"
+
+// ray prepared for box traversal
+struct bvhRay
+{
+  double orig[3], dir[3], inv_dir[3];
+};
+
+struct bvhNode
+{
+  double min[3], max[3];
+  // for interior nodes, index of the left child (the right child
+  // immediately follows it); for leaves, index of the first primitive
+  int offset;
+  int count; // number of primitives in a leaf, 0 for interior nodes
+};
+
+class ray_packet;
+
+// interface for objects whose primitives are stored in a bvh
+class bvh_client
+{
+public:
+  virtual ~bvh_client() {}
+  // intersect ray with primitive prim, returning the ray parameter of
+  // the intersection or -1 if there is none nearer than tmax.  data
+  // is passed through untouched from bvh::intersect.
+  virtual double intersect_primitive(int prim, const bvhRay &ray,
+				     double tmax, void *data) const = 0;
+  // intersect rays [first,last) of a packet with primitive prim,
+  // keeping the nearest hit of each.  By default the rays are passed
+  // to intersect_primitive one at a time.
+  virtual void intersect_packet(int prim, ray_packet &packet, int first,
+				int last, void *data) const;
+};
+
+// bounding volume hierarchy built with the surface area heuristic
+class bvh
+{
+public:
+  bvh();
+  ~bvh();
+  // build over n primitives with the given bounding boxes.  A
+  // refittable tree keeps a copy of the boxes so that they can be
+  // updated one at a time.
+  void build(int n, const double (*min)[3], const double (*max)[3],
+	     int refittable = 0);
+  // rebuild a refittable tree from its current boxes
+  void rebuild();
+  // change the box of one primitive in a refittable tree, refitting
+  // only the nodes above it
+  void update(int prim, const double *min, const double *max);
+  // ratio of the tree's current SAH cost to its cost when built
+  double degradation() const;
+  // find the nearest primitive hit by ray, returning its ray
+  // parameter or -1 if nothing is hit
+  double intersect(const bvh_client *client, const bvhRay &ray,
+		   void *data) const;
+  // return 1 as soon as any primitive is found nearer than tmax, or 0
+  // if there are none
+  int occluded(const bvh_client *client, const bvhRay &ray, double tmax,
+	       void *data) const;
+  // use nodes and indices owned by someone else (e.g., a mapped
+  // cache file) in place of building
+  void attach(bvhNode *nodes, int num_nodes, int *indices, int num_prims);
+  // whether nodes and indices from outside (e.g., a cache file) form
+  // a tree over faces primitives which is safe to traverse: children
+  // follow their parents, leaves and indices are in range, and it's no
+  // deeper than a built tree can be
+  static int valid(const bvhNode *nodes, int num_nodes, const int *indices,
+		   int num_prims, int faces);
+  int size() const;
+  const bvhNode *get_nodes() const;
+  const int *get_indices() const;
+  int get_num_prims() const;
+  // primitive index stored at position i of the leaf list
+  int primitive(int i) const;
+  // convert a ray to traversal form
+  static void make_ray(bvhRay &ray, const point &orig, const point &dir);
+  // intersect ray with a node's box, returning the entry distance or
+  // -1 if it misses the interval [0,tmax]
+  static double intersect_box(const bvhNode &node, const bvhRay &ray,
+			      double tmax);
+protected:
+  bvhNode *nodes;
+  int num_nodes;
+  int *indices; // primitive indices, in leaf order
+  int num_prims;
+  int attached; // nodes and indices are not ours to free
+  // refitting state: the box of each primitive, the parent of each
+  // node, the leaf holding each primitive, and the unnormalized SAH
+  // cost (the sum of each node's area times its cost)
+  double (*prim_min)[3], (*prim_max)[3];
+  int *parent;
+  int *leaf;
+  double area_cost, built_cost;
+  // area of a node weighted by the cost of visiting it
+  double node_cost(int node) const;
+  // build a subtree over indices[first..first+count) into node, which
+  // lies depth levels below the root
+  void build_node(int node, int first, int count, int depth,
+		  const double (*min)[3], const double (*max)[3],
+		  const double (*centroid)[3]);
+  void deinit();
+};
+
+#endif /* _BVH_HH */
@@ -0,0 +1,18 @@
+#include <stdio.h>
+
+#include "convert.hh"
+
+int main(int argc, char* argv[])
+{
+  if(argc != 3)
+    {
+      printf("usage: %s MESH.obj MESH.rtm\n"
+	     "  convert a mesh to the binary format, which scenes may name\n"
+	     "  in place of the OBJ file\n", argv[0]);
+      return 1;
+    }
+  mesh m;
+  if(m.load(argv[1]) || m.save(argv[2])) return 1;
+  printf("wrote %s\n", argv[2]);
+  return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef _CONVERT_HH
+#define _CONVERT_HH 1
+
+#include "mesh.hh"
+
+// Here's the main
+int main(int argc, char* argv[]);
+
+#endif /* _CONVERT_HH */
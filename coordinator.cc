@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/time.h>
+#include "coordinator.hh"
+#include "accel_cache.hh"
+#include "net.hh"
+
+// wall clock time in seconds
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+// read a whole file into memory, returning 0 if it can't be read
+static char *read_file(const char *path, size_t &size)
+{
+  FILE *fp = fopen(path, "rb");
+  if(!fp)
+    {
+      printf("read_file(): Cannot open %s!\n", path);
+      return 0;
+    }
+  fseek(fp, 0, SEEK_END);
+  long len = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char *data = len < 0 ? 0 : (char *)malloc(len + 1);
+  if(!data || fread(data, 1, len, fp) != (size_t)len)
+    {
+      printf("read_file(): Cannot read %s!\n", path);
+      free(data);
+      fclose(fp);
+      return 0;
+    }
+  fclose(fp);
+  data[len] = 0;
+  size = len;
+  return data;
+}
+
+// ############################## coordinator ##############################
+coordinator::coordinator()
+{
+  max_workers = 4;
+  workers = new workerLink[max_workers];
+  num_workers = 0;
+  files = 0;
+  num_files = 0;
+  rays = 0;
+  num_bands = 0;
+  copies = 0;
+  done = 0;
+}
+
+coordinator::~coordinator()
+{
+  for(int i = 0; i < num_workers; i++)
+    if(workers[i].fd != -1) close(workers[i].fd);
+  delete[] workers;
+  free_files();
+  delete[] copies;
+  delete[] done;
+}
+
+int coordinator::add_worker(const char *address)
+{
+  const char *colon = strrchr(address, ':');
+  if(!colon || colon == address || colon - address >= 256
+     || atoi(colon + 1) <= 0)
+    return -1;
+  if(num_workers == max_workers)
+    {
+      workerLink *grown = new workerLink[2 * max_workers];
+      memcpy(grown, workers, num_workers * sizeof(*workers));
+      delete[] workers;
+      workers = grown;
+      max_workers *= 2;
+    }
+  workerLink &w = workers[num_workers++];
+  memcpy(w.host, address, colon - address);
+  w.host[colon - address] = 0;
+  w.port = atoi(colon + 1);
+  w.fd = -1;
+  w.ready = 0;
+  w.band = -1;
+  w.started = 0;
+  return 0;
+}
+
+long long coordinator::get_rays() const
+{
+  return rays;
+}
+
+int coordinator::num_alive() const
+{
+  int n = 0;
+  for(int i = 0; i < num_workers; i++)
+    if(workers[i].fd != -1) n++;
+  return n;
+}
+
+void coordinator::free_files()
+{
+  for(int i = 0; i < num_files; i++)
+    free(files[i].data);
+  delete[] files;
+  files = 0;
+  num_files = 0;
+}
+
+int coordinator::add_file(char *data, size_t size, const char *ext)
+{
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx%s",
+	   accel_cache::hash_bytes(data, size), ext);
+  for(int i = 0; i < num_files; i++)
+    if(files[i].data && !strcmp(files[i].name, name))
+      {
+	free(data);
+	return i;
+      }
+  strcpy(files[num_files].name, name);
+  files[num_files].data = data;
+  files[num_files].size = size;
+  return num_files++;
+}
+
+int coordinator::bundle(const char *path)
+{
+  free_files();
+  size_t size;
+  char *rtl = read_file(path, size);
+  if(!rtl) return -1;
+  int lines = 1;
+  for(size_t i = 0; i < size; i++)
+    if(rtl[i] == '\n') lines++;
+  // at most a mesh per line, and the scene itself
+  files = new sceneFile[lines + 2];
+  files[0].data = 0;
+  num_files = 1;
+  // each line's mesh name may grow to a hash and an extension
+  char *out = (char *)malloc(size + lines * sizeof(files[0].name) + 1),
+    *q = out;
+  for(char *p = rtl; *p;)
+    {
+      char *end = p + strcspn(p, "\n");
+      char *s = p + strspn(p, " \t\r");
+      if(*s == 'M' && (s[1] == ' ' || s[1] == '\t'))
+	{
+	  // "M file ...": swap the file for the name it is sent under
+	  char *name = s + 1 + strspn(s + 1, " \t");
+	  int len = strcspn(name, " \t\r\n");
+	  char mesh[255], ext[10] = "";
+	  if(len >= (int)sizeof(mesh))
+	    {
+	      printf("coordinator::bundle(): Mesh name too long in %s!\n",
+		     path);
+	      free(rtl);
+	      free(out);
+	      return -1;
+	    }
+	  memcpy(mesh, name, len);
+	  mesh[len] = 0;
+	  // keep the extension, which says how to read the mesh
+	  const char *dot = strrchr(mesh, '.');
+	  if(dot && dot[1] && !strchr(dot, '/')
+	     && strlen(dot) < sizeof(ext))
+	    {
+	      for(int i = 0; dot[i]; i++)
+		ext[i] = dot[i] >= 'A' && dot[i] <= 'Z' ? dot[i] - 'A' + 'a'
+		  : dot[i];
+	      ext[strlen(dot)] = 0;
+	      for(int i = 1; ext[i]; i++)
+		if(!(ext[i] >= 'a' && ext[i] <= 'z')
+		   && !(ext[i] >= '0' && ext[i] <= '9'))
+		  ext[0] = 0;
+	    }
+	  size_t mesh_size;
+	  char *data = read_file(mesh, mesh_size);
+	  if(!data)
+	    {
+	      free(rtl);
+	      free(out);
+	      return -1;
+	    }
+	  int f = add_file(data, mesh_size, ext);
+	  memcpy(q, p, name - p);
+	  q += name - p;
+	  q += sprintf(q, "%s", files[f].name);
+	  p = name + len;
+	}
+      memcpy(q, p, end - p);
+      q += end - p;
+      if(*end) *q++ = *end++;
+      p = end;
+    }
+  free(rtl);
+  // the scene's name hashes the meshes' too, as it names them by hash
+  int f = add_file(out, q - out, ".rtl");
+  files[0] = files[f];
+  files[f] = files[--num_files];
+  return 0;
+}
+
+int coordinator::start(workerLink &w, const char *job)
+{
+  w.ready = 0;
+  w.band = -1;
+  w.fd = connect_tcp(w.host, w.port);
+  if(w.fd == -1) return -1;
+  if(set_timeout(w.fd, WORKER_TIMEOUT)) return -1;
+  char line[128];
+  for(int i = 0; i < num_files; i++)
+    {
+      snprintf(line, sizeof(line), "FILE %s %llu\n", files[i].name,
+	       (unsigned long long)files[i].size);
+      if(write_all(w.fd, line, strlen(line))
+	 || read_line(w.fd, line, sizeof(line)) <= 0)
+	return -1;
+      if(!strcmp(line, "NEED\n"))
+	{
+	  printf("Sending %s to %s:%d\n", files[i].name, w.host, w.port);
+	  if(write_all(w.fd, files[i].data, files[i].size)
+	     || read_line(w.fd, line, sizeof(line)) <= 0)
+	    return -1;
+	}
+      if(strcmp(line, "HAVE\n"))
+	{
+	  printf("coordinator::start(): %s:%d: %s", w.host, w.port, line);
+	  return -1;
+	}
+    }
+  return write_all(w.fd, job, strlen(job));
+}
+
+void coordinator::drop(workerLink &w, const char *why)
+{
+  printf("Dropping worker %s:%d (%s)", w.host, w.port, why);
+  if(w.band != -1)
+    {
+      printf(", handing band %d to others", w.band);
+      copies[w.band]--;
+    }
+  printf("\n");
+  if(w.fd != -1) close(w.fd);
+  w.fd = -1;
+  w.band = -1;
+}
+
+int coordinator::next_band(double time) const
+{
+  for(int b = 0; b < num_bands; b++)
+    if(!done[b] && !copies[b]) return b;
+  // all are handed out, so help with the band most overdue
+  double limit = bands_timed ? STRAGGLE_FACTOR * band_seconds / bands_timed
+    : 0;
+  if(limit < STRAGGLE_MIN) limit = STRAGGLE_MIN;
+  int band = -1;
+  double late = limit;
+  for(int i = 0; i < num_workers; i++)
+    {
+      const workerLink &w = workers[i];
+      if(w.fd != -1 && w.band != -1 && !done[w.band] && copies[w.band] == 1
+	 && time - w.started > late)
+	{
+	  band = w.band;
+	  late = time - w.started;
+	}
+    }
+  return band;
+}
+
+int coordinator::receive(workerLink &w, FrameBuffer *fb)
+{
+  char line[128];
+  if(read_line(w.fd, line, sizeof(line)) <= 0) return -1;
+  if(!w.ready)
+    {
+      if(strcmp(line, "READY\n"))
+	{
+	  printf("coordinator::receive(): %s:%d: %s", w.host, w.port, line);
+	  return -1;
+	}
+      w.ready = 1;
+      return 0;
+    }
+  int y0, y1, width = fb->GetWidth();
+  double seconds;
+  long long n;
+  if(w.band == -1 || sscanf(line, "DONE %d %d %lf %lld", &y0, &y1, &seconds,
+			    &n) != 4
+     || y0 != w.band * TILE_SIZE || y1 <= y0 || y1 > fb->GetHeight())
+    {
+      printf("coordinator::receive(): %s:%d: %s", w.host, w.port, line);
+      return -1;
+    }
+  float *rows = new float[(size_t)3 * width * (y1 - y0)];
+  if(read_all(w.fd, rows, (size_t)3 * width * (y1 - y0) * sizeof(float)))
+    {
+      delete[] rows;
+      return -1;
+    }
+  int b = w.band;
+  w.band = -1;
+  copies[b]--;
+  // another worker may have beaten it to the band
+  if(!done[b])
+    {
+      const float *p = rows;
+      for(int y = y0; y < y1; y++)
+	for(int x = 0; x < width; x++, p += 3)
+	  fb->SetPixel(x, y, Color(p[0], p[1], p[2]));
+      done[b] = 1;
+      band_seconds += now() - w.started;
+      bands_timed++;
+      rays += n;
+    }
+  delete[] rows;
+  return 0;
+}
+
+int coordinator::render(const renderJob &job, FrameBuffer *fb,
+			renderer &rend)
+{
+  if(bundle(job.scene)) return -1;
+  renderJob remote = job;
+  strcpy(remote.scene, files[0].name);
+  char line[JOB_LINE + 4] = "JOB ";
+  format_job(remote, line + 4);
+
+  delete[] copies;
+  delete[] done;
+  num_bands = (job.height + TILE_SIZE - 1) / TILE_SIZE;
+  copies = new int[num_bands];
+  done = new char[num_bands];
+  memset(copies, 0, num_bands * sizeof(*copies));
+  memset(done, 0, num_bands);
+  band_seconds = 0;
+  bands_timed = 0;
+  rays = 0;
+  for(int i = 0; i < num_workers; i++)
+    {
+      if(workers[i].fd != -1) close(workers[i].fd);
+      if(start(workers[i], line)) drop(workers[i], "cannot start");
+    }
+
+  // hand out bands until all are done or no worker is left
+  pollfd *fds = new pollfd[num_workers];
+  int *polled = new int[num_workers];
+  for(;;)
+    {
+      int left = 0;
+      for(int b = 0; b < num_bands; b++)
+	if(!done[b]) left++;
+      if(!left) break;
+      double time = now();
+      int n = 0;
+      for(int i = 0; i < num_workers; i++)
+	{
+	  workerLink &w = workers[i];
+	  if(w.fd == -1) continue;
+	  int b;
+	  if(w.ready && w.band == -1 && (b = next_band(time)) != -1)
+	    {
+	      char band[64];
+	      int y1 = (b + 1) * TILE_SIZE;
+	      snprintf(band, sizeof(band), "BAND %d %d\n", b * TILE_SIZE,
+		       y1 < job.height ? y1 : job.height);
+	      if(write_all(w.fd, band, strlen(band)))
+		{
+		  drop(w, "cannot send");
+		  continue;
+		}
+	      w.band = b;
+	      w.started = time;
+	      copies[b]++;
+	    }
+	  fds[n].fd = w.fd;
+	  fds[n].events = POLLIN;
+	  polled[n++] = i;
+	}
+      if(!n) break;
+      if(poll(fds, n, 100) == -1 && errno != EINTR)
+	{
+	  printf("coordinator::render(): %s\n", strerror(errno));
+	  break;
+	}
+      for(int k = 0; k < n; k++)
+	if(fds[k].revents && receive(workers[polled[k]], fb))
+	  drop(workers[polled[k]], "lost");
+    }
+  delete[] fds;
+  delete[] polled;
+
+  // render locally what no worker could
+  int left = 0;
+  for(int b = 0; b < num_bands; b++)
+    if(!done[b]) left++;
+  if(left)
+    {
+      printf("Rendering %d bands locally\n", left);
+      scene scn;
+      if(scn.load(job.scene)) return -1;
+      scn.sync_tree();
+      apply_job(job, rend);
+      rend.reset_rays();
+      for(int b = 0; b < num_bands; b++)
+	if(!done[b])
+	  rend.render_rows(&scn, fb, b * TILE_SIZE, (b + 1) * TILE_SIZE);
+      rays += rend.get_rays();
+    }
+  // workers still rendering copies of bands find out when they answer
+  for(int i = 0; i < num_workers; i++)
+    if(workers[i].fd != -1 && workers[i].band != -1)
+      {
+	close(workers[i].fd);
+	workers[i].fd = -1;
+      }
+  return 0;
+}
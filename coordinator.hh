@@ -0,0 +1,84 @@
+#ifndef _COORDINATOR_HH
+#define _COORDINATOR_HH 1
+
+#include "job_queue.hh"
+
+// seconds a band may take, as a multiple of the mean so far and at
+// least the minimum, before an idle worker renders it too
+#define STRAGGLE_FACTOR 4.0
+#define STRAGGLE_MIN 0.5
+// seconds a blocked read or write of a worker may take before the
+// worker is given up on
+#define WORKER_TIMEOUT 60.0
+
+// a file of the scene shipped to workers
+struct sceneFile
+{
+  char name[32]; // hash of the contents in hex, and the extension
+  char *data;
+  size_t size;
+};
+
+// a worker process and what it is rendering
+struct workerLink
+{
+  char host[256];
+  int port;
+  int fd; // -1 once given up on
+  int ready; // whether it has loaded the scene
+  int band; // being rendered, or -1 if none
+  double started; // when the band was sent
+};
+
+// Renders frames on worker processes (see render_worker) over TCP.
+// The scene and its meshes are sent to workers lacking them, under
+// names hashed from their contents, and the frame is split into bands
+// of tile rows handed to workers as they become free.  Bands of workers
+// which fail are handed to others, as are bands a worker takes much
+// longer than usual on (the first to finish wins), and any left when
+// no worker remains are rendered locally.
+class coordinator
+{
+public:
+  coordinator();
+  ~coordinator();
+  // add the worker at "host:port", returning -1 if malformed
+  int add_worker(const char *address);
+  // render job into fb, of the job's size, on the workers, or on rend
+  // where they fail, returning -1 if the scene can't be read
+  int render(const renderJob &job, FrameBuffer *fb, renderer &rend);
+  // primary rays traced for the last frame
+  long long get_rays() const;
+  // workers still working at the end of the last frame
+  int num_alive() const;
+protected:
+  workerLink *workers;
+  int num_workers, max_workers;
+  sceneFile *files; // the scene first, then its meshes
+  int num_files;
+  long long rays;
+  // bands of the frame: how many workers are rendering each, and
+  // which are done
+  int num_bands, *copies;
+  char *done;
+  double band_seconds; // total time of finished bands
+  int bands_timed;
+  // read the scene at path and the meshes it names into files, with
+  // the scene rewritten to name the meshes by their hashes
+  int bundle(const char *path);
+  void free_files();
+  // add a file of the given contents, unless it is there already,
+  // and return its index
+  int add_file(char *data, size_t size, const char *ext);
+  // connect to worker w, send it what it lacks of the scene, and start
+  // it loading job
+  int start(workerLink &w, const char *job);
+  // give up on worker w, handing its band back
+  void drop(workerLink &w, const char *why);
+  // choose a band for an idle worker, or return -1 if there is none
+  int next_band(double time) const;
+  // read a reply from worker w into fb
+  int receive(workerLink &w, FrameBuffer *fb);
+};
+
+#endif /* _COORDINATOR_HH */
@@ -1,6 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <emmintrin.h>
+#define GL_GLEXT_PROTOTYPES
 #include <GL/gl.h>
+#include <GL/glext.h>
 
 #include "frame_buffer.hh"
 
@@ -107,38 +112,99 @@ Pixel::Pixel(Color cc, double depth)
 }
 
 /* ########################## FrameBuffer ######################### */
-FrameBuffer::FrameBuffer(int x_dimension, int y_dimension)
+// allocate n bytes on a 64-byte boundary, or exit
+static void *alloc_aligned(size_t n)
 {
-  storage_array = new Pixel[x_dimension * y_dimension];
-  buffer = new Pixel *[x_dimension];
-
-  for(int n = 0; n < x_dimension; ++n)
-    buffer[n] = &storage_array[n * x_dimension];
+  void *p;
+  if(posix_memalign(&p, 64, n ? n : 64))
+    {
+      printf("FrameBuffer: Cannot allocate %lu bytes!\n", (unsigned long)n);
+      exit(-1);
+    }
+  return p;
+}
 
+FrameBuffer::FrameBuffer(int x_dimension, int y_dimension)
+{
   x_res = x_dimension;
   y_res = y_dimension;
-
+  channels = display = 0;
+  color = depth = normal = 0;
+  object = 0;
+  rays = 0;
+  alloc_channels();
+
+  texture = pbo[0] = pbo[1] = 0;
+  tex_width = tex_height = next_pbo = use_pbo = 0;
+  packed = 0;
+  set_gamma(1.0);
 }
 
+// GL objects are left to go with the context, which may be gone
 FrameBuffer::~FrameBuffer()
 {
-  delete [] buffer[0];
-  delete [] buffer;
+  free_channels();
+  delete [] packed;
 }
 
 void FrameBuffer::Resize(int x_dimension, int y_dimension)
 {
-  delete [] buffer[0];
-  delete [] buffer;
+  free_channels();
+  x_res = x_dimension;
+  y_res = y_dimension;
+  alloc_channels();
+}
 
-  storage_array = new Pixel[x_dimension * y_dimension];
-  buffer = new Pixel *[x_dimension];
+void FrameBuffer::alloc_channels()
+{
+  pitch = (x_res + 15) & ~15;
+  size_t n = (size_t)pitch * y_res;
+  color = (float *)alloc_aligned(4 * n * sizeof(float));
+  memset(color, 0, 4 * n * sizeof(float));
+  if(channels & FB_DEPTH)
+    {
+      depth = (float *)alloc_aligned(n * sizeof(float));
+      memset(depth, 0, n * sizeof(float));
+    }
+  if(channels & FB_NORMAL)
+    {
+      normal = (float *)alloc_aligned(3 * n * sizeof(float));
+      memset(normal, 0, 3 * n * sizeof(float));
+    }
+  if(channels & FB_OBJECT)
+    {
+      object = (int *)alloc_aligned(n * sizeof(int));
+      memset(object, 0xff, n * sizeof(int));
+    }
+  if(channels & FB_RAYS)
+    {
+      rays = (unsigned int *)alloc_aligned(n * sizeof(int));
+      memset(rays, 0, n * sizeof(int));
+    }
+}
 
-  for(int n = 0; n < x_dimension; ++n)
-    buffer[n] = &storage_array[n * x_dimension];
+void FrameBuffer::free_channels()
+{
+  free(color);
+  free(depth);
+  free(normal);
+  free(object);
+  free(rays);
+  color = depth = normal = 0;
+  object = 0;
+  rays = 0;
+}
 
-  x_res = x_dimension;
-  y_res = y_dimension;
+void FrameBuffer::SetChannels(int channels_)
+{
+  free_channels();
+  channels = channels_ & FB_CHANNELS;
+  alloc_channels();
+}
+
+int FrameBuffer::GetChannels() const
+{
+  return channels;
 }
 
 Pixel FrameBuffer::GetPixel(int x, int y)
@@ -148,7 +214,8 @@ Pixel FrameBuffer::GetPixel(int x, int y)
       printf("FrameBuffer::GetPixel(): array index out of bounds\n");
       exit(-1);
     }
-  return buffer[x][y];
+  const float *c = ColorAt(x, y);
+  return Pixel(Color(c[0], c[1], c[2]), depth ? depth[y * pitch + x] : 0);
 }
 
 void FrameBuffer::SetPixel(int x, int y, Color c)
@@ -159,11 +226,10 @@ void FrameBuffer::SetPixel(int x, int y, Color c)
       exit(-1);
     }
 
-  buffer[x][y].color = c;
-  buffer[x][y].z_value = 0;
+  plot(x, y, c);
 }
 
-void FrameBuffer::SetPixel(int x, int y, Color c, double depth)
+void FrameBuffer::SetPixel(int x, int y, Color c, double z)
 {
   if(x < 0 || x >= x_res || y < 0 || y >= y_res)
     {
@@ -171,8 +237,65 @@ void FrameBuffer::SetPixel(int x, int y, Color c, double depth)
       exit(-1);
     }
 
-  buffer[x][y].color = c;
-  buffer[x][y].z_value = depth;
+  plot(x, y, c);
+  if(depth) depth[y * pitch + x] = z;
+}
+
+pixelInfo FrameBuffer::GetInfo(int x, int y)
+{
+  if(x < 0 || x >= x_res || y < 0 || y >= y_res)
+    {
+      printf("FrameBuffer::GetInfo(): array index out of bounds\n");
+      exit(-1);
+    }
+  pixelInfo info;
+  int i = y * pitch + x;
+  info.depth = depth ? depth[i] : 0;
+  for(int k = 0; k < 3; k++)
+    info.normal[k] = normal ? normal[3 * i + k] : 0;
+  info.object = object ? object[i] : -1;
+  info.rays = rays ? rays[i] : 0;
+  return info;
+}
+
+void FrameBuffer::SetInfo(int x, int y, const pixelInfo &info)
+{
+  if(x < 0 || x >= x_res || y < 0 || y >= y_res)
+    {
+      printf("FrameBuffer::SetInfo(): array index out of bounds\n");
+      exit(-1);
+    }
+  int i = y * pitch + x;
+  if(depth) depth[i] = info.depth;
+  if(normal)
+    for(int k = 0; k < 3; k++)
+      normal[3 * i + k] = info.normal[k];
+  if(object) object[i] = info.object;
+  if(rays) rays[i] = info.rays;
+}
+
+void FrameBuffer::FillRect(int x0, int y0, int x1, int y1, Color c,
+			   const pixelInfo *info)
+{
+  if(x0 < 0) x0 = 0;
+  if(y0 < 0) y0 = 0;
+  if(x1 > x_res) x1 = x_res;
+  if(y1 > y_res) y1 = y_res;
+  for(int y = y0; y < y1; y++)
+    for(int x = x0; x < x1; x++)
+      {
+	plot(x, y, c);
+	if(info) SetInfo(x, y, *info);
+      }
+}
+
+void FrameBuffer::plot(int x, int y, Color c)
+{
+  float *p = ColorAt(x, y);
+  p[0] = c.r;
+  p[1] = c.g;
+  p[2] = c.b;
+  p[3] = 1.0f;
 }
 
 int FrameBuffer::GetWidth()
@@ -213,48 +336,302 @@ void FrameBuffer::BresenhamLine(int x_1, int y_1, int x_2, int y_2, Color c)
   }
 }
 
-void FrameBuffer::render_buffer()
+void FrameBuffer::set_gamma(double gamma)
 {
-  double w = 10.0/GetWidth();
-  double h = 10.0/GetHeight();
+  for(int i = 0; i < GAMMA_TABLE; i++)
+    gamma_table[i] = (unsigned char)
+      (255.0 * pow(i / (GAMMA_TABLE - 1.0), 1.0 / gamma) + 0.5);
+}
 
-  Color cl;
+void FrameBuffer::set_display(int channel)
+{
+  display = channel;
+}
 
-  glMatrixMode(GL_PROJECTION);
-  glPushMatrix();
-  glLoadIdentity();
-  glOrtho(0,10, 0,10, -1,1);
+Color FrameBuffer::show_channel(int x, int y, double scale)
+{
+  pixelInfo info = GetInfo(x, y);
+  switch(display)
+    {
+    case FB_DEPTH:
+      // nearer is brighter, and misses are black
+      return info.depth > 0 ? Color(1,1,1) * (1.0 - info.depth * scale)
+	: Color();
+    case FB_NORMAL:
+      return Color(0.5 + 0.5 * info.normal[0], 0.5 + 0.5 * info.normal[1],
+		   0.5 + 0.5 * info.normal[2]);
+    case FB_OBJECT:
+      {
+	if(info.object < 0) return Color();
+	unsigned int h = (info.object + 1) * 2654435761u;
+	return Color((h >> 24) / 255.0, (h >> 16 & 255) / 255.0,
+		     (h >> 8 & 255) / 255.0);
+      }
+    case FB_RAYS:
+      return Color(1,1,1) * (info.rays * scale);
+    }
+  return Color();
+}
 
-  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+void FrameBuffer::pack_rgba(unsigned int *rgba)
+{
+  const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f),
+    scale = _mm_set1_ps(GAMMA_TABLE - 1.0f), half = _mm_set1_ps(0.5f);
+  int index[4] __attribute__((aligned(16)));
+  if(display & channels)
+    {
+      // scale depths and ray counts by the largest in the buffer
+      double max = 0;
+      for(int y = 0; y < y_res; y++)
+	for(int x = 0; x < x_res; x++)
+	  {
+	    double v = display == FB_DEPTH ? (depth ? depth[y * pitch + x] : 0)
+	      : display == FB_RAYS ? (rays ? rays[y * pitch + x] : 0) : 0;
+	    if(v > max) max = v;
+	  }
+      for(int y = 0; y < y_res; y++)
+	for(int x = 0; x < x_res; x++)
+	  {
+	    Color c = show_channel(x, y, max > 0 ? 1.0 / max : 0);
+	    *rgba++ = (int)(fmin(fmax(c.r, 0), 1) * 255 + 0.5)
+	      | (int)(fmin(fmax(c.g, 0), 1) * 255 + 0.5) << 8
+	      | (int)(fmin(fmax(c.b, 0), 1) * 255 + 0.5) << 16 | 0xff000000u;
+	  }
+      return;
+    }
+  for(int y = 0; y < y_res; y++)
+    {
+      const float *c = ColorAt(0, y);
+      for(int x = 0; x < x_res; x++, c += 4)
+	{
+	  // clamp r, g and b to [0,1] together and scale them to indices
+	  // of gamma_table
+	  __m128 v = _mm_min_ps(_mm_max_ps(_mm_load_ps(c), zero), one);
+	  _mm_store_si128((__m128i *)index,
+			  _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, scale),
+						      half)));
+	  *rgba++ = gamma_table[index[0]] | gamma_table[index[1]] << 8
+	    | gamma_table[index[2]] << 16 | 0xff000000u;
+	}
+    }
+}
 
-  glBegin(GL_QUADS);
+int FrameBuffer::WritePPM(const char *filename)
+{
+  FILE *fp = fopen(filename, "wb");
+  if(!fp)
+    {
+      printf("FrameBuffer::WritePPM(): Cannot open %s!\n", filename);
+      return -1;
+    }
+  unsigned int *rgba = new unsigned int[x_res * y_res];
+  unsigned char *row = new unsigned char[3 * x_res];
+  pack_rgba(rgba);
+  fprintf(fp, "P6\n%d %d\n255\n", x_res, y_res);
+  // PPM starts from the top row
+  int ret = 0;
+  for(int y = y_res - 1; y >= 0 && !ret; y--)
+    {
+      for(int x = 0; x < x_res; x++)
+	{
+	  unsigned int p = rgba[y * x_res + x];
+	  row[3 * x] = p & 0xff;
+	  row[3 * x + 1] = p >> 8 & 0xff;
+	  row[3 * x + 2] = p >> 16 & 0xff;
+	}
+      if(fwrite(row, 3, x_res, fp) != (size_t)x_res) ret = -1;
+    }
+  delete [] rgba;
+  delete [] row;
+  if(fclose(fp) || ret)
+    {
+      printf("FrameBuffer::WritePPM(): Cannot write %s!\n", filename);
+      return -1;
+    }
+  return 0;
+}
+
+int FrameBuffer::WritePFM(const char *filename, int channel)
+{
+  if(channel && !(channel & channels))
+    {
+      printf("FrameBuffer::WritePFM(): No such channel %d!\n", channel);
+      return -1;
+    }
+  FILE *fp = fopen(filename, "wb");
+  if(!fp)
+    {
+      printf("FrameBuffer::WritePFM(): Cannot open %s!\n", filename);
+      return -1;
+    }
+  int ret = WritePFM(fp, channel);
+  if(fclose(fp) || ret)
+    {
+      printf("FrameBuffer::WritePFM(): Cannot write %s!\n", filename);
+      return -1;
+    }
+  return 0;
+}
+
+int FrameBuffer::WritePFM(FILE *fp, int channel)
+{
+  if(channel && !(channel & channels)) return -1;
+  int n = !channel || channel == FB_NORMAL ? 3 : 1, ret = 0;
+  float *row = new float[n * x_res];
+  // PFM starts from the bottom row, and a negative scale means the
+  // floats are little-endian
+  const unsigned int one = 1;
+  fprintf(fp, "%s\n%d %d\n%s\n", n == 3 ? "PF" : "Pf", x_res, y_res,
+	  *(const unsigned char *)&one ? "-1.0" : "1.0");
+  for(int y = 0; y < y_res && !ret; y++)
+    {
+      int i = y * pitch;
+      for(int x = 0; x < x_res; x++, i++)
+	switch(channel)
+	  {
+	  case FB_DEPTH: row[x] = depth[i]; break;
+	  case FB_NORMAL: memcpy(row + 3 * x, normal + 3 * i, 12); break;
+	  case FB_OBJECT: row[x] = object[i]; break;
+	  case FB_RAYS: row[x] = rays[i]; break;
+	  default: memcpy(row + 3 * x, color + 4 * i, 12); break;
+	  }
+      if(fwrite(row, sizeof(float) * n, x_res, fp) != (size_t)x_res)
+	ret = -1;
+    }
+  delete [] row;
+  return ret;
+}
 
-  printf("width %d, height %d\n", GetWidth(), GetHeight());
+int FrameBuffer::ReadPFM(FILE *fp)
+{
+  char type[3];
+  int w, h;
+  double scale;
+  if(fscanf(fp, "%2s %d %d %lf", type, &w, &h, &scale) != 4
+     || strcmp(type, "PF") || w < 1 || h < 1 || fgetc(fp) != '\n')
+    {
+      printf("FrameBuffer::ReadPFM(): Not a color PFM!\n");
+      return -1;
+    }
+  const unsigned int one = 1;
+  if((scale < 0) != (*(const unsigned char *)&one != 0))
+    {
+      printf("FrameBuffer::ReadPFM(): Byte order differs!\n");
+      return -1;
+    }
+  if(w != x_res || h != y_res) Resize(w, h);
+  float *row = new float[3 * w];
+  int ret = 0;
+  for(int y = 0; y < h && !ret; y++)
+    {
+      if(fread(row, 3 * sizeof(float), w, fp) != (size_t)w)
+	{
+	  printf("FrameBuffer::ReadPFM(): Image is cut short!\n");
+	  ret = -1;
+	}
+      else
+	for(int x = 0; x < w; x++)
+	  plot(x, y, Color(row[3 * x], row[3 * x + 1], row[3 * x + 2]));
+    }
+  delete [] row;
+  return ret;
+}
+
+void FrameBuffer::init_texture()
+{
+  if(!texture)
+    {
+      glGenTextures(1, &texture);
+      glBindTexture(GL_TEXTURE_2D, texture);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      // pixel buffers are core from GL 2.1
+      const char *version = (const char *)glGetString(GL_VERSION),
+	*ext = (const char *)glGetString(GL_EXTENSIONS);
+      use_pbo = (version && atof(version) >= 2.1)
+	|| (ext && strstr(ext, "GL_ARB_pixel_buffer_object"));
+      if(use_pbo) glGenBuffers(2, pbo);
+    }
+  if(tex_width == x_res && tex_height == y_res) return;
+  // (re)allocate storage for the current size
+  tex_width = x_res;
+  tex_height = y_res;
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, x_res, y_res, 0, GL_RGBA,
+	       GL_UNSIGNED_BYTE, 0);
+  if(use_pbo)
+    for(int i = 0; i < 2; i++)
+      {
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[i]);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, 4 * x_res * y_res, 0,
+		     GL_STREAM_DRAW);
+      }
+  else
+    {
+      delete [] packed;
+      packed = new unsigned int[x_res * y_res];
+    }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
 
-  for(int y = 0; y < GetHeight(); y++)
+void FrameBuffer::render_buffer()
+{
+  init_texture();
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  if(use_pbo)
     {
-      for(int x = 0; x < GetHeight(); x++)
+      // fill one buffer while the other may still be feeding the
+      // previous frame's upload, which then proceeds without the CPU
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[next_pbo]);
+      glBufferData(GL_PIXEL_UNPACK_BUFFER, 4 * x_res * y_res, 0,
+		   GL_STREAM_DRAW);
+      unsigned int *rgba =
+	(unsigned int *)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+      if(rgba)
 	{
-	  cl = buffer[x][y].color;
-	  glColor3d(cl.r, cl.g, cl.b);
-	  drawRect(w*x, h*y, w, h);
+	  pack_rgba(rgba);
+	  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, x_res, y_res, GL_RGBA,
+			  GL_UNSIGNED_BYTE, 0);
 	}
+      else printf("FrameBuffer::render_buffer(): Cannot map buffer!\n");
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      next_pbo = !next_pbo;
+    }
+  else
+    {
+      pack_rgba(packed);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, x_res, y_res, GL_RGBA,
+		      GL_UNSIGNED_BYTE, packed);
     }
 
+  glMatrixMode(GL_PROJECTION);
+  glPushMatrix();
+  glLoadIdentity();
+  glOrtho(0,1, 0,1, -1,1);
+
+  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+  glEnable(GL_TEXTURE_2D);
+  glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+  glBegin(GL_QUADS);
+  glTexCoord2d(0,0);
+  glVertex2d(0,0);
+  glTexCoord2d(1,0);
+  glVertex2d(1,0);
+  glTexCoord2d(1,1);
+  glVertex2d(1,1);
+  glTexCoord2d(0,1);
+  glVertex2d(0,1);
   glEnd();
+  glDisable(GL_TEXTURE_2D);
 
   glPopMatrix();
   glMatrixMode(GL_MODELVIEW);
 }
 
-void FrameBuffer::drawRect(double x, double y, double w, double h)
-{
-  glVertex2d(x,y);
-  glVertex2d(x+w,y);
-  glVertex2d(x+w,y+h);
-  glVertex2d(x, y+h);
-}
-
 void FrameBuffer::linePosSteep(int x_1, int y_1, int x_2, int y_2, Color c)
 {
   int dx, dy, p, twodx, twodxdy, x, y, yend;
@@ -278,7 +655,7 @@ void FrameBuffer::linePosSteep(int x_1, int y_1, int x_2, int y_2, Color c)
 	y = y_2;
       }
       for (; y <= yend; y++)
-	buffer[x_1][y] = c;
+	plot(x_1, y, c);
     }
   if (x_1 > x_2) {
     x = x_2;
@@ -292,7 +669,7 @@ void FrameBuffer::linePosSteep(int x_1, int y_1, int x_2, int y_2, Color c)
   }
   if (x_1 != x_2)
     {
-      buffer[x_1][y_1] = c;
+      plot(x_1, y_1, c);
       while (y < yend) {
 	y++;
 	if (p < 0)
@@ -301,7 +678,7 @@ void FrameBuffer::linePosSteep(int x_1, int y_1, int x_2, int y_2, Color c)
 	  x++;
 	  p += twodxdy;
 	}
-	buffer[x][y] = c;
+	plot(x, y, c);
       }
     }
 }
@@ -325,7 +702,7 @@ void FrameBuffer::linePosShallow(int x_1, int y_1, int x_2, int y_2, Color c)
     y = y_1;
     xend = x_2;
   }
-  buffer[x][y] = c;
+  plot(x, y, c);
 
   while (x < xend) {
     x++;
@@ -335,7 +712,7 @@ void FrameBuffer::linePosShallow(int x_1, int y_1, int x_2, int y_2, Color c)
       y++;
       p += twodydx;
     }
-    buffer[x][y] = c;
+    plot(x, y, c);
   }
 }
 
@@ -358,7 +735,7 @@ void FrameBuffer::lineNegShallow(int x_1, int y_1, int x_2, int y_2, Color c)
     y = y_1;
     xend = x_2;
   }
-  buffer[x][y] = c;
+  plot(x, y, c);
 
   while (x < xend) {
     x++;
@@ -368,7 +745,7 @@ void FrameBuffer::lineNegShallow(int x_1, int y_1, int x_2, int y_2, Color c)
       y--;
       p += twodydx;
     }
-    buffer[x][y] = c;
+    plot(x, y, c);
   }
 }
 
@@ -391,7 +768,7 @@ void FrameBuffer::lineNegSteep(int x_1, int y_1, int x_2, int y_2, Color c)
     y = y_1;
     yend = y_2;
   }
-  buffer[x][y] = c;
+  plot(x, y, c);
 
   while (y > yend) {
     y--;
@@ -401,6 +778,6 @@ void FrameBuffer::lineNegSteep(int x_1, int y_1, int x_2, int y_2, Color c)
       x++;
       p += twodxdy;
     }
-    buffer[x][y] = c;
+    plot(x, y, c);
   }
 }
@@ -1,6 +1,11 @@
 #ifndef _FRAME_BUFFER_HH
 #define _FRAME_BUFFER_HH
 
+#include <stdio.h>
+
+// entries of the table mapping clamped intensities to display values
+#define GAMMA_TABLE 4096
+
 class Color
 {
 public:
@@ -31,15 +36,31 @@ public:
   Pixel(Color cc, double depth);
 };
 
+// extra channels a FrameBuffer may hold besides color
+#define FB_DEPTH 0x1 /* distance to the first hit */
+#define FB_NORMAL 0x2 /* world normal at the first hit */
+#define FB_OBJECT 0x4 /* surface hit first, or -1 */
+#define FB_RAYS 0x8 /* rays traced for the pixel, secondary ones included */
+#define FB_CHANNELS 0xf
+
+// values of the extra channels at one pixel, as found by the tracer
+struct pixelInfo
+{
+  float depth;
+  float normal[3];
+  int object;
+  unsigned int rays;
+};
+
 class FrameBuffer
 {
 public:
-  Pixel **buffer;
   int x_res, y_res;
 
-  // pixels can be accessed as fb->buffer[x][y]
-  // or by fb->GetPixel(x,y) and fb->SetPixel(x,y)
-  // GetPixel and SetPixel are bounds-checked
+  // pixels can be accessed by fb->GetPixel(x,y) and fb->SetPixel(x,y),
+  // which are bounds-checked, or a row at a time from ColorAt(x,y).
+  // Every channel is stored row-major from the bottom row up, and
+  // rows start on 64-byte boundaries.
 
   FrameBuffer(int x_dimension, int y_dimension);
   ~FrameBuffer();
@@ -51,11 +72,61 @@ public:
   void SetPixel(int x, int y, Color c, double depth);
   int GetWidth();
   int GetHeight();
+  // choose the extra channels held (FB_* flags), clearing them
+  void SetChannels(int channels);
+  int GetChannels() const;
+  // get or set the extra channels held at a pixel
+  pixelInfo GetInfo(int x, int y);
+  void SetInfo(int x, int y, const pixelInfo &info);
+  // set the color and extra channels of [x0,x1) x [y0,y1), clipped to
+  // the buffer (info may be 0 to leave the extra channels alone)
+  void FillRect(int x0, int y0, int x1, int y1, Color c,
+		const pixelInfo *info);
+  // red, green, blue and an unused fourth float of pixel (x,y), which
+  // the rest of row y follows (unchecked)
+  float *ColorAt(int x, int y) { return color + 4 * (y * pitch + x); }
   void BresenhamLine(int x_1, int y_1, int x_2, int y_2, Color c);
+  // encode displayed intensities with the given gamma (1 by default,
+  // leaving them linear)
+  void set_gamma(double gamma);
+  // show the given extra channel in place of color (0 for color)
+  void set_display(int channel);
+  // pack the pixels into rgba, 8 bits to a channel, from the bottom
+  // row up
+  void pack_rgba(unsigned int *rgba);
+  // draw the buffer over the whole viewport as one textured quad
   void render_buffer();
+  // write the buffer as it would be displayed to a binary PPM file,
+  // returning -1 on failure
+  int WritePPM(const char *filename);
+  // write color, or an extra channel, as floats to a PFM file (three
+  // channels for color and normals, one for the others), returning -1
+  // on failure
+  int WritePFM(const char *filename, int channel = 0);
+  // write the same to an open stream (returning -1 without a message)
+  int WritePFM(FILE *fp, int channel = 0);
+  // read a color PFM from an open stream, resizing the buffer to fit
+  int ReadPFM(FILE *fp);
 protected:
-  Pixel *storage_array;
-  void drawRect(double x, double y, double w, double h);
+  int pitch; // pixels from one row to the next, a multiple of 16
+  int channels, display;
+  float *color, *depth, *normal;
+  int *object;
+  unsigned int *rays;
+  unsigned char gamma_table[GAMMA_TABLE];
+  // display texture and the pixel buffers uploads alternate between,
+  // created by the first render_buffer (texture is 0 until then)
+  unsigned int texture, pbo[2];
+  int tex_width, tex_height, next_pbo, use_pbo;
+  unsigned int *packed; // upload source when pixel buffers are missing
+  // allocate the channels for the current size, and free them
+  void alloc_channels();
+  void free_channels();
+  // map extra channel display of pixel (x,y) to a color, scaling
+  // depths and ray counts by scale
+  Color show_channel(int x, int y, double scale);
+  void init_texture();
+  void plot(int x, int y, Color c);
   void linePosSteep(int x_1, int y_1, int x_2, int y_2, Color c);
   void linePosShallow(int x_1, int y_1, int x_2, int y_2, Color c);
   void lineNegShallow(int x_1, int y_1, int x_2, int y_2, Color c);
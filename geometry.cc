@@ -0,0 +1,532 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include <GL/gl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "geometry.hh"
+#include "matrix.hh"
+#include "obj_reader.hh"
+#include "ray_packet.hh"
+
+// barycentric coordinates of the nearest face hit so far
+struct meshHit
+{
+  double u, v;
+  int face;
+};
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+// Pack a unit vector into 32 bits by projecting it onto the octahedron
+// |x|+|y|+|z| = 1, folding the lower half over the upper, and storing
+// x and y in 16 bits each, losing under 0.004 degrees.
+static uint32_t encode_normal(point n)
+{
+  double l = fabs(n[0]) + fabs(n[1]) + fabs(n[2]);
+  if(!(l > 0.0)) return 0; // (0,0,1), for lack of anything better
+  double x = n[0] / l, y = n[1] / l;
+  if(n[2] < 0.0)
+    {
+      double fx = (1.0 - fabs(y)) * (x >= 0.0 ? 1.0 : -1.0);
+      y = (1.0 - fabs(x)) * (y >= 0.0 ? 1.0 : -1.0);
+      x = fx;
+    }
+  int16_t ix = (int16_t)lrint(x * 32767.0), iy = (int16_t)lrint(y * 32767.0);
+  return (uint32_t)(uint16_t)ix | (uint32_t)(uint16_t)iy << 16;
+}
+
+static vector decode_normal(uint32_t e)
+{
+  double x = (int16_t)(e & 0xffff) / 32767.0,
+    y = (int16_t)(e >> 16) / 32767.0, z = 1.0 - fabs(x) - fabs(y);
+  if(z < 0.0)
+    {
+      double fx = (1.0 - fabs(y)) * (x >= 0.0 ? 1.0 : -1.0);
+      y = (1.0 - fabs(x)) * (y >= 0.0 ? 1.0 : -1.0);
+      x = fx;
+    }
+  vector n(x, y, z);
+  n.normalize();
+  return n;
+}
+
+geometry *geometry::loaded = 0;
+pthread_mutex_t geometry::lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t geometry::done = PTHREAD_COND_INITIALIZER;
+
+// ############################## geometry ##############################
+geometry::geometry()
+{
+  name = 0;
+  mtime = 0;
+  refs = 0;
+  ready = failed = 0;
+  next = 0;
+  verts = faces = 0;
+  coords = 0;
+  normList = 0;
+  faceList = 0;
+  triList = 0;
+  tree = 0;
+  wide[0] = wide[1] = 0;
+  cache = 0;
+  file = 0;
+  key = 0;
+}
+
+geometry::~geometry()
+{
+  // arrays of a mapped file go with it
+  if(file) delete file;
+  else
+    {
+      delete[] coords;
+      delete[] normList;
+      free(faceList);
+    }
+  free(triList);
+  delete tree;
+  delete wide[0];
+  delete wide[1];
+  delete cache;
+  free(name);
+}
+
+geometry *geometry::acquire(const char *filename, int width)
+{
+  struct stat st;
+  if(stat(filename, &st))
+    {
+      printf("geometry::acquire(): Cannot open %s!\n", filename);
+      return 0;
+    }
+  pthread_mutex_lock(&lock);
+  geometry *g;
+  for(g = loaded; g; g = g->next)
+    if(!strcmp(g->name, filename) && g->mtime == st.st_mtime && !g->failed)
+      break;
+  if(g)
+    {
+      // share it, once whoever is loading it has finished
+      g->refs++;
+      while(!g->ready)
+	pthread_cond_wait(&done, &lock);
+      pthread_mutex_unlock(&lock);
+      if(g->failed)
+	{
+	  release(g);
+	  return 0;
+	}
+      g->prepare(width);
+      return g;
+    }
+  g = new geometry();
+  g->name = strdup(filename);
+  g->mtime = st.st_mtime;
+  g->refs = 1;
+  g->next = loaded;
+  loaded = g;
+  pthread_mutex_unlock(&lock);
+
+  // load it without holding the lock, so that other files may load
+  // meanwhile
+  int ret = g->load(filename, width);
+  pthread_mutex_lock(&lock);
+  g->ready = 1;
+  g->failed = ret != 0;
+  pthread_cond_broadcast(&done);
+  pthread_mutex_unlock(&lock);
+  if(ret)
+    {
+      release(g);
+      return 0;
+    }
+  return g;
+}
+
+void geometry::release(geometry *g)
+{
+  if(!g) return;
+  pthread_mutex_lock(&lock);
+  if(--g->refs)
+    {
+      pthread_mutex_unlock(&lock);
+      return;
+    }
+  for(geometry **p = &loaded; *p; p = &(*p)->next)
+    if(*p == g)
+      {
+	*p = g->next;
+	break;
+      }
+  pthread_mutex_unlock(&lock);
+  delete g;
+}
+
+void geometry::prepare(int width)
+{
+  if(!tree || (width != 4 && width != 8) || get_wide(width)) return;
+  // build without holding the lock, which every acquire and release
+  // takes, and keep whichever hierarchy is published first
+  wide_bvh *w = build_wide(width);
+  pthread_mutex_lock(&lock);
+  if(!wide[width == 8])
+    {
+      // released, so that whoever reads it in get_wide sees it built
+      __atomic_store_n(&wide[width == 8], w, __ATOMIC_RELEASE);
+      w = 0;
+    }
+  pthread_mutex_unlock(&lock);
+  delete w;
+}
+
+const char *geometry::get_name() const
+{
+  return name;
+}
+
+int geometry::changed() const
+{
+  struct stat st;
+  return stat(name, &st) || st.st_mtime != mtime;
+}
+
+int geometry::get_verts() const
+{
+  return verts;
+}
+
+int geometry::get_faces() const
+{
+  return faces;
+}
+
+void geometry::bounds(point &min_, point &max_) const
+{
+  min_ = min;
+  max_ = max;
+}
+
+size_t geometry::memory(int print) const
+{
+  size_t vbytes = (size_t)verts * (3 * sizeof(float) + sizeof(uint32_t)),
+    fbytes = (size_t)faces * sizeof(faceStruct),
+    tbytes = (size_t)faces * sizeof(triRecord), hbytes = 0;
+  if(tree)
+    hbytes += (size_t)tree->size() * sizeof(bvhNode)
+      + (size_t)tree->get_num_prims() * sizeof(int);
+  for(int width = 4; width <= 8; width += 4)
+    {
+      const wide_bvh *w = get_wide(width);
+      if(w)
+	hbytes += (size_t)w->get_num_nodes() * wide_bvh::node_size(width)
+	  + (size_t)w->get_num_blocks() * wide_bvh::block_size(width);
+    }
+  if(print)
+    printf("%s: %.1f KB (vertices %.1f, faces %.1f, records %.1f, "
+	   "hierarchies %.1f)\n", name,
+	   (vbytes + fbytes + tbytes + hbytes) / 1024.0, vbytes / 1024.0,
+	   fbytes / 1024.0, tbytes / 1024.0, hbytes / 1024.0);
+  return vbytes + fbytes + tbytes + hbytes;
+}
+
+const wide_bvh *geometry::get_wide(int width) const
+{
+  // read without the lock, as on every ray, so acquired to pair with
+  // prepare publishing it
+  return width == 4 || width == 8
+    ? __atomic_load_n(&wide[width == 8], __ATOMIC_ACQUIRE) : 0;
+}
+
+point geometry::vertex(uint32_t i) const
+{
+  return point(coords[i], coords[verts + i], coords[2 * verts + i]);
+}
+
+void geometry::make_triangles()
+{
+  if(posix_memalign((void **)&triList, 64, sizeof(triRecord) * (faces + 1)))
+    {
+      printf("geometry::make_triangles(): Cannot allocate %d faces\n",
+	     faces);
+      exit(-1);
+    }
+  for(int i = 0; i < faces; i++)
+    {
+      const faceStruct &f = faceList[i];
+      double a[3], b[3], c[3];
+      for(int k = 0; k < 3; k++)
+	{
+	  a[k] = coords[k * verts + f.v1];
+	  b[k] = coords[k * verts + f.v2];
+	  c[k] = coords[k * verts + f.v3];
+	}
+      make_triangle(triList[i], a, b, c);
+    }
+}
+
+wide_bvh *geometry::build_wide(int width) const
+{
+  wide_bvh *w = new wide_bvh();
+  w->build(*tree, triList, width);
+  return w;
+}
+
+// The mesh reader itself, for Wavefront OBJ files (see obj_reader) or
+// binary mesh files (see mesh_file)
+// return 0 on success, -1 on failure
+int geometry::load(const char *filename, int width)
+{
+  double start = now();
+  if(mesh_file::is_mesh_file(filename) ? map_file(filename)
+     : read_obj(filename))
+    return -1;
+  make_triangles();
+  double read = now();
+  build_tree(width);
+
+  // one line at a time, as other files may be loading meanwhile
+  printf("%s: %d verts, %d faces, read in %.3f s, hierarchy in %.3f s\n",
+	 filename, verts, faces, read - start, now() - read);
+  memory(1);
+  return 0;
+}
+
+int geometry::save(const char *filename) const
+{
+  return mesh_file::save(filename, key, verts, faces, coords, normList,
+			 faceList, min, max);
+}
+
+int geometry::read_obj(const char *filename)
+{
+  int i;
+  point v;
+  obj_reader obj;
+
+  if(obj.read(filename)) return -1;
+  verts = obj.num_verts();
+  faces = obj.num_tris();
+
+  // Dynamic allocation of vertex and face lists
+  faceList = (faceStruct *)malloc(sizeof(faceStruct) * (faces + 1));
+  coords = new float[3 * verts];
+  normList = new uint32_t[verts];
+
+  // Copy the vertices and set min/max for bounding box
+  const double (*vert)[3] = obj.get_verts();
+  for(i = 0;i < verts;i++)
+    {
+      for(int k = 0; k < 3; k++)
+	coords[k * verts + i] = vert[i][k];
+      if(i == 0)
+	{
+	  min = max = point(vert[0][0], vert[0][1], vert[0][2]);
+	  continue;
+	}
+      if(vert[i][0] < min.get_X()) min.set_X(vert[i][0]);
+      else if (vert[i][0] > max.get_X()) max.set_X(vert[i][0]);
+      if(vert[i][1] < min.get_Y()) min.set_Y(vert[i][1]);
+      else if (vert[i][1] > max.get_Y()) max.set_Y(vert[i][1]);
+      if(vert[i][2] < min.get_Z()) min.set_Z(vert[i][2]);
+      else if (vert[i][2] > max.get_Z()) max.set_Z(vert[i][2]);
+    }
+
+  // Copy the faces, whose indices the reader has checked
+  const int (*tri)[3] = obj.get_tris();
+  for(i = 0;i < faces;i++)
+    {
+      faceList[i].v1 = tri[i][0];
+      faceList[i].v2 = tri[i][1];
+      faceList[i].v3 = tri[i][2];
+    }
+
+  // The part below calculates the normals of each vertex, at full
+  // precision until they are encoded
+  vector *norm = new vector[verts];
+  for(i = 0;i < faces;i++)
+    {
+      const double *a = vert[faceList[i].v1], *b = vert[faceList[i].v2],
+	*c = vert[faceList[i].v3];
+      // find a unit vector perpendicular to faceList[i]
+      v = matrix::cross(vector(b[0] - a[0], b[1] - a[1], b[2] - a[2]))
+	* vector(c[0] - b[0], c[1] - b[1], c[2] - b[2]);
+      v.normalize();
+      v = v * -1.0;
+
+      // add this unit vector to norm list for each vertex
+      norm[faceList[i].v1] += v;
+      norm[faceList[i].v2] += v;
+      norm[faceList[i].v3] += v;
+    }
+
+  // use the normals the file gives instead, where it gives any
+  const double (*given)[3] = obj.get_normals();
+  if(given)
+    for(i = 0;i < verts;i++)
+      if(given[i][0] || given[i][1] || given[i][2])
+	norm[i] = vector(given[i][0], given[i][1], given[i][2]);
+
+  // encoding normalizes them
+  for (i = 0;i < verts;i++)
+    normList[i] = encode_normal(norm[i]);
+  delete[] norm;
+
+  key = accel_cache::hash_file(filename);
+  return 0;
+}
+
+int geometry::map_file(const char *filename)
+{
+  file = new mesh_file();
+  if(file->open(filename))
+    {
+      delete file;
+      file = 0;
+      return -1;
+    }
+  // use the arrays where they are mapped
+  const meshHeader *h = file->header();
+  verts = h->verts;
+  faces = h->faces;
+  coords = file->get_coords();
+  normList = file->get_normals();
+  faceList = file->get_faces();
+  min = point(h->min[0], h->min[1], h->min[2]);
+  max = point(h->max[0], h->max[1], h->max[2]);
+  key = h->key;
+  return 0;
+}
+
+void geometry::build_tree(int width)
+{
+  if(width != 4 && width != 8) width = 0;
+  // reuse the structures built by an earlier run, if there are any
+  cache = new accel_cache();
+  tree = new bvh();
+  if(key && faces && !cache->open(key, width, faces))
+    {
+      if(width) wide[width == 8] = new wide_bvh();
+      cache->attach(*tree, wide[width == 8]);
+      return;
+    }
+  delete cache;
+  cache = 0;
+
+  // build the hierarchy over the bounds of each face
+  double (*fmin)[3] = new double[faces][3], (*fmax)[3] = new double[faces][3];
+  for(int i = 0;i < faces;i++)
+    {
+      uint32_t fv[3] = { faceList[i].v1, faceList[i].v2, faceList[i].v3 };
+      for(int k = 0; k < 3; k++)
+	{
+	  const float *c = coords + k * verts;
+	  fmin[i][k] = fmax[i][k] = c[fv[0]];
+	  for(int j = 1; j < 3; j++)
+	    {
+	      if(c[fv[j]] < fmin[i][k]) fmin[i][k] = c[fv[j]];
+	      if(c[fv[j]] > fmax[i][k]) fmax[i][k] = c[fv[j]];
+	    }
+	}
+    }
+  tree->build(faces, fmin, fmax);
+  delete[] fmin;
+  delete[] fmax;
+  if(width) wide[width == 8] = build_wide(width);
+  if(key && faces)
+    accel_cache::save(key, faces, *tree, width ? wide[width == 8] : 0);
+}
+
+double geometry::intersect(const bvhRay &ray, int width, int &face,
+			   double &u, double &v) const
+{
+  if(!tree) return -1.0;
+  const wide_bvh *w = get_wide(width);
+  if(w) return w->intersect(ray, TMIN, DBL_MAX, face, u, v);
+  meshHit hit;
+  double t = tree->intersect(this, ray, &hit);
+  face = hit.face;
+  u = hit.u;
+  v = hit.v;
+  return t;
+}
+
+int geometry::occluded(const bvhRay &ray, int width, double tmax) const
+{
+  if(!tree) return 0;
+  const wide_bvh *w = get_wide(width);
+  if(w) return w->occluded(ray, TMIN, tmax);
+  meshHit hit;
+  return tree->occluded(this, ray, tmax, &hit);
+}
+
+void geometry::intersect(ray_packet &packet) const
+{
+  if(tree) packet.intersect(*tree, this, 0);
+}
+
+void geometry::interpolate(int face, double u, double v, point &vertex,
+			   point &normal) const
+{
+  const faceStruct &f = faceList[face];
+  vertex = point::combine(this->vertex(f.v1), this->vertex(f.v2), u,
+			  this->vertex(f.v3), v);
+  normal = point::combine(decode_normal(normList[f.v1]),
+			  decode_normal(normList[f.v2]), u,
+			  decode_normal(normList[f.v3]), v);
+}
+
+void geometry::render() const
+{
+  glBegin(GL_TRIANGLES);
+  for(int i = 0; i < faces; i++)
+    {
+      vertex(faceList[i].v1).render();
+      vertex(faceList[i].v2).render();
+      vertex(faceList[i].v3).render();
+    }
+  glEnd();
+  //#define DEBUG_MESH_NORMS 1
+#ifdef DEBUG_MESH_NORMS
+  glBegin(GL_LINES);
+  for(int i = 0; i < faces; i++)
+    {
+      uint32_t fv[3] = { faceList[i].v1, faceList[i].v2, faceList[i].v3 };
+      for(int j = 0; j < 3; j++)
+	{
+	  vertex(fv[j]).render();
+	  (vertex(fv[j]) + decode_normal(normList[fv[j]])).render();
+	}
+    }
+  glEnd();
+#endif /* DEBUG_MESH_NORMS */
+}
+
+double geometry::intersect_primitive(int prim, const bvhRay &ray,
+				     double tmax, void *data) const
+{
+  double u, v, t = intersect_triangle(triList[prim], ray, TMIN, tmax, u, v);
+  if(t != -1.0)
+    {
+      meshHit *hit = (meshHit *)data;
+      hit->u = u;
+      hit->v = v;
+      hit->face = prim;
+      return t;
+    }
+  return -1.0;
+}
+
+void geometry::intersect_packet(int prim, ray_packet &packet, int first,
+				int last, void *) const
+{
+  packet.intersect_triangle(triList[prim], prim, first, last);
+}
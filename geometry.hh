@@ -0,0 +1,108 @@
+#ifndef _GEOMETRY_HH
+#define _GEOMETRY_HH 1
+
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "point.hh"
+#include "bvh.hh"
+#include "wide_bvh.hh"
+#include "accel_cache.hh"
+#include "mesh_file.hh"
+
+// ignore hits this close to the ray origin, so that rays leaving the
+// surface don't hit it again
+#define TMIN 0.2
+
+class ray_packet;
+
+// The triangles of a mesh file and the hierarchies over them, in
+// object coordinates.  Geometry is shared by every mesh loaded from
+// the same file (while it is unchanged), and is never changed once
+// loaded except to add a wide hierarchy of another width, so meshes
+// hold only their transform and material.
+class geometry : public bvh_client
+{
+public:
+  // get the geometry of filename, with a wide hierarchy of width (4
+  // or 8, or 0 for none), loading it unless a mesh already holds it,
+  // or return 0 if it can't be loaded
+  static geometry *acquire(const char *filename, int width);
+  // drop a reference got from acquire, deleting g with the last
+  static void release(geometry *g);
+  // add a wide hierarchy of width if there isn't one yet
+  void prepare(int width);
+  const char *get_name() const;
+  // whether the file has changed (or gone) since it was loaded
+  int changed() const;
+  int get_verts() const;
+  int get_faces() const;
+  void bounds(point &min, point &max) const;
+  // bytes held by the lists and hierarchies, printing how they divide
+  // up if print is set
+  size_t memory(int print = 0) const;
+  // intersect a ray with the triangles through the hierarchy of width,
+  // setting the face hit and its barycentric coordinates
+  double intersect(const bvhRay &ray, int width, int &face, double &u,
+		   double &v) const;
+  // whether a triangle blocks a ray nearer than tmax
+  int occluded(const bvhRay &ray, int width, double tmax) const;
+  // find the nearest triangle hit by each ray of a packet
+  void intersect(ray_packet &packet) const;
+  // get the point and normal at (u,v) on face
+  void interpolate(int face, double u, double v, point &vertex,
+		   point &normal) const;
+  // draw the triangles as lines within the current GL state
+  void render() const;
+  // write the geometry as a binary mesh file
+  int save(const char *filename) const;
+  // intersect a ray with a single face
+  double intersect_primitive(int prim, const bvhRay &ray, double tmax,
+			     void *data) const;
+  // intersect rays of a packet with a single face
+  void intersect_packet(int prim, ray_packet &packet, int first, int last,
+			void *data) const;
+protected:
+  geometry();
+  ~geometry();
+  // identity in the cache of loaded geometry
+  char *name;
+  time_t mtime;
+  int refs;
+  int ready, failed; // whether loading has finished, and how
+  geometry *next;
+  int verts, faces;           // Number of vertices, faces and normals
+  float *coords;	      // every vertex x, then every y, then every z
+  uint32_t *normList;	      // unit vertex normals (see encode_normal)
+  faceStruct *faceList;	      // Face List
+  triRecord *triList;	      // faces prepared for intersection
+  point min, max;	      // bounds of the vertices
+  bvh *tree;		      // hierarchy over faceList
+  wide_bvh *wide[2];	      // tree collapsed for 4- and 8-wide SIMD,
+			      // published atomically (see get_wide)
+  accel_cache *cache;	      // mapped file holding tree and a wide
+  mesh_file *file;	      // mapped file holding the lists, if any
+  unsigned long long key;     // hash of the source, naming the cache
+  // load filename, with a wide hierarchy of width
+  int load(const char *filename, int width);
+  // fill in the lists from an OBJ file or a mapped binary one
+  int read_obj(const char *filename);
+  int map_file(const char *filename);
+  // build tree and the wide hierarchy of width, or map them from the
+  // cache
+  void build_tree(int width);
+  // the wide hierarchy of width, or 0 if it isn't built
+  const wide_bvh *get_wide(int width) const;
+  point vertex(uint32_t i) const;
+  // lay out every face in triList for the intersection kernels
+  void make_triangles();
+  // collapse tree into a wide hierarchy of width
+  wide_bvh *build_wide(int width) const;
+  // list of loaded geometry, guarded by lock, with done signalled
+  // whenever some finishes loading
+  static geometry *loaded;
+  static pthread_mutex_t lock;
+  static pthread_cond_t done;
+};
+
+#endif /* _GEOMETRY_HH */
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "job_queue.hh"
+
+// ############################## renderJob ##############################
+void default_job(renderJob &job)
+{
+  job.scene[0] = 0;
+  job.width = job.height = 512;
+  job.max_depth = 4;
+  job.min_weight = MIN_WEIGHT;
+  job.roulette = 0;
+  job.perspective = 1;
+  job.base_samples = job.max_samples = 1;
+  job.eye[0] = job.eye[1] = 0;
+  job.eye[2] = 8;
+  job.focus[0] = job.focus[1] = job.focus[2] = 0;
+  job.up[0] = job.up[2] = 0;
+  job.up[1] = 1;
+  job.plane_width = 6.0;
+  job.plane_depth = 8.0;
+  job.priority = 0;
+  job.seq = 0;
+  job.state = JOB_QUEUED;
+  job.fb = 0;
+  job.seconds = 0;
+  job.rays = 0;
+}
+
+int valid_job(const renderJob &job)
+{
+  return job.scene[0] && job.width >= 1 && job.height >= 1
+    && job.width <= JOB_SIZE && job.height <= JOB_SIZE
+    && job.max_depth >= 0 && job.max_depth <= MAX_TRACE_DEPTH
+    && job.base_samples >= 1
+    && job.max_samples >= job.base_samples
+    && job.max_samples <= JOB_SAMPLES;
+}
+
+int parse_job(const char *line, renderJob &job)
+{
+  default_job(job);
+  while(*line)
+    {
+      char key[16];
+      int n = 0;
+      while(*line == ' ') line++;
+      if(*line == '\n' || !*line) break;
+      if(sscanf(line, "%15[a-z]=%n", key, &n) != 1 || !n) return -1;
+      line += n;
+      // the scene's path takes the rest of the line, so it may hold
+      // spaces
+      if(!strcmp(key, "scene"))
+	{
+	  int len = strcspn(line, "\n");
+	  if(len >= JOB_PATH) return -1;
+	  memcpy(job.scene, line, len);
+	  job.scene[len] = 0;
+	  line += len;
+	  continue;
+	}
+      n = 0;
+      if(!strcmp(key, "size"))
+	sscanf(line, "%dx%d%n", &job.width, &job.height, &n);
+      else if(!strcmp(key, "depth"))
+	sscanf(line, "%d%n", &job.max_depth, &n);
+      else if(!strcmp(key, "prune"))
+	sscanf(line, "%lf%n", &job.min_weight, &n);
+      else if(!strcmp(key, "roulette"))
+	sscanf(line, "%d%n", &job.roulette, &n);
+      else if(!strcmp(key, "ortho"))
+	{
+	  sscanf(line, "%d%n", &job.perspective, &n);
+	  job.perspective = !job.perspective;
+	}
+      else if(!strcmp(key, "samples"))
+	sscanf(line, "%d,%d%n", &job.base_samples, &job.max_samples, &n);
+      else if(!strcmp(key, "eye"))
+	sscanf(line, "%lf,%lf,%lf%n", &job.eye[0], &job.eye[1], &job.eye[2],
+	       &n);
+      else if(!strcmp(key, "focus"))
+	sscanf(line, "%lf,%lf,%lf%n", &job.focus[0], &job.focus[1],
+	       &job.focus[2], &n);
+      else if(!strcmp(key, "up"))
+	sscanf(line, "%lf,%lf,%lf%n", &job.up[0], &job.up[1], &job.up[2], &n);
+      else if(!strcmp(key, "plane"))
+	sscanf(line, "%lf,%lf%n", &job.plane_width, &job.plane_depth, &n);
+      else if(!strcmp(key, "priority"))
+	sscanf(line, "%d%n", &job.priority, &n);
+      if(!n || (line[n] && line[n] != ' ' && line[n] != '\n')) return -1;
+      line += n;
+    }
+  return valid_job(job) ? 0 : -1;
+}
+
+void format_job(const renderJob &job, char *line)
+{
+  snprintf(line, JOB_LINE, "size=%dx%d depth=%d prune=%.17g roulette=%d "
+	   "ortho=%d samples=%d,%d "
+	   "eye=%.17g,%.17g,%.17g focus=%.17g,%.17g,%.17g "
+	   "up=%.17g,%.17g,%.17g plane=%.17g,%.17g priority=%d scene=%s\n",
+	   job.width, job.height, job.max_depth, job.min_weight, job.roulette,
+	   !job.perspective,
+	   job.base_samples, job.max_samples, job.eye[0], job.eye[1],
+	   job.eye[2], job.focus[0], job.focus[1], job.focus[2], job.up[0],
+	   job.up[1], job.up[2], job.plane_width, job.plane_depth,
+	   job.priority, job.scene);
+}
+
+void apply_job(const renderJob &job, renderer &rend)
+{
+  point eye(job.eye[0], job.eye[1], job.eye[2]),
+    focus(job.focus[0], job.focus[1], job.focus[2]);
+  vector up(job.up[0], job.up[1], job.up[2]);
+  rend.set_camera(matrix::look_at(eye, focus, up).inverse(),
+		  job.plane_width, job.plane_depth, job.perspective);
+  rend.set_max_depth(job.max_depth);
+  rend.set_pruning(job.min_weight, job.roulette);
+  rend.set_samples(job.base_samples, job.max_samples);
+  rend.set_pass(1, 0);
+}
+
+// ############################## job_queue ##############################
+job_queue::job_queue()
+{
+  pthread_mutex_init(&lock, 0);
+  pthread_cond_init(&changed, 0);
+  capacity = 16;
+  heap = new renderJob *[capacity];
+  num_jobs = 0;
+  next_seq = 0;
+}
+
+job_queue::~job_queue()
+{
+  pthread_cond_destroy(&changed);
+  pthread_mutex_destroy(&lock);
+  delete[] heap;
+}
+
+int job_queue::before(const renderJob *a, const renderJob *b)
+{
+  return a->priority != b->priority ? a->priority > b->priority
+    : a->seq < b->seq;
+}
+
+int job_queue::push(renderJob *job)
+{
+  pthread_mutex_lock(&lock);
+  if(num_jobs == capacity)
+    {
+      renderJob **grown = new renderJob *[2 * capacity];
+      memcpy(grown, heap, num_jobs * sizeof(*heap));
+      delete[] heap;
+      heap = grown;
+      capacity *= 2;
+    }
+  job->seq = next_seq++;
+  job->state = JOB_QUEUED;
+  // sift up
+  int i = num_jobs++;
+  while(i && before(job, heap[(i - 1) / 2]))
+    {
+      heap[i] = heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+  heap[i] = job;
+  int ahead = 0;
+  for(int k = 0; k < num_jobs; k++)
+    if(heap[k] != job && before(heap[k], job)) ahead++;
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+  return ahead;
+}
+
+renderJob *job_queue::pop()
+{
+  pthread_mutex_lock(&lock);
+  while(!num_jobs)
+    pthread_cond_wait(&changed, &lock);
+  renderJob *job = heap[0], *last = heap[--num_jobs];
+  // sift the last job down from the root
+  int i = 0;
+  for(;;)
+    {
+      int child = 2 * i + 1;
+      if(child >= num_jobs) break;
+      if(child + 1 < num_jobs && before(heap[child + 1], heap[child]))
+	child++;
+      if(!before(heap[child], last)) break;
+      heap[i] = heap[child];
+      i = child;
+    }
+  if(num_jobs) heap[i] = last;
+  job->state = JOB_RUNNING;
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+  return job;
+}
+
+void job_queue::finish(renderJob *job, int state)
+{
+  pthread_mutex_lock(&lock);
+  job->state = state;
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+}
+
+int job_queue::wait(renderJob *job, int state)
+{
+  pthread_mutex_lock(&lock);
+  while(job->state == state)
+    pthread_cond_wait(&changed, &lock);
+  state = job->state;
+  pthread_mutex_unlock(&lock);
+  return state;
+}
+
+int job_queue::size()
+{
+  pthread_mutex_lock(&lock);
+  int n = num_jobs;
+  pthread_mutex_unlock(&lock);
+  return n;
+}
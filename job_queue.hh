@@ -0,0 +1,86 @@
+#ifndef _JOB_QUEUE_HH
+#define _JOB_QUEUE_HH 1
+
+#include <pthread.h>
+#include "renderer.hh"
+
+// longest scene path a job may name
+#define JOB_PATH 1024
+// longest job description line, including the newline
+#define JOB_LINE 2048
+// largest side of an image, and most samples in a pixel, a job may ask
+// for
+#define JOB_SIZE 16384
+#define JOB_SAMPLES 256
+
+// states of a queued job
+#define JOB_QUEUED 0
+#define JOB_RUNNING 1
+#define JOB_DONE 2
+#define JOB_FAILED 3
+
+// A frame to render: what to render and how, as sent over a socket on
+// one line of key=value pairs, and what became of it once queued.
+struct renderJob
+{
+  char scene[JOB_PATH];
+  int width, height; // resolution
+  int max_depth;
+  double min_weight; // branches are pruned below this weight
+  int roulette; // by Russian roulette
+  int perspective;
+  int base_samples, max_samples; // 1 and 1 for one sample per pixel
+  double eye[3], focus[3], up[3]; // camera
+  double plane_width, plane_depth; // image plane
+  int priority; // higher runs first, and equal ones in order
+  // set by the queue and the server
+  long long seq;
+  int state;
+  FrameBuffer *fb; // the image once done
+  double seconds; // time spent rendering
+  long long rays; // primary rays traced
+};
+
+// set job to the defaults of render.bin
+void default_job(renderJob &job);
+// whether job names a scene and keeps within the limits above, and
+// within MAX_TRACE_DEPTH bounces
+int valid_job(const renderJob &job);
+// fill in job from a description line, returning -1 if it is malformed
+// or not valid
+int parse_job(const char *line, renderJob &job);
+// describe job on one line (ending in a newline) of at most JOB_LINE
+// bytes
+void format_job(const renderJob &job, char *line);
+// set up rend to render job
+void apply_job(const renderJob &job, renderer &rend);
+
+// Jobs waiting to be rendered, as a heap which puts the highest
+// priority (and then the earliest) first.  A mutex guards it and the
+// state of every job handed to it, with a condition signalled on each
+// change of either.
+class job_queue
+{
+public:
+  job_queue();
+  ~job_queue();
+  // add job, returning how many queued jobs are ahead of it
+  int push(renderJob *job);
+  // wait for a job, and remove it from the queue as running
+  renderJob *pop();
+  // set the state of a popped job, and wake those waiting on it
+  void finish(renderJob *job, int state);
+  // wait until job's state differs from state, and return the new one
+  int wait(renderJob *job, int state);
+  int size();
+protected:
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  renderJob **heap;
+  int num_jobs, capacity;
+  long long next_seq;
+  // whether a should run before b
+  static int before(const renderJob *a, const renderJob *b);
+};
+
+#endif /* _JOB_QUEUE_HH */
@@ -0,0 +1,145 @@
+#ifndef _LANES_HH
+#define _LANES_HH 1
+
+#include <string.h>
+#include <emmintrin.h>
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+// Thin wrappers around the vector instructions used by traversal, so
+// that it can be written once for each width.  Operand order matters
+// for min and max: when a lane of the first argument is NaN the
+// second is returned, which lets rays parallel to a slab ignore it.
+
+struct lanes4
+{
+  typedef __m128 vf;
+  enum { W = 4 };
+  static vf set1(float f) { return _mm_set1_ps(f); }
+  static vf load(const float *p) { return _mm_load_ps(p); }
+  static void store(float *p, vf a) { _mm_store_ps(p, a); }
+  static vf add(vf a, vf b) { return _mm_add_ps(a, b); }
+  static vf sub(vf a, vf b) { return _mm_sub_ps(a, b); }
+  static vf mul(vf a, vf b) { return _mm_mul_ps(a, b); }
+  static vf div(vf a, vf b) { return _mm_div_ps(a, b); }
+  static vf min(vf a, vf b) { return _mm_min_ps(a, b); }
+  static vf max(vf a, vf b) { return _mm_max_ps(a, b); }
+  static vf le(vf a, vf b) { return _mm_cmple_ps(a, b); }
+  static vf lt(vf a, vf b) { return _mm_cmplt_ps(a, b); }
+  static vf gt(vf a, vf b) { return _mm_cmpgt_ps(a, b); }
+  static vf ge(vf a, vf b) { return _mm_cmpge_ps(a, b); }
+  static vf land(vf a, vf b) { return _mm_and_ps(a, b); }
+  static vf lor(vf a, vf b) { return _mm_or_ps(a, b); }
+  // lanes of a where m is set, otherwise lanes of b
+  static vf select(vf m, vf a, vf b)
+  {
+    return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+  }
+  static vf abs(vf a)
+  {
+    return _mm_andnot_ps(_mm_set1_ps(-0.0f), a);
+  }
+  static int mask(vf a) { return _mm_movemask_ps(a); }
+  // widen four bytes to floats
+  static vf bytes(const unsigned char *q)
+  {
+    int i;
+    memcpy(&i, q, 4);
+    __m128i x = _mm_cvtsi32_si128(i), zero = _mm_setzero_si128();
+    x = _mm_unpacklo_epi16(_mm_unpacklo_epi8(x, zero), zero);
+    return _mm_cvtepi32_ps(x);
+  }
+};
+
+#ifdef __AVX__
+struct lanes8
+{
+  typedef __m256 vf;
+  enum { W = 8 };
+  static vf set1(float f) { return _mm256_set1_ps(f); }
+  static vf load(const float *p) { return _mm256_load_ps(p); }
+  static void store(float *p, vf a) { _mm256_store_ps(p, a); }
+  static vf add(vf a, vf b) { return _mm256_add_ps(a, b); }
+  static vf sub(vf a, vf b) { return _mm256_sub_ps(a, b); }
+  static vf mul(vf a, vf b) { return _mm256_mul_ps(a, b); }
+  static vf div(vf a, vf b) { return _mm256_div_ps(a, b); }
+  static vf min(vf a, vf b) { return _mm256_min_ps(a, b); }
+  static vf max(vf a, vf b) { return _mm256_max_ps(a, b); }
+  static vf le(vf a, vf b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+  static vf lt(vf a, vf b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+  static vf gt(vf a, vf b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+  static vf ge(vf a, vf b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+  static vf land(vf a, vf b) { return _mm256_and_ps(a, b); }
+  static vf lor(vf a, vf b) { return _mm256_or_ps(a, b); }
+  static vf select(vf m, vf a, vf b) { return _mm256_blendv_ps(b, a, m); }
+  static vf abs(vf a)
+  {
+    return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a);
+  }
+  static int mask(vf a) { return _mm256_movemask_ps(a); }
+  static vf bytes(const unsigned char *q)
+  {
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(lanes4::bytes(q)),
+				lanes4::bytes(q + 4), 1);
+  }
+};
+#else
+// without AVX, eight lanes are processed as two halves
+struct lanes8
+{
+  struct vf
+  {
+    __m128 lo, hi;
+  };
+  enum { W = 8 };
+  static vf make(__m128 lo, __m128 hi)
+  {
+    vf r;
+    r.lo = lo;
+    r.hi = hi;
+    return r;
+  }
+  static vf set1(float f) { return make(_mm_set1_ps(f), _mm_set1_ps(f)); }
+  static vf load(const float *p)
+  {
+    return make(_mm_load_ps(p), _mm_load_ps(p + 4));
+  }
+  static void store(float *p, vf a)
+  {
+    _mm_store_ps(p, a.lo);
+    _mm_store_ps(p + 4, a.hi);
+  }
+#define LANES8_OP(name, op)						\
+  static vf name(vf a, vf b) { return make(op(a.lo, b.lo), op(a.hi, b.hi)); }
+  LANES8_OP(add, _mm_add_ps)
+  LANES8_OP(sub, _mm_sub_ps)
+  LANES8_OP(mul, _mm_mul_ps)
+  LANES8_OP(div, _mm_div_ps)
+  LANES8_OP(min, _mm_min_ps)
+  LANES8_OP(max, _mm_max_ps)
+  LANES8_OP(le, _mm_cmple_ps)
+  LANES8_OP(lt, _mm_cmplt_ps)
+  LANES8_OP(gt, _mm_cmpgt_ps)
+  LANES8_OP(ge, _mm_cmpge_ps)
+  LANES8_OP(land, _mm_and_ps)
+  LANES8_OP(lor, _mm_or_ps)
+#undef LANES8_OP
+  static vf select(vf m, vf a, vf b)
+  {
+    return make(lanes4::select(m.lo, a.lo, b.lo),
+		lanes4::select(m.hi, a.hi, b.hi));
+  }
+  static vf abs(vf a) { return make(lanes4::abs(a.lo), lanes4::abs(a.hi)); }
+  static int mask(vf a)
+  {
+    return _mm_movemask_ps(a.lo) | _mm_movemask_ps(a.hi) << 4;
+  }
+  static vf bytes(const unsigned char *q)
+  {
+    return make(lanes4::bytes(q), lanes4::bytes(q + 4));
+  }
+};
+#endif /* __AVX__ */
+
+#endif /* _LANES_HH */
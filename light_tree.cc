@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include "light_tree.hh"
+
+static double peak(const Color &c)
+{
+  return c.r > c.g ? (c.r > c.b ? c.r : c.b) : (c.g > c.b ? c.g : c.b);
+}
+
+static double intensity(const Color &c)
+{
+  return c.r + c.g + c.b;
+}
+
+// uniform in [0,1), by splitmix64
+static double next_random(unsigned long long &seed)
+{
+  unsigned long long z = (seed += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z ^= z >> 31;
+  return (z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// The cut lighting a hit: the lights and clusters standing in for
+// every light in the tree
+struct lightCut
+{
+  const material *m;
+  point dir, vertex, normal;
+  // a light or cluster, with a bound on how much the cluster's
+  // lighting may differ from its estimate
+  struct
+  {
+    const light *l;
+    int node; // the cluster's node, or -1 for a single light
+    Color estimate;
+    double bound;
+  } entry[MAX_CUT];
+  int n;
+  Color total; // sum of the estimates
+
+  void add(const light *l, int node, double bound)
+  {
+    Color c = m->phong(dir, *l, vertex, normal);
+    // a single light which doesn't reach the hit can go
+    if(node == -1 && !(c.r || c.g || c.b)) return;
+    entry[n].l = l;
+    entry[n].node = node;
+    entry[n].estimate = c;
+    entry[n].bound = bound;
+    total += c;
+    n++;
+  }
+  void remove(int i)
+  {
+    total -= entry[i].estimate;
+    entry[i] = entry[--n];
+  }
+};
+
+// ############################## light_tree ##############################
+light_tree::light_tree()
+{
+  lights = 0;
+  num_lights = 0;
+  cluster = 0;
+}
+
+light_tree::~light_tree()
+{
+  delete[] lights;
+  delete[] cluster;
+}
+
+void light_tree::build(const light *all, int n)
+{
+  delete[] lights;
+  delete[] cluster;
+  num_lights = 0;
+  for(int i = 0; i < n; i++)
+    if(all[i].pos.get_w()) num_lights++;
+  lights = new light[num_lights];
+  num_lights = 0;
+  for(int i = 0; i < n; i++)
+    if(all[i].pos.get_w()) lights[num_lights++] = all[i];
+
+  // a box around each light's position
+  double (*pos)[3] = new double[num_lights][3];
+  for(int i = 0; i < num_lights; i++)
+    {
+      pos[i][0] = lights[i].pos.get_X();
+      pos[i][1] = lights[i].pos.get_Y();
+      pos[i][2] = lights[i].pos.get_Z();
+    }
+  tree.build(num_lights, pos, pos);
+  delete[] pos;
+  cluster = new light[tree.size()];
+  // representatives are chosen at random, but the same way every time
+  unsigned long long seed = 1;
+  if(num_lights) build_cluster(0, seed);
+}
+
+void light_tree::build_cluster(int node, unsigned long long &seed)
+{
+  const bvhNode &nd = tree.get_nodes()[node];
+  const int *index = tree.get_indices();
+  // pick each light or child with probability in proportion to its
+  // intensity, so that a cluster's estimate is right on average
+  Color sum;
+  double total = 0.0;
+  if(nd.count)
+    for(int i = nd.offset; i < nd.offset + nd.count; i++)
+      {
+	const light &l = lights[index[i]];
+	sum += l.color;
+	total += intensity(l.color);
+	if(i == nd.offset || next_random(seed) * total < intensity(l.color))
+	  cluster[node].pos = l.pos;
+      }
+  else
+    for(int i = nd.offset; i < nd.offset + 2; i++)
+      {
+	build_cluster(i, seed);
+	sum += cluster[i].color;
+	total += intensity(cluster[i].color);
+	if(i == nd.offset
+	   || next_random(seed) * total < intensity(cluster[i].color))
+	  cluster[node].pos = cluster[i].pos;
+      }
+  cluster[node].color = sum;
+}
+
+int light_tree::size() const
+{
+  return num_lights;
+}
+
+int light_tree::select(const material &m, point dir, point vertex,
+		       point normal, const light **chosen,
+		       Color *estimate) const
+{
+  if(!num_lights) return 0;
+  lightCut cut;
+  cut.m = &m;
+  cut.dir = dir;
+  cut.vertex = vertex;
+  cut.normal = normal;
+  cut.n = 0;
+  add_node(cut, 0);
+
+  // split the cluster with the largest error bound until every bound
+  // is a small part of the total
+  const bvhNode *nodes = tree.get_nodes();
+  const int *index = tree.get_indices();
+  for(;;)
+    {
+      int split = -1;
+      for(int i = 0; i < cut.n; i++)
+	if(cut.entry[i].node != -1
+	   && (split == -1 || cut.entry[i].bound > cut.entry[split].bound))
+	  split = i;
+      if(split == -1
+	 || cut.entry[split].bound <= LIGHT_ERROR * peak(cut.total))
+	break;
+      const bvhNode &nd = nodes[cut.entry[split].node];
+      if(cut.n - 1 + (nd.count ? nd.count : 2) > MAX_CUT) break;
+      cut.remove(split);
+      if(nd.count)
+	for(int i = nd.offset; i < nd.offset + nd.count; i++)
+	  cut.add(&lights[index[i]], -1, 0.0);
+      else
+	{
+	  add_node(cut, nd.offset);
+	  add_node(cut, nd.offset + 1);
+	}
+    }
+
+  for(int i = 0; i < cut.n; i++)
+    {
+      chosen[i] = cut.entry[i].l;
+      estimate[i] = cut.entry[i].estimate;
+    }
+  return cut.n;
+}
+
+void light_tree::add_node(lightCut &cut, int node) const
+{
+  const bvhNode &nd = tree.get_nodes()[node];
+  // a leaf of one light is that light
+  if(nd.count == 1)
+    {
+      cut.add(&lights[tree.get_indices()[nd.offset]], -1, 0.0);
+      return;
+    }
+  // clusters wholly behind the hit are culled
+  Color most = cut.m->phong_bound(cut.dir, nd.min, nd.max, cut.vertex,
+				 cut.normal);
+  double bound = peak(most * cluster[node].color);
+  if(bound > 0.0) cut.add(&cluster[node], node, bound);
+}
@@ -0,0 +1,50 @@
+#ifndef _LIGHT_TREE_HH
+#define _LIGHT_TREE_HH 1
+
+#include "material.hh"
+#include "bvh.hh"
+
+// scenes with more point lights than this light hits through a tree
+#define LIGHT_TREE_MIN 16
+// most lights and clusters a hit is lit by
+#define MAX_CUT 128
+// a cluster is split until its error bound is below this fraction of
+// the estimated lighting
+#define LIGHT_ERROR 0.02
+
+// Hierarchy over point lights (as in Lightcuts), lighting a hit with
+// a cut through it: clusters which can't add more than a small
+// fraction of the light stand in for all of their lights, lit from one
+// representative with the cluster's total color, and the rest are
+// split down to single lights.  Clusters lying wholly behind a hit are
+// culled.
+struct lightCut;
+
+class light_tree
+{
+public:
+  light_tree();
+  ~light_tree();
+  // build over the point lights among lights
+  void build(const light *lights, int n);
+  // number of lights in the tree
+  int size() const;
+  // choose the lights and clusters lighting a hit of material m,
+  // setting chosen[i] to each (at most MAX_CUT) and estimate[i] to its
+  // unshadowed phong() lighting, and return how many there are
+  int select(const material &m, point dir, point vertex, point normal,
+	     const light **chosen, Color *estimate) const;
+protected:
+  bvh tree;
+  light *lights;  // the point lights, in the order tree indexes them
+  int num_lights;
+  // each node's representative light, carrying the total color of
+  // the node's lights
+  light *cluster;
+  // sum the colors of node's lights and pick its representative
+  void build_cluster(int node, unsigned long long &seed);
+  // add node to a cut, as a cluster or as its only light
+  void add_node(lightCut &cut, int node) const;
+};
+
+#endif /* _LIGHT_TREE_HH */
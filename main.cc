@@ -33,6 +33,19 @@ void	display(void)
   // (Note also that the window spans (0,1) )
   // Finish drawing, update the frame buffer, and swap buffers
   glutSwapBuffers();
+
+  // keep refining the image while nothing else is happening
+  if(!mode && viewer->refining()) glutIdleFunc(idle);
+}
+
+
+// This function is called whenever GLUT has no events to handle, while
+// the ray-traced image is still being refined
+void	idle(void)
+{
+  // show each pass as it finishes
+  if(viewer->refine()) glutPostRedisplay();
+  if(!viewer->refining()) glutIdleFunc(0);
 }
 
 
@@ -44,6 +57,7 @@ void	resize(int x,int y)
   window_width = x;
   window_height = y;
   viewer->refresh();
+  viewer->invalidate();
   printf("Resized to %d %d\n",x,y);
 }
 
@@ -92,7 +106,8 @@ void	mouseMotion(int x, int y)
 	  // zoom if right mouse button is down
 	  if(mouse0->is_set(1)) viewer->translate(- scale * dx, scale * dy, 0);
 	  if(mouse0->is_set(2)) viewer->translate(0, 0, - scale * dy);
-	  // redraw
+	  // redraw, abandoning any refinement of the old view
+	  viewer->invalidate();
 	  glutPostRedisplay();
 	} /* if(!mode) */
       else
@@ -123,11 +138,11 @@ void	keyboard(unsigned char key, int x, int y)
     // resolution
   case '-':
   case '_':
-    viewer->Resize(viewer->GetHeight()/2, viewer->GetWidth()/2);
+    viewer->Resize(viewer->GetWidth()/2, viewer->GetHeight()/2);
     break;
   case '=':
   case '+':
-    viewer->Resize(viewer->GetHeight()*2, viewer->GetWidth()*2);
+    viewer->Resize(viewer->GetWidth()*2, viewer->GetHeight()*2);
     break;
     // image plane properties
   case ']':
@@ -244,6 +259,26 @@ void	keyboard(unsigned char key, int x, int y)
     if(mode) printf("Entered selection mode\n");
     else printf("Entered camera mode\n");
     break;
+  case 'i':
+  case 'I':
+    // Toggle adaptive supersampling
+    viewer->toggle_antialias();
+    break;
+  case 'l':
+  case 'L':
+    // Show the next channel of the image
+    viewer->next_channel();
+    break;
+  case 'k':
+  case 'K':
+    // Toggle tracing primary rays in packets
+    viewer->toggle_packets();
+    break;
+  case 'o':
+  case 'O':
+    // Toggle progressive refinement
+    viewer->toggle_progressive();
+    break;
   case 'p':
   case 'P':
     // Toggle Projection Type (orthogonal, perspective)
@@ -257,6 +292,9 @@ void	keyboard(unsigned char key, int x, int y)
     break;
   }
 
+  // Start the image over, abandoning any refinement in progress
+  viewer->invalidate();
+
   // Schedule a new display event
   glutPostRedisplay();
 }
@@ -17,6 +17,10 @@ void	mouseButton(int button,int state,int x,int y);
 // x and y are the location of the mouse (in window-relative coordinates)
 void	mouseMotion(int x, int y);
 
+// This function is called whenever GLUT has no events to handle, while
+// the ray-traced image is still being refined
+void	idle(void);
+
 // This function is called whenever there is a keyboard input
 // key is the ASCII value of the key pressed
 // x and y are the location of the mouse
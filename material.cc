@@ -0,0 +1,194 @@
+#include <math.h>
+#include "material.hh"
+
+// ############################## light ##############################
+light::light()
+{
+  pos = point();
+  color = Color();
+}
+
+light::light(int type, point pos_, Color color_)
+{
+  pos = point(pos_);
+  pos[3] = type;
+  color = color_;
+}
+
+// ############################## material ##############################
+material::material()
+{
+  ambient = diffuse = specular = Color(1.0, 1.0, 1.0);
+  shininess = refractive_index = reflective_weight = refractive_weight = 0.0;
+}
+
+material::material(Color ambient_, Color diffuse_, Color specular_,
+		   double shininess_, double refractive_index_,
+		   double reflective_weight_, double refractive_weight_)
+{
+  ambient = ambient_;
+  diffuse = diffuse_;
+  specular = specular_;
+  shininess = shininess_;
+  refractive_index = refractive_index_;
+  reflective_weight = reflective_weight_;
+  refractive_weight = refractive_weight_;
+}
+
+static int same_color(const Color &a, const Color &b)
+{
+  return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+int material::same(const material &m) const
+{
+  return same_color(ambient, m.ambient) && same_color(diffuse, m.diffuse)
+    && same_color(specular, m.specular) && shininess == m.shininess
+    && refractive_index == m.refractive_index
+    && reflective_weight == m.reflective_weight
+    && refractive_weight == m.refractive_weight;
+}
+
+Color material::phong_ambient() const
+{
+  return ambient * Color(0.3, 0.3, 0.3);
+}
+
+Color material::phong(point dir, const light &l, point vertex,
+		      point normal) const
+{
+  point lightdir = l.pos.get_w() ? l.pos - vertex : point(l.pos),
+    view = -dir.normalize();
+  lightdir.normalize();
+  if(normal * view < 0.0) normal = - normal;
+  double NdotL = normal * lightdir;
+  Color color;
+  if(NdotL > 0.0)
+    {
+      // calculate diffuse lighting
+      color = diffuse * l.color * NdotL;
+
+      // calculate specular highlights
+      // calculate halfway vector, L+V
+      point halfway = (lightdir + view).normalize();
+      float NdotH = normal * halfway;
+      if(NdotH > 0.0)
+	color += specular * l.color
+	  * pow(NdotH, shininess);
+    }
+  return color;
+}
+
+void material::phong(const light &l, const shadeBatch &batch, int first,
+		     int last, Color *color) const
+{
+  double NdotL[SHADE_BATCH];
+  float NdotH[SHADE_BATCH];
+  // a point light's direction depends on the vertex, and a directional
+  // light's doesn't
+  double px = l.pos.get_X(), py = l.pos.get_Y(), pz = l.pos.get_Z(),
+    at = l.pos.get_w() ? 1.0 : 0.0;
+
+  // the same sums as phong() makes, with no branches so that the loop
+  // vectorizes
+  for(int i = first; i < last; i++)
+    {
+      double lx = px - at * batch.vx[i], ly = py - at * batch.vy[i],
+	lz = pz - at * batch.vz[i];
+      double len = sqrt(lx * lx + ly * ly + lz * lz);
+      len += len == 0.0; // 1 rather than 0, as there's nothing to scale
+      lx /= len;
+      ly /= len;
+      lz /= len;
+      NdotL[i] = batch.nx[i] * lx + batch.ny[i] * ly + batch.nz[i] * lz;
+      double hx = lx + batch.ex[i], hy = ly + batch.ey[i],
+	hz = lz + batch.ez[i];
+      len = sqrt(hx * hx + hy * hy + hz * hz);
+      len += len == 0.0;
+      hx /= len;
+      hy /= len;
+      hz /= len;
+      NdotH[i] = batch.nx[i] * hx + batch.ny[i] * hy + batch.nz[i] * hz;
+    }
+
+  Color lit = diffuse * l.color, shine = specular * l.color;
+  for(int i = first; i < last; i++)
+    {
+      color[i] = Color();
+      if(NdotL[i] > 0.0)
+	{
+	  color[i] = lit * NdotL[i];
+	  if(NdotH[i] > 0.0)
+	    color[i] += shine * pow(NdotH[i], shininess);
+	}
+    }
+}
+
+Color material::phong_bound(point dir, const double *min, const double *max,
+			    point vertex, point normal) const
+{
+  point view = -dir.normalize();
+  if(normal * view < 0.0) normal = - normal;
+  // the largest distance of the box along the normal, and its nearest
+  // distance from the vertex, bound the cosine of any light in it
+  double n[3] = { normal.get_x(), normal.get_y(), normal.get_z() },
+    v[3] = { vertex.get_x(), vertex.get_y(), vertex.get_z() },
+    above = 0.0, dist2 = 0.0;
+  for(int k = 0; k < 3; k++)
+    {
+      above += n[k] * ((n[k] > 0.0 ? max[k] : min[k]) - v[k]);
+      double d = v[k] < min[k] ? min[k] - v[k]
+	: v[k] > max[k] ? v[k] - max[k] : 0.0;
+      dist2 += d * d;
+    }
+  if(above <= 0.0) return Color();
+  double cosine = dist2 > 0.0 ? above / sqrt(dist2) : 1.0;
+  if(cosine > 1.0) cosine = 1.0;
+  return diffuse * cosine + specular;
+}
+
+// ############################## material_table ##############################
+material_table::material_table()
+{
+  list = 0;
+  count = capacity = 0;
+}
+
+material_table::~material_table()
+{
+  delete[] list;
+}
+
+int material_table::add(const material &m)
+{
+  for(int i = 0; i < count; i++)
+    if(list[i].same(m)) return i;
+  if(count == capacity)
+    {
+      capacity = capacity ? 2 * capacity : 16;
+      material *grown = new material[capacity];
+      for(int i = 0; i < count; i++)
+	grown[i] = list[i];
+      delete[] list;
+      list = grown;
+    }
+  list[count] = m;
+  return count++;
+}
+
+const material &material_table::get(int id) const
+{
+  return list[id];
+}
+
+int material_table::size() const
+{
+  return count;
+}
+
+void material_table::clear()
+{
+  delete[] list;
+  list = 0;
+  count = capacity = 0;
+}
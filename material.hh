@@ -0,0 +1,78 @@
+#ifndef _MATERIAL_HH
+#define _MATERIAL_HH 1
+
+#include "point.hh"
+#include "frame_buffer.hh"
+
+// most hits lit together in a shadeBatch
+#define SHADE_BATCH 64
+
+class light
+{
+public:
+  light();
+  light(int type, point pos, Color color);
+  // location of light if a point, direction if a vector
+  point pos;
+  Color color;
+};
+
+// Hits lit together, sorted by material and kept as a structure of
+// arrays, so that the shading loops run over contiguous inputs
+struct shadeBatch
+{
+  double vx[SHADE_BATCH], vy[SHADE_BATCH], vz[SHADE_BATCH]; // vertex
+  // normal, turned toward the viewer
+  double nx[SHADE_BATCH], ny[SHADE_BATCH], nz[SHADE_BATCH];
+  double ex[SHADE_BATCH], ey[SHADE_BATCH], ez[SHADE_BATCH]; // to viewer
+};
+
+// How a surface reflects and refracts light
+class material
+{
+public:
+  material();
+  material(Color ambient, Color diffuse, Color specular,
+	   double shininess, double refractive_index,
+	   double reflective_weight, double refractive_weight);
+  // whether every property is the same
+  int same(const material &m) const;
+  // lighting calculations
+  Color phong_ambient() const;
+  // calculate non-ambient local illumination
+  Color phong(point dir, const light &l, point vertex, point normal) const;
+  // phong() of hits [first,last) of a batch, setting color[i] for hit i
+  void phong(const light &l, const shadeBatch &batch, int first, int last,
+	     Color *color) const;
+  // bound phong() from above for any white light (of color 1,1,1)
+  // within the box [min,max]
+  Color phong_bound(point dir, const double *min, const double *max,
+		    point vertex, point normal) const;
+  Color ambient;
+  Color diffuse;
+  Color specular;
+  double shininess;
+  double refractive_index;
+  double reflective_weight;
+  double refractive_weight;
+};
+
+// The materials of a scene, each kept once however many surfaces
+// share it, and referred to by index
+class material_table
+{
+public:
+  material_table();
+  ~material_table();
+  // get the index of a material, adding it if there's none the same
+  int add(const material &m);
+  const material &get(int id) const;
+  int size() const;
+  void clear();
+protected:
+  material *list;
+  int count;
+  int capacity;
+};
+
+#endif /* _MATERIAL_HH */
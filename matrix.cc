@@ -129,6 +129,15 @@ matrix matrix::invert()
   return *this;
 }
 
+matrix matrix::transpose() const
+{
+  matrix ret = matrix::identity();
+  for(int i = 0; i < 3; i++)
+    for(int j = 0; j < 3; j++)
+      ret.array[i][j] = array[j][i];
+  return ret;
+}
+
 point matrix::operator* (const point& param) const
 {
   vector ret;
@@ -26,6 +26,9 @@ public:
   // translations, and uniform scalings
   matrix inverse() const;
   matrix invert();
+  // transpose the rotation and scaling part, dropping any translation
+  // (as needed to transform normals)
+  matrix transpose() const;
   // transform a point
   point operator * (const point& param) const;
   // load into current gl matrix
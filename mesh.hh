@@ -4,39 +4,44 @@
 #include "point.hh"
 #include "model.hh"
 #include "surface.hh"
+#include "geometry.hh"
 
-struct faceStruct
-{
-  int v1,v2,v3;
-};
-
+// An instance of the geometry in a mesh file, with its own transform
+// and material
 class mesh: public surface
 {
 public:
   mesh();
   mesh(const char *filename);
-  mesh(Color ambient, Color diffuse, Color specular,
-       double shininess, double refractive_index,
-       double reflective_weight, double refractive_weight);
-  mesh(const char *filename, Color ambient, Color diffuse,
-       Color specular, double shininess, double refractive_index,
-       double reflective_weight, double refractive_weight);
   ~mesh();
   // load mesh objects
   int load(const char *filename);
   int load(const char *filename, double scale, double rot_x, double rot_y,
 	   double rot_z, double trans_x, double trans_y, double trans_z);
+  // write the mesh as a binary mesh file, which load reads far faster
+  int save(const char *filename) const;
   // change color to reflect selected status
   void select();
   void deselect();
   // intersect a ray with bounding box
-  double intersect(point orig, point dir);
+  double intersect(point orig, point dir) const;
   // intersect a ray with object and set vertex and normal
-  double fine_intersect(point orig, point dir, point &vertex, point &normal);
+  double fine_intersect(point orig, point dir, point &vertex,
+			point &normal) const;
+  int occluded(point orig, point dir, double tmax) const;
+  // trace a packet through the binary hierarchy
+  void trace_packet(ray_packet &packet, int id, int first, int last) const;
+  int packet_hit(const ray_packet &packet, int i, point orig, point dir,
+		 point &vertex, point &normal) const;
+  void local_bounds(point &min, point &max) const;
+  // choose the traversal: 4 or 8 for a wide hierarchy, or 0 for the
+  // scalar binary one
+  void set_width(int width);
+  // the triangles it shares, or 0 if it isn't loaded
+  const geometry *get_geometry() const;
 protected:
-  int verts, faces;           // Number of vertices, faces and normals
-  point *vertList, *normList; // Vertex and Normal Lists
-  faceStruct *faceList;	      // Face List
+  geometry *geom;	      // triangles shared with other instances
+  int width;
   // render the object
   void do_render();
   // handle internal dynamic structures
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mesh_file.hh"
+
+#define MESH_MAGIC "RTMESH\0"
+#define MESH_VERSION 2
+#define ALIGN 64
+
+static long long align(long long off)
+{
+  return (off + ALIGN - 1) / ALIGN * ALIGN;
+}
+
+// write len bytes at offset off, padding up to it with zeros
+static int write_at(FILE *fp, long long off, const void *data, size_t len)
+{
+  while(ftell(fp) < off)
+    if(fputc(0, fp) == EOF) return -1;
+  return len && fwrite(data, len, 1, fp) != 1 ? -1 : 0;
+}
+
+// ############################## mesh_file ##############################
+mesh_file::mesh_file()
+{
+  map = 0;
+  size = 0;
+}
+
+mesh_file::~mesh_file()
+{
+  unmap();
+}
+
+void mesh_file::unmap()
+{
+  if(map) munmap(map, size);
+  map = 0;
+  size = 0;
+}
+
+int mesh_file::is_mesh_file(const char *filename)
+{
+  char magic[8];
+  FILE *fp = fopen(filename, "rb");
+  if(!fp) return 0;
+  int ret = fread(magic, sizeof(magic), 1, fp) == 1
+    && !memcmp(magic, MESH_MAGIC, sizeof(magic));
+  fclose(fp);
+  return ret;
+}
+
+int mesh_file::open(const char *filename)
+{
+  struct stat st;
+  unmap();
+  int fd = ::open(filename, O_RDONLY);
+  if(fd == -1)
+    {
+      printf("mesh_file::open(): Cannot open %s!\n", filename);
+      return -1;
+    }
+  if(fstat(fd, &st) || st.st_size < (off_t)sizeof(meshHeader))
+    {
+      printf("mesh_file::open(): %s is truncated!\n", filename);
+      close(fd);
+      return -1;
+    }
+  // map privately, so that the arrays may be used in place
+  size = st.st_size;
+  map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED)
+    {
+      printf("mesh_file::open(): Cannot map %s!\n", filename);
+      map = 0;
+      return -1;
+    }
+
+  // check that the file is whole and from a build laying out records
+  // the same way
+  const meshHeader *h = (const meshHeader *)map;
+  long long end = (long long)size;
+  if(memcmp(h->magic, MESH_MAGIC, sizeof(h->magic))
+     || h->version != MESH_VERSION || h->verts < 0 || h->faces < 0
+     || h->coord_size != (int)sizeof(float)
+     || h->normal_size != (int)sizeof(uint32_t)
+     || h->face_size != (int)sizeof(faceStruct)
+     || h->coords_off % ALIGN || h->normals_off % ALIGN
+     || h->faces_off % ALIGN
+     // the arrays follow the header in order, without overlapping
+     || h->coords_off < (long long)sizeof(meshHeader)
+     || h->coords_off > end
+     || h->normals_off < h->coords_off + 3LL * h->verts * h->coord_size
+     || h->normals_off > end
+     || h->faces_off < h->normals_off + (long long)h->verts * h->normal_size
+     || h->faces_off > end
+     || h->faces_off + (long long)h->faces * h->face_size > end)
+    {
+      printf("mesh_file::open(): %s is not a mesh file of this build!\n",
+	     filename);
+      unmap();
+      return -1;
+    }
+  // faces come from outside, so check them before they are trusted
+  const faceStruct *face = get_faces();
+  for(int i = 0; i < h->faces; i++)
+    if(face[i].v1 >= (uint32_t)h->verts || face[i].v2 >= (uint32_t)h->verts
+       || face[i].v3 >= (uint32_t)h->verts)
+      {
+	printf("mesh_file::open(): %s: vertex index out of bounds\n",
+	       filename);
+	unmap();
+	return -1;
+      }
+  return 0;
+}
+
+const meshHeader *mesh_file::header() const
+{
+  return (const meshHeader *)map;
+}
+
+float *mesh_file::get_coords() const
+{
+  return (float *)((char *)map + header()->coords_off);
+}
+
+uint32_t *mesh_file::get_normals() const
+{
+  return (uint32_t *)((char *)map + header()->normals_off);
+}
+
+faceStruct *mesh_file::get_faces() const
+{
+  return (faceStruct *)((char *)map + header()->faces_off);
+}
+
+int mesh_file::save(const char *filename, unsigned long long key, int verts,
+		    int faces, const float *coords, const uint32_t *normList,
+		    const faceStruct *faceList, const point &min, const point &max)
+{
+  char tmp[1100];
+  snprintf(tmp, sizeof(tmp), "%s.%d", filename, (int)getpid());
+
+  meshHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, MESH_MAGIC, sizeof(h.magic));
+  h.version = MESH_VERSION;
+  h.verts = verts;
+  h.faces = faces;
+  h.coord_size = sizeof(float);
+  h.normal_size = sizeof(uint32_t);
+  h.face_size = sizeof(faceStruct);
+  h.key = key;
+  h.min[0] = min.get_X();
+  h.min[1] = min.get_Y();
+  h.min[2] = min.get_Z();
+  h.max[0] = max.get_X();
+  h.max[1] = max.get_Y();
+  h.max[2] = max.get_Z();
+  h.coords_off = align(sizeof(h));
+  h.normals_off = align(h.coords_off + 3LL * verts * h.coord_size);
+  h.faces_off = align(h.normals_off + (long long)verts * h.normal_size);
+
+  // write to a temporary file and move it into place, so that readers
+  // never see a partial file
+  FILE *fp = fopen(tmp, "wb");
+  if(!fp)
+    {
+      printf("mesh_file::save(): Cannot write %s!\n", tmp);
+      return -1;
+    }
+  int ret = write_at(fp, 0, &h, sizeof(h));
+  ret |= write_at(fp, h.coords_off, coords, 3 * (size_t)verts * h.coord_size);
+  ret |= write_at(fp, h.normals_off, normList, (size_t)verts * h.normal_size);
+  ret |= write_at(fp, h.faces_off, faceList, (size_t)faces * h.face_size);
+  if(fclose(fp) || ret || rename(tmp, filename))
+    {
+      printf("mesh_file::save(): Cannot write %s!\n", filename);
+      unlink(tmp);
+      return -1;
+    }
+  return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef _MESH_FILE_HH
+#define _MESH_FILE_HH 1
+
+#include <stddef.h>
+#include "point.hh"
+#include "triangle.hh"
+
+// Header of a binary mesh file.  Arrays follow it at the given
+// offsets, each aligned to a cache line and laid out as mesh keeps
+// them, so that a mapped file can be used in place.
+struct meshHeader
+{
+  char magic[8];
+  unsigned int version;
+  int verts, faces;
+  // sizes of the stored records, to reject files from other builds
+  int coord_size, normal_size, face_size;
+  unsigned long long key;	// hash of the source, naming its accel_cache
+  double min[3], max[3];	// bounds of the vertices
+  // coords holds every x, then every y, then every z
+  long long coords_off, normals_off, faces_off;
+};
+
+// A mesh stored as the vertices, encoded vertex normals and faces
+// geometry computes from an OBJ file, read by
+// mapping the file rather than by parsing it.
+class mesh_file
+{
+public:
+  mesh_file();
+  ~mesh_file();
+  // whether filename starts as a mesh file does
+  static int is_mesh_file(const char *filename);
+  // map filename, returning -1 if it isn't a whole mesh file from a
+  // build storing records the same way
+  int open(const char *filename);
+  const meshHeader *header() const;
+  // the mapped arrays, which are private to this process
+  float *get_coords() const;
+  uint32_t *get_normals() const;
+  faceStruct *get_faces() const;
+  // write a mesh to filename
+  static int save(const char *filename, unsigned long long key, int verts,
+		  int faces, const float *coords, const uint32_t *normList,
+		  const faceStruct *faceList, const point &min, const point &max);
+protected:
+  void *map;
+  size_t size;
+  void unmap();
+};
+
+#endif /* _MESH_FILE_HH */
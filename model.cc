@@ -4,7 +4,8 @@
 /* ############################## model ############################## */
 model::model()
 {
-  state = matrix::identity();
+  version = 0;
+  set_state(matrix::identity());
   show_axes = 0;
   ax = 0;
   show_bound = 0;
@@ -14,7 +15,8 @@ model::model()
 
 model::model(double rr, double gg, double bb)
 {
-  state = matrix::identity();
+  version = 0;
+  set_state(matrix::identity());
   show_axes = 0;
   ax = 0;
   show_bound = 0;
@@ -102,32 +104,32 @@ void model::set_color(double rr, double gg, double bb)
 
 void model::rotate(double theta, double vx, double vy, double vz)
 {
-  state = matrix::rotate(theta, vx, vy, vz) * state;
+  set_state(matrix::rotate(theta, vx, vy, vz) * state);
 }
 
 void model::scale(double sx, double sy, double sz)
 {
-  state = matrix::scale(sx, sy, sz) * state;
+  set_state(matrix::scale(sx, sy, sz) * state);
 }
 
 void model::translate(double tx, double ty, double tz)
 {
-  state = matrix::translate(tx, ty, tz) * state;
+  set_state(matrix::translate(tx, ty, tz) * state);
 }
 
 void model::rotate_local(double theta, double vx, double vy, double vz)
 {
-  state *= matrix::rotate(theta, vx, vy, vz);
+  set_state(state * matrix::rotate(theta, vx, vy, vz));
 }
 
 void model::scale_local(double sx, double sy, double sz)
 {
-  state *= matrix::scale(sx, sy, sz);
+  set_state(state * matrix::scale(sx, sy, sz));
 }
 
 void model::translate_local(double tx, double ty, double tz)
 {
-  state *= matrix::translate(tx, ty, tz);
+  set_state(state * matrix::translate(tx, ty, tz));
 }
 
 matrix model::get_state() const
@@ -135,6 +137,37 @@ matrix model::get_state() const
   return state;
 }
 
+const matrix &model::get_inverse() const
+{
+  return inv_state;
+}
+
+const matrix &model::get_normal_matrix() const
+{
+  return normal_state;
+}
+
+unsigned int model::get_version() const
+{
+  return version;
+}
+
+void model::set_state(const matrix &m)
+{
+  state = m;
+  inv_state = m.inverse();
+  normal_state = inv_state.transpose();
+  version++;
+}
+
+// cross product of two vectors, without going through a matrix
+static vector cross(const point &a, const point &b)
+{
+  return vector(a.get_y() * b.get_z() - a.get_z() * b.get_y(),
+		a.get_z() * b.get_x() - a.get_x() * b.get_z(),
+		a.get_x() * b.get_y() - a.get_y() * b.get_x());
+}
+
 /*
  * adapted from the M\"oller-Trumbore fast intersection paper to
  * calculate the intersection with either a parallelogram or a
@@ -147,7 +180,7 @@ int model::mt_intersect(point orig, point dir, double &t, double &u, double &v,
 {
 #define EPSILON 1e-6
   point edge1 = vert1 - vert0, edge2 = vert2 - vert0,
-    tvec, pvec = matrix::cross(dir) * edge2, qvec;
+    tvec, pvec = cross(dir, edge2), qvec;
   double det = edge1 * pvec, inv_det;
   /* return false if the ray is nearly parallel to the polygon */
   if(det > -EPSILON && det < EPSILON)
@@ -163,7 +196,7 @@ int model::mt_intersect(point orig, point dir, double &t, double &u, double &v,
     return 0;
 
   /* calculate v and test bounds */
-  qvec = matrix::cross(tvec) * edge1;
+  qvec = cross(tvec, edge1);
   v = dir * qvec * inv_det;
   if(square)
     {
@@ -256,6 +289,16 @@ double box::intersect(point orig, point dir) const
   return ret;
 }
 
+point box::get_min() const
+{
+  return points[0];
+}
+
+point box::get_max() const
+{
+  return points[7];
+}
+
 void box::do_render()
 {
   // draw the edges of the box
@@ -12,7 +12,7 @@ public:
   // constructor
   model();
   model(double r, double g, double b);
-  ~model();
+  virtual ~model();
   // render the object
   void render();
   void render(matrix transformation);
@@ -36,8 +36,18 @@ public:
   virtual void translate_local(double tx, double ty, double tz);
   // get transformation matrices
   virtual matrix get_state() const;
+  // get the inverse of the state, and the matrix transforming normals
+  const matrix &get_inverse() const;
+  const matrix &get_normal_matrix() const;
+  // get a counter which changes whenever the state does
+  unsigned int get_version() const;
 protected:
   matrix state;
+  matrix inv_state; // cached inverse of state
+  matrix normal_state; // cached inverse transpose of state
+  unsigned int version;
+  // replace the state and update the cached matrices
+  void set_state(const matrix &m);
   int show_axes;
   axes *ax;
   int show_bound;
@@ -81,6 +91,9 @@ public:
   // return the distance along the ray to the first intersection,
   // or -1 if they fail to intersect
   double intersect(point orig, point dir) const;
+  // get opposite corners of the box
+  point get_min() const;
+  point get_max() const;
 protected:
   point points[8];
   void do_render();
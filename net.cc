@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "net.hh"
+
+// ############################## net ##############################
+// fill in a Unix socket address, returning -1 if path is too long
+static int unix_address(const char *path, sockaddr_un &addr)
+{
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(addr.sun_path))
+    {
+      printf("unix_address(): Socket path %s is too long!\n", path);
+      return -1;
+    }
+  strcpy(addr.sun_path, path);
+  return 0;
+}
+
+int listen_unix(const char *path)
+{
+  sockaddr_un addr;
+  if(unix_address(path, addr)) return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd == -1)
+    {
+      printf("listen_unix(): Cannot create socket: %s\n", strerror(errno));
+      return -1;
+    }
+  unlink(path);
+  if(bind(fd, (sockaddr *)&addr, sizeof(addr)) || listen(fd, 16))
+    {
+      printf("listen_unix(): Cannot listen on %s: %s\n", path,
+	     strerror(errno));
+      close(fd);
+      return -1;
+    }
+  return fd;
+}
+
+int connect_unix(const char *path)
+{
+  sockaddr_un addr;
+  if(unix_address(path, addr)) return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd == -1)
+    {
+      printf("connect_unix(): Cannot create socket: %s\n", strerror(errno));
+      return -1;
+    }
+  if(connect(fd, (sockaddr *)&addr, sizeof(addr)))
+    {
+      printf("connect_unix(): Cannot connect to %s: %s\n", path,
+	     strerror(errno));
+      close(fd);
+      return -1;
+    }
+  return fd;
+}
+
+int listen_tcp(const char *address, int port)
+{
+  addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  char service[16];
+  snprintf(service, sizeof(service), "%d", port);
+  int err = getaddrinfo(address, service, &hints, &res);
+  if(err)
+    {
+      printf("listen_tcp(): Cannot find %s: %s\n", address ? address : "*",
+	     gai_strerror(err));
+      return -1;
+    }
+  int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if(fd == -1)
+    {
+      printf("listen_tcp(): Cannot create socket: %s\n", strerror(errno));
+      freeaddrinfo(res);
+      return -1;
+    }
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if(bind(fd, res->ai_addr, res->ai_addrlen) || listen(fd, 16))
+    {
+      printf("listen_tcp(): Cannot listen on %s:%d: %s\n",
+	     address ? address : "*", port, strerror(errno));
+      close(fd);
+      freeaddrinfo(res);
+      return -1;
+    }
+  freeaddrinfo(res);
+  return fd;
+}
+
+int connect_tcp(const char *host, int port)
+{
+  addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  char service[16];
+  snprintf(service, sizeof(service), "%d", port);
+  int err = getaddrinfo(host, service, &hints, &res);
+  if(err)
+    {
+      printf("connect_tcp(): Cannot find %s: %s\n", host, gai_strerror(err));
+      return -1;
+    }
+  int fd = -1;
+  for(addrinfo *ai = res; ai && fd == -1; ai = ai->ai_next)
+    {
+      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if(fd != -1 && connect(fd, ai->ai_addr, ai->ai_addrlen))
+	{
+	  close(fd);
+	  fd = -1;
+	}
+    }
+  freeaddrinfo(res);
+  if(fd == -1)
+    {
+      printf("connect_tcp(): Cannot connect to %s:%d: %s\n", host, port,
+	     strerror(errno));
+      return -1;
+    }
+  // requests are single short lines, so don't hold them back
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  return fd;
+}
+
+int set_timeout(int fd, double seconds)
+{
+  struct timeval tv;
+  tv.tv_sec = (time_t)seconds;
+  tv.tv_usec = (suseconds_t)((seconds - tv.tv_sec) * 1e6);
+  if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))
+     || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)))
+    {
+      printf("set_timeout(): %s\n", strerror(errno));
+      return -1;
+    }
+  return 0;
+}
+
+int write_all(int fd, const void *buf, size_t n)
+{
+  const char *p = (const char *)buf;
+  while(n)
+    {
+      ssize_t done = write(fd, p, n);
+      if(done < 0 && errno == EINTR) continue;
+      if(done <= 0) return -1;
+      p += done;
+      n -= done;
+    }
+  return 0;
+}
+
+int read_all(int fd, void *buf, size_t n)
+{
+  char *p = (char *)buf;
+  while(n)
+    {
+      ssize_t done = read(fd, p, n);
+      if(done < 0 && errno == EINTR) continue;
+      if(done <= 0) return -1;
+      p += done;
+      n -= done;
+    }
+  return 0;
+}
+
+int read_line(int fd, char *line, int size)
+{
+  // a byte at a time, so that nothing after the newline is consumed
+  int len = 0;
+  while(len < size - 1)
+    {
+      ssize_t done = read(fd, line + len, 1);
+      if(done < 0 && errno == EINTR) continue;
+      if(done < 0) return -1;
+      if(!done) break;
+      if(line[len++] == '\n') break;
+    }
+  line[len] = 0;
+  return len && line[len - 1] != '\n' && len == size - 1 ? -1 : len;
+}
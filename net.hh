@@ -0,0 +1,27 @@
+#ifndef _NET_HH
+#define _NET_HH 1
+
+#include <stddef.h>
+
+// Blocking socket helpers, which print a message and return -1 on
+// failure.
+
+// listen on a Unix socket at path, replacing any stale one there
+int listen_unix(const char *path);
+// connect to the Unix socket at path
+int connect_unix(const char *path);
+// listen for TCP connections on port of the interface with address
+// (by name or number), or of any interface if address is 0
+int listen_tcp(const char *address, int port);
+// connect to port on host, by name or address
+int connect_tcp(const char *host, int port);
+// give up on reads and writes of fd blocked for longer than seconds
+int set_timeout(int fd, double seconds);
+// write or read exactly n bytes
+int write_all(int fd, const void *buf, size_t n);
+int read_all(int fd, void *buf, size_t n);
+// read a line (keeping its newline) of at most size - 1 bytes,
+// returning its length, 0 at end of file, or -1
+int read_line(int fd, char *line, int size);
+
+#endif /* _NET_HH */
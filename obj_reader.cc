@@ -0,0 +1,424 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "obj_reader.hh"
+
+// powers of ten represented exactly as doubles
+static const double pow10[] =
+  { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+    1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+static int is_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char *skip_space(const char *p, const char *end)
+{
+  while(p < end && is_space(*p)) p++;
+  return p;
+}
+
+// start of the line after p
+static const char *next_line(const char *p, const char *end)
+{
+  const char *nl = (const char *)memchr(p, '\n', end - p);
+  return nl ? nl + 1 : end;
+}
+
+// whether the line at p starts with keyword followed by a space
+static int keyword(const char *p, const char *end, const char *word)
+{
+  int len = strlen(word);
+  return end - p > len && !memcmp(p, word, len) && is_space(p[len]);
+}
+
+// parse an integer at s, setting end past it or to s if there is none
+static long parse_int(const char *s, const char *limit, const char *&end)
+{
+  const char *p = s;
+  int neg = p < limit && *p == '-';
+  if(p < limit && (*p == '-' || *p == '+')) p++;
+  long n = 0;
+  const char *digits = p;
+  while(p < limit && *p >= '0' && *p <= '9' && n < 1000000000L)
+    n = 10 * n + (*p++ - '0');
+  end = p == digits ? s : p;
+  return neg ? -n : n;
+}
+
+// resolve an index of a face, counted from 1 or back from base (the
+// number defined so far), to one from 0, or return -1 if it is outside
+// [0,total)
+static int resolve(long index, int base, int total)
+{
+  long i = index > 0 ? index - 1 : base + index;
+  return index && i >= 0 && i < total ? (int)i : -1;
+}
+
+double parse_double(const char *s, const char *limit, const char *&end)
+{
+  const char *p = s;
+  int neg = p < limit && *p == '-';
+  if(p < limit && (*p == '-' || *p == '+')) p++;
+  unsigned long long m = 0;
+  int digits = 0, exp10 = 0, any = 0, exact = 1;
+  for(; p < limit && *p >= '0' && *p <= '9'; p++, any = 1)
+    {
+      if(digits < 19)
+	{
+	  m = 10 * m + (*p - '0');
+	  if(m) digits++;
+	}
+      else
+	{
+	  exp10++;
+	  if(*p != '0') exact = 0;
+	}
+    }
+  if(p < limit && *p == '.')
+    for(p++; p < limit && *p >= '0' && *p <= '9'; p++, any = 1)
+      {
+	if(digits < 19)
+	  {
+	    m = 10 * m + (*p - '0');
+	    if(m) digits++;
+	    exp10--;
+	  }
+	else if(*p != '0') exact = 0;
+      }
+  if(!any)
+    {
+      end = s;
+      return 0;
+    }
+  if(p < limit && (*p == 'e' || *p == 'E'))
+    {
+      const char *q;
+      long e = parse_int(p + 1, limit, q);
+      if(q != p + 1)
+	{
+	  exp10 += e < -1000 ? -1000 : e > 1000 ? 1000 : e;
+	  p = q;
+	}
+    }
+  end = p;
+  // with both factors exact, one rounding gives the nearest double
+  if(!m) return neg ? -0.0 : 0.0;
+  if(exact && m < (1ULL << 53) && exp10 >= -22 && exp10 <= 22)
+    {
+      double v = exp10 < 0 ? m / pow10[-exp10] : m * pow10[exp10];
+      return neg ? -v : v;
+    }
+  char buf[128];
+  if(p - s >= (int)sizeof(buf))
+    {
+      end = s;
+      return 0;
+    }
+  memcpy(buf, s, p - s);
+  buf[p - s] = 0;
+  return strtod(buf, 0);
+}
+
+// ############################## obj_reader ##############################
+obj_reader::obj_reader()
+{
+  map = 0;
+  chunks = 0;
+  vert = normal = vert_normal = 0;
+  tri = tri_normal = 0;
+  clear();
+}
+
+obj_reader::~obj_reader()
+{
+  clear();
+}
+
+void obj_reader::clear()
+{
+  if(map) munmap(map, size);
+  map = 0;
+  size = 0;
+  delete[] chunks;
+  chunks = 0;
+  num_chunks = 0;
+  free(vert);
+  free(normal);
+  free(vert_normal);
+  free(tri);
+  free(tri_normal);
+  vert = normal = vert_normal = 0;
+  tri = tri_normal = 0;
+  verts = normals = tris = 0;
+}
+
+int obj_reader::num_verts() const
+{
+  return verts;
+}
+
+int obj_reader::num_tris() const
+{
+  return tris;
+}
+
+const double (*obj_reader::get_verts() const)[3]
+{
+  return vert;
+}
+
+const double (*obj_reader::get_normals() const)[3]
+{
+  return vert_normal;
+}
+
+const int (*obj_reader::get_tris() const)[3]
+{
+  return tri;
+}
+
+int obj_reader::read(const char *filename)
+{
+  clear();
+  name = filename;
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if(fd == -1 || fstat(fd, &st))
+    {
+      printf("obj_reader::read(): Cannot open %s!\n", filename);
+      if(fd != -1) close(fd);
+      return -1;
+    }
+  size = st.st_size;
+  if(size)
+    {
+      void *p = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(p == MAP_FAILED)
+	{
+	  printf("obj_reader::read(): Cannot map %s!\n", filename);
+	  close(fd);
+	  size = 0;
+	  return -1;
+	}
+      map = (char *)p;
+      madvise(p, size, MADV_WILLNEED);
+    }
+  close(fd);
+
+  // split the file into chunks of whole lines
+  num_chunks = size ? (size + OBJ_CHUNK - 1) / OBJ_CHUNK : 1;
+  chunks = new objChunk[num_chunks];
+  const char *end = map + size, *p = map;
+  for(int i = 0; i < num_chunks; i++)
+    {
+      chunks[i].begin = p;
+      if(i == num_chunks - 1) p = end;
+      else if(p < map + (size_t)(i + 1) * OBJ_CHUNK)
+	p = next_line(map + (size_t)(i + 1) * OBJ_CHUNK - 1, end);
+      chunks[i].end = p;
+    }
+  // a mesh read on a pool thread (as scene::load reads each) is
+  // parsed on that thread alone, rather than starting a pool per mesh
+  thread_pool *pool =
+    num_chunks > 1 && !thread_pool::busy() ? new thread_pool() : 0;
+
+  // count, then place each chunk after those before it
+  pass = 0;
+  if(pool) pool->run(this, num_chunks);
+  else
+    for(int i = 0; i < num_chunks; i++)
+      count(chunks[i]);
+  long long total_verts = 0, total_normals = 0, total_tris = 0;
+  int ret = 0;
+  for(int i = 0; i < num_chunks; i++)
+    {
+      chunks[i].first_vert = total_verts;
+      chunks[i].first_normal = total_normals;
+      chunks[i].first_tri = total_tris;
+      total_verts += chunks[i].verts;
+      total_normals += chunks[i].normals;
+      total_tris += chunks[i].tris;
+      ret |= chunks[i].error;
+    }
+  if(total_verts > 0x7fffffff || total_tris > 0x7fffffff)
+    {
+      printf("obj_reader::read(): %s is too large!\n", filename);
+      ret = -1;
+    }
+  verts = total_verts;
+  normals = total_normals;
+  tris = total_tris;
+  vert = (double (*)[3])malloc(sizeof(*vert) * (verts + 1));
+  normal = (double (*)[3])malloc(sizeof(*normal) * (normals + 1));
+  tri = (int (*)[3])malloc(sizeof(*tri) * (tris + 1));
+  if(normals)
+    tri_normal = (int (*)[3])malloc(sizeof(*tri_normal) * (tris + 1));
+  if(!vert || !normal || !tri || (normals && !tri_normal))
+    {
+      printf("obj_reader::read(): Cannot allocate %s!\n", filename);
+      ret = -1;
+    }
+
+  if(!ret)
+    {
+      pass = 1;
+      if(pool) pool->run(this, num_chunks);
+      else
+	for(int i = 0; i < num_chunks; i++)
+	  parse(chunks[i]);
+      for(int i = 0; i < num_chunks; i++)
+	ret |= chunks[i].error;
+    }
+  delete pool;
+  if(map) munmap(map, size);
+  map = 0;
+  if(ret)
+    {
+      clear();
+      return -1;
+    }
+
+  // average the normals faces give each vertex
+  if(normals)
+    {
+      vert_normal = (double (*)[3])calloc(verts + 1, sizeof(*vert_normal));
+      for(int i = 0; i < tris; i++)
+	for(int k = 0; k < 3; k++)
+	  if(tri_normal[i][k] != -1)
+	    for(int j = 0; j < 3; j++)
+	      vert_normal[tri[i][k]][j] += normal[tri_normal[i][k]][j];
+      for(int i = 0; i < verts; i++)
+	{
+	  double *n = vert_normal[i],
+	    len = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+	  if(len > 0)
+	    for(int j = 0; j < 3; j++)
+	      n[j] /= len;
+	}
+    }
+  free(normal);
+  free(tri_normal);
+  normal = 0;
+  tri_normal = 0;
+  return 0;
+}
+
+void obj_reader::run(int item, int)
+{
+  if(pass) parse(chunks[item]);
+  else count(chunks[item]);
+}
+
+void obj_reader::count(objChunk &c)
+{
+  c.verts = c.normals = c.tris = 0;
+  c.error = 0;
+  for(const char *p = c.begin; p < c.end; p = next_line(p, c.end))
+    {
+      p = skip_space(p, c.end);
+      if(keyword(p, c.end, "v")) c.verts++;
+      else if(keyword(p, c.end, "vn")) c.normals++;
+      else if(keyword(p, c.end, "f"))
+	{
+	  // a triangle for each corner after the second
+	  int corners = 0;
+	  for(p = skip_space(p + 2, c.end); p < c.end && *p != '\n';
+	      p = skip_space(p, c.end))
+	    {
+	      corners++;
+	      while(p < c.end && !is_space(*p) && *p != '\n') p++;
+	    }
+	  if(corners < 3)
+	    {
+	      printf("Error: %s: face with %d vertices\n", name, corners);
+	      c.error = -1;
+	    }
+	  else c.tris += corners - 2;
+	}
+    }
+}
+
+void obj_reader::parse(objChunk &c)
+{
+  int v = c.first_vert, n = c.first_normal, t = c.first_tri;
+  for(const char *p = c.begin; p < c.end; p = next_line(p, c.end))
+    {
+      p = skip_space(p, c.end);
+      const char *q;
+      if(keyword(p, c.end, "v") || keyword(p, c.end, "vn"))
+	{
+	  double *out = p[1] == 'n' ? normal[n++] : vert[v++];
+	  p += p[1] == 'n' ? 3 : 2;
+	  for(int k = 0; k < 3; k++)
+	    {
+	      out[k] = parse_double(p = skip_space(p, c.end), c.end, q);
+	      if(q == p)
+		{
+		  printf("Error: %s: malformed vertex\n", name);
+		  c.error = -1;
+		  return;
+		}
+	      p = q;
+	    }
+	}
+      else if(keyword(p, c.end, "f"))
+	{
+	  // split the polygon into a fan around its first corner
+	  int corner = 0, first[2] = { -1, -1 }, last[2] = { -1, -1 };
+	  for(p = skip_space(p + 2, c.end); p < c.end && *p != '\n';
+	      p = skip_space(p, c.end), corner++)
+	    {
+	      // "v", "v/vt", "v//vn" or "v/vt/vn"
+	      long index = parse_int(p, c.end, q), nindex = 0;
+	      int vi = q == p ? -1 : resolve(index, v, verts), ni = -1;
+	      p = q;
+	      if(p < c.end && *p == '/')
+		{
+		  parse_int(++p, c.end, q);
+		  p = q;
+		  if(p < c.end && *p == '/')
+		    {
+		      nindex = parse_int(++p, c.end, q);
+		      ni = q == p ? -2 : resolve(nindex, n, normals);
+		      p = q;
+		    }
+		}
+	      if(vi == -1 || ni == -2 || (nindex && ni == -1)
+		 || (p < c.end && !is_space(*p) && *p != '\n'))
+		{
+		  printf("Error: %s: vertex index out of bounds: %ld\n", name,
+			 vi == -1 ? index : nindex);
+		  c.error = -1;
+		  return;
+		}
+	      if(corner >= 2)
+		{
+		  tri[t][0] = first[0];
+		  tri[t][1] = last[0];
+		  tri[t][2] = vi;
+		  if(tri_normal)
+		    {
+		      tri_normal[t][0] = first[1];
+		      tri_normal[t][1] = last[1];
+		      tri_normal[t][2] = ni;
+		    }
+		  t++;
+		}
+	      else if(!corner)
+		{
+		  first[0] = vi;
+		  first[1] = ni;
+		}
+	      last[0] = vi;
+	      last[1] = ni;
+	    }
+	}
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef _OBJ_READER_HH
+#define _OBJ_READER_HH 1
+
+#include <stddef.h>
+#include "thread_pool.hh"
+
+// bytes of file parsed as one item; files no larger (or read on a
+// thread already busy with a pool's job) are parsed on the calling
+// thread alone
+#define OBJ_CHUNK (1 << 20)
+
+// a run of whole lines of the file, and what they hold
+struct objChunk
+{
+  const char *begin, *end;
+  // counts of v, vn and f lines, and of triangles the faces make
+  int verts, normals, tris;
+  // of the whole file before the chunk
+  int first_vert, first_normal, first_tri;
+  int error; // set if a line of it can't be read
+};
+
+// Reader of Wavefront OBJ meshes, which maps the file and parses it
+// in chunks of whole lines on a pool of threads.  A first pass counts
+// the vertices, normals and triangles of each chunk, so that the
+// second can parse each straight into its place, and resolve indices
+// counted back from the end (negative ones) to absolute ones.
+// Polygons are split into fans of triangles; normals given by faces
+// are averaged at each vertex; texture coordinates, groups, materials
+// and the like are skipped.
+class obj_reader : public pool_job
+{
+public:
+  obj_reader();
+  ~obj_reader();
+  // read filename, returning -1 if it can't be read or a face is
+  // malformed or names a vertex that doesn't exist
+  int read(const char *filename);
+  int num_verts() const;
+  int num_tris() const;
+  // positions of the vertices
+  const double (*get_verts() const)[3];
+  // normals at the vertices, or 0 if faces give none
+  const double (*get_normals() const)[3];
+  // vertices of each triangle, counted from 0
+  const int (*get_tris() const)[3];
+  // count or parse chunk item, as the pass requires
+  void run(int item, int thread);
+protected:
+  const char *name;
+  char *map;
+  size_t size;
+  objChunk *chunks;
+  int num_chunks;
+  int pass; // 0 to count, 1 to parse
+  int verts, normals, tris;
+  double (*vert)[3], (*normal)[3], (*vert_normal)[3];
+  int (*tri)[3];
+  int (*tri_normal)[3]; // of each corner, or -1
+  void clear();
+  // count what the lines of c hold
+  void count(objChunk &c);
+  // parse the lines of c into place
+  void parse(objChunk &c);
+};
+
+// parse a number at s, setting end past it, and return it or set end
+// to s if there is none.  Numbers with up to 19 significant digits and
+// small exponents are converted exactly, and others by strtod.
+double parse_double(const char *s, const char *limit, const char *&end);
+
+#endif /* _OBJ_READER_HH */
@@ -0,0 +1,354 @@
+#include <float.h>
+#include <math.h>
+#include "ray_packet.hh"
+#include "lanes.hh"
+
+#define EPSILON 1e-6f
+#define STACK_SIZE 256
+// interior nodes reached by this few rays are traced a ray at a time
+#define SINGLE_RAYS 2
+// relative slack in the interval test, covering float rounding in the
+// per-ray tests
+#define SLACK 1e-5
+
+// rays are tested a vector at a time
+#ifdef __AVX__
+typedef lanes8 packet_lanes;
+#else
+typedef lanes4 packet_lanes;
+#endif
+
+// interval product [a0,a1] * [b0,b1]
+static void interval_mul(double a0, double a1, double b0, double b1,
+			 double &lo, double &hi)
+{
+  double p[4] = { a0 * b0, a0 * b1, a1 * b0, a1 * b1 };
+  lo = hi = p[0];
+  for(int i = 1; i < 4; i++)
+    {
+      if(p[i] < lo) lo = p[i];
+      if(p[i] > hi) hi = p[i];
+    }
+}
+
+// mask of the bits [first,last)
+static unsigned long long range_mask(int first, int last)
+{
+  unsigned long long below_last = last >= 64 ? ~0ULL : (1ULL << last) - 1;
+  return below_last & ~((1ULL << first) - 1);
+}
+
+// ############################## ray_packet ##############################
+ray_packet::ray_packet()
+{
+  reset(0);
+}
+
+void ray_packet::reset(int n)
+{
+  typedef packet_lanes S;
+  if(n > PACKET_SIZE) n = PACKET_SIZE;
+  num_rays = n;
+  padded = (n + S::W - 1) / S::W * S::W;
+  tmin = 0.0f;
+  float nan = nanf("");
+  for(int i = 0; i < PACKET_SIZE; i++)
+    {
+      // unused rays have already hit something behind their origin,
+      // so that no box or triangle test ever accepts them
+      t[i] = i < n ? FLT_MAX : -1.0f;
+      u[i] = v[i] = 0.0f;
+      surface[i] = prim[i] = -1;
+      for(int k = 0; k < 3; k++)
+	{
+	  orig[k][i] = 0.0f;
+	  dir[k][i] = nan;
+	}
+    }
+}
+
+int ray_packet::size() const
+{
+  return num_rays;
+}
+
+void ray_packet::set_ray(int i, const point &o, const point &d)
+{
+  orig[0][i] = o.get_X();
+  orig[1][i] = o.get_Y();
+  orig[2][i] = o.get_Z();
+  dir[0][i] = d.get_x();
+  dir[1][i] = d.get_y();
+  dir[2][i] = d.get_z();
+}
+
+point ray_packet::get_orig(int i) const
+{
+  return point(orig[0][i], orig[1][i], orig[2][i]);
+}
+
+point ray_packet::get_dir(int i) const
+{
+  return vector(dir[0][i], dir[1][i], dir[2][i]);
+}
+
+void ray_packet::prepare()
+{
+  for(int k = 0; k < 3; k++)
+    {
+      // division by zero deliberately produces an infinity
+      for(int i = 0; i < padded; i++)
+	inv_dir[k][i] = 1.0f / dir[k][i];
+      orig_min[k] = inv_min[k] = DBL_MAX;
+      orig_max[k] = inv_max[k] = -DBL_MAX;
+      int pos = 0, neg = 0;
+      for(int i = 0; i < num_rays; i++)
+	{
+	  double inv = 1.0 / dir[k][i];
+	  if(orig[k][i] < orig_min[k]) orig_min[k] = orig[k][i];
+	  if(orig[k][i] > orig_max[k]) orig_max[k] = orig[k][i];
+	  if(inv < inv_min[k]) inv_min[k] = inv;
+	  if(inv > inv_max[k]) inv_max[k] = inv;
+	  pos += dir[k][i] > 0.0f;
+	  neg += dir[k][i] < 0.0f;
+	}
+      coherent[k] = num_rays && (pos == num_rays || neg == num_rays);
+    }
+}
+
+void ray_packet::transform(const ray_packet &src, const matrix &m)
+{
+  num_rays = src.num_rays;
+  padded = src.padded;
+  tmin = src.tmin;
+  for(int i = 0; i < PACKET_SIZE; i++)
+    {
+      t[i] = src.t[i];
+      u[i] = src.u[i];
+      v[i] = src.v[i];
+      surface[i] = src.surface[i];
+      prim[i] = src.prim[i];
+      if(i >= num_rays)
+	{
+	  for(int k = 0; k < 3; k++)
+	    {
+	      orig[k][i] = src.orig[k][i];
+	      dir[k][i] = src.dir[k][i];
+	    }
+	  continue;
+	}
+      set_ray(i, m * src.get_orig(i), m * src.get_dir(i));
+    }
+  prepare();
+}
+
+int ray_packet::intersect_box(const bvhNode &node, int first, int last,
+			      unsigned long long &hits) const
+{
+  typedef packet_lanes S;
+  typedef S::vf vf;
+
+  // cull the box if no ray of the packet can hit it
+  double tnear = 0.0, tfar = DBL_MAX;
+  for(int k = 0; k < 3; k++)
+    {
+      if(!coherent[k]) continue;
+      double enter = inv_min[k] > 0 ? node.min[k] : node.max[k],
+	leave = inv_min[k] > 0 ? node.max[k] : node.min[k], lo, hi, tmp;
+      interval_mul(enter - orig_max[k], enter - orig_min[k], inv_min[k],
+		   inv_max[k], lo, tmp);
+      interval_mul(leave - orig_max[k], leave - orig_min[k], inv_min[k],
+		   inv_max[k], tmp, hi);
+      if(lo > tnear) tnear = lo;
+      if(hi < tfar) tfar = hi;
+    }
+  if(tnear > tfar + SLACK * (fabs(tfar) + 1.0)) return 0;
+
+  // then test the rays themselves, rounding the box outward to floats
+  float lo[3], hi[3];
+  for(int k = 0; k < 3; k++)
+    {
+      lo[k] = (float)node.min[k];
+      hi[k] = (float)node.max[k];
+      if(lo[k] > node.min[k]) lo[k] = nextafterf(lo[k], -FLT_MAX);
+      if(hi[k] < node.max[k]) hi[k] = nextafterf(hi[k], FLT_MAX);
+    }
+  vf zero = S::set1(0.0f);
+  hits = 0;
+  for(int g = first / S::W * S::W; g < last; g += S::W)
+    {
+      vf tn = zero, tf = S::load(t + g);
+      for(int k = 0; k < 3; k++)
+	{
+	  vf o = S::load(orig[k] + g), inv = S::load(inv_dir[k] + g),
+	    neg = S::lt(inv, zero), bmin = S::set1(lo[k]),
+	    bmax = S::set1(hi[k]);
+	  vf near = S::select(neg, bmax, bmin),
+	    far = S::select(neg, bmin, bmax);
+	  tn = S::max(S::mul(S::sub(near, o), inv), tn);
+	  tf = S::min(S::mul(S::sub(far, o), inv), tf);
+	}
+      hits |= (unsigned long long)S::mask(S::le(tn, tf)) << g;
+    }
+  hits &= range_mask(first, last);
+  return __builtin_popcountll(hits);
+}
+
+void ray_packet::intersect(const bvh &tree, const bvh_client *client,
+			   void *data)
+{
+  if(!tree.size() || !num_rays) return;
+  const bvhNode *nodes = tree.get_nodes();
+  int stack[STACK_SIZE], first[STACK_SIZE], last[STACK_SIZE], sp = 0;
+  stack[sp] = 0;
+  first[sp] = 0;
+  last[sp++] = padded;
+  while(sp)
+    {
+      sp--;
+      int node = stack[sp];
+      unsigned long long hits;
+      int n = intersect_box(nodes[node], first[sp], last[sp], hits);
+      if(!n) continue;
+      // narrow the range to the rays which reach this node
+      int lo = __builtin_ctzll(hits), hi = 64 - __builtin_clzll(hits);
+      const bvhNode &nd = nodes[node];
+      if(nd.count)
+	{
+	  for(int i = nd.offset; i < nd.offset + nd.count; i++)
+	    client->intersect_packet(tree.primitive(i), *this, lo, hi,
+				     data);
+	  continue;
+	}
+      // the packet has diverged, so follow the remaining rays alone
+      if(n <= SINGLE_RAYS)
+	{
+	  while(hits)
+	    {
+	      intersect_single(tree, node, __builtin_ctzll(hits), client,
+			       data);
+	      hits &= hits - 1;
+	    }
+	  continue;
+	}
+      // visit the child nearer along the first ray first, deferring
+      // the other
+      int l = nd.offset, r = nd.offset + 1;
+      double d = 0.0;
+      for(int k = 0; k < 3; k++)
+	d += dir[k][lo] * (nodes[l].min[k] + nodes[l].max[k]
+			   - nodes[r].min[k] - nodes[r].max[k]);
+      if(d > 0.0)
+	{
+	  int tmp = l;
+	  l = r;
+	  r = tmp;
+	}
+      stack[sp] = r;
+      first[sp] = lo;
+      last[sp++] = hi;
+      stack[sp] = l;
+      first[sp] = lo;
+      last[sp++] = hi;
+    }
+}
+
+void ray_packet::intersect_single(const bvh &tree, int node, int i,
+				  const bvh_client *client, void *data)
+{
+  const bvhNode *nodes = tree.get_nodes();
+  int stack[STACK_SIZE], sp = 0;
+  bvhRay ray;
+  bvh::make_ray(ray, get_orig(i), get_dir(i));
+  stack[sp++] = node;
+  while(sp)
+    {
+      const bvhNode &nd = nodes[stack[--sp]];
+      if(bvh::intersect_box(nd, ray, t[i]) == -1.0) continue;
+      if(nd.count)
+	{
+	  for(int j = nd.offset; j < nd.offset + nd.count; j++)
+	    client->intersect_packet(tree.primitive(j), *this, i, i + 1,
+				     data);
+	  continue;
+	}
+      // push the farther child first
+      int l = nd.offset, r = nd.offset + 1;
+      double tl = bvh::intersect_box(nodes[l], ray, t[i]),
+	tr = bvh::intersect_box(nodes[r], ray, t[i]);
+      if(tl != -1.0 && tr != -1.0 && tr < tl)
+	{
+	  int tmp = l;
+	  l = r;
+	  r = tmp;
+	}
+      stack[sp++] = r;
+      stack[sp++] = l;
+    }
+}
+
+void ray_packet::intersect_triangle(const triRecord &tri, int id, int first,
+				    int last)
+{
+  typedef packet_lanes S;
+  typedef S::vf vf;
+  vf v0[3], e1[3], e2[3];
+  for(int k = 0; k < 3; k++)
+    {
+      v0[k] = S::set1(tri.v0[k]);
+      e1[k] = S::set1(tri.e1[k]);
+      e2[k] = S::set1(tri.e2[k]);
+    }
+  vf eps = S::set1(EPSILON), zero = S::set1(0.0f), one = S::set1(1.0f),
+    lo = S::set1(tmin);
+  for(int g = first / S::W * S::W; g < last; g += S::W)
+    {
+      vf d[3], tv[3];
+      for(int k = 0; k < 3; k++)
+	{
+	  d[k] = S::load(dir[k] + g);
+	  tv[k] = S::sub(S::load(orig[k] + g), v0[k]);
+	}
+      // Moller-Trumbore, as in intersect_triangle() of triangle.hh
+      vf p0 = S::sub(S::mul(d[1], e2[2]), S::mul(d[2], e2[1])),
+	p1 = S::sub(S::mul(d[2], e2[0]), S::mul(d[0], e2[2])),
+	p2 = S::sub(S::mul(d[0], e2[1]), S::mul(d[1], e2[0]));
+      vf det = S::add(S::add(S::mul(e1[0], p0), S::mul(e1[1], p1)),
+		      S::mul(e1[2], p2));
+      vf inv_det = S::div(one, det);
+      vf uu = S::mul(S::add(S::add(S::mul(tv[0], p0), S::mul(tv[1], p1)),
+			    S::mul(tv[2], p2)), inv_det);
+      vf q0 = S::sub(S::mul(tv[1], e1[2]), S::mul(tv[2], e1[1])),
+	q1 = S::sub(S::mul(tv[2], e1[0]), S::mul(tv[0], e1[2])),
+	q2 = S::sub(S::mul(tv[0], e1[1]), S::mul(tv[1], e1[0]));
+      vf vv = S::mul(S::add(S::add(S::mul(d[0], q0), S::mul(d[1], q1)),
+			    S::mul(d[2], q2)), inv_det);
+      vf tt = S::mul(S::add(S::add(S::mul(e2[0], q0), S::mul(e2[1], q1)),
+			    S::mul(e2[2], q2)), inv_det);
+      vf told = S::load(t + g);
+      vf m = S::land(S::ge(S::abs(det), eps),
+		     S::land(S::land(S::ge(uu, zero), S::le(uu, one)),
+			     S::land(S::ge(vv, zero),
+				     S::le(S::add(uu, vv), one))));
+      m = S::land(m, S::land(S::ge(tt, lo), S::lt(tt, told)));
+      // only rays in the range take the hit
+      int bits = S::mask(m) & (int)(range_mask(first, last) >> g)
+	& ((1 << S::W) - 1);
+      if(!bits) continue;
+      float tb[S::W] __attribute__((aligned(32))),
+	ub[S::W] __attribute__((aligned(32))),
+	vb[S::W] __attribute__((aligned(32)));
+      S::store(tb, tt);
+      S::store(ub, uu);
+      S::store(vb, vv);
+      while(bits)
+	{
+	  int j = __builtin_ctz(bits);
+	  bits &= bits - 1;
+	  t[g + j] = tb[j];
+	  u[g + j] = ub[j];
+	  v[g + j] = vb[j];
+	  prim[g + j] = id;
+	}
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef _RAY_PACKET_HH
+#define _RAY_PACKET_HH 1
+
+#include "point.hh"
+#include "matrix.hh"
+#include "bvh.hh"
+#include "triangle.hh"
+
+// rays in a full packet, which covers a square tile of pixels
+#define PACKET_DIM 8
+#define PACKET_SIZE (PACKET_DIM * PACKET_DIM)
+
+// A bundle of coherent rays traced together through a bvh, stored one
+// array per component so that several rays are tested at once.  Boxes
+// are first tested against the whole packet with interval arithmetic,
+// and subtrees reached by only a few of its rays are traced one ray at
+// a time.
+class ray_packet
+{
+public:
+  ray_packet();
+  // start a packet of n rays, none of which has hit anything
+  void reset(int n);
+  int size() const;
+  // set ray i
+  void set_ray(int i, const point &orig, const point &dir);
+  point get_orig(int i) const;
+  point get_dir(int i) const;
+  // compute what traversal needs once the rays are set
+  void prepare();
+  // set this packet to the rays of src transformed by m, keeping their
+  // nearest hits (ray parameters are unchanged by the transform)
+  void transform(const ray_packet &src, const matrix &m);
+  // find the nearest primitive of tree hit by each ray with a ray
+  // parameter in [tmin,t[i]), handing leaves to client->intersect_packet
+  void intersect(const bvh &tree, const bvh_client *client, void *data);
+  // test rays [first,last) against a triangle, keeping nearer hits
+  void intersect_triangle(const triRecord &tri, int id, int first,
+			  int last);
+  // nearest ray parameter accepted
+  float tmin;
+  // nearest hit of each ray: its parameter (FLT_MAX if none), the
+  // surface and primitive hit, and barycentric coordinates
+  float t[PACKET_SIZE] __attribute__((aligned(32)));
+  float u[PACKET_SIZE] __attribute__((aligned(32)));
+  float v[PACKET_SIZE] __attribute__((aligned(32)));
+  int surface[PACKET_SIZE];
+  int prim[PACKET_SIZE];
+protected:
+  int num_rays;
+  int padded; // num_rays rounded up to whole vectors
+  float orig[3][PACKET_SIZE] __attribute__((aligned(32)));
+  float dir[3][PACKET_SIZE] __attribute__((aligned(32)));
+  float inv_dir[3][PACKET_SIZE] __attribute__((aligned(32)));
+  // bounds of the origins and reciprocal directions over the packet,
+  // usable only along axes where every direction has the same sign
+  double orig_min[3], orig_max[3], inv_min[3], inv_max[3];
+  int coherent[3];
+  // find which of rays [first,last) hit node's box, setting a bit in
+  // hits for each, and return how many do
+  int intersect_box(const bvhNode &node, int first, int last,
+		    unsigned long long &hits) const;
+  // trace ray i alone through the subtree under node
+  void intersect_single(const bvh &tree, int node, int i,
+			const bvh_client *client, void *data);
+};
+
+#endif /* _RAY_PACKET_HH */
@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "render.hh"
+#include "net.hh"
+#include "coordinator.hh"
+
+// wall clock time in seconds
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+void usage(const char *name)
+{
+  printf("usage: %s [options] SCENE.rtl\n"
+	 "  -o FILE       write the image to FILE, as floats if it ends in\n"
+	 "                .pfm and as a PPM otherwise (default out.ppm)\n"
+	 "  -s WxH        resolution (default 512x512, at most 16384x16384)\n"
+	 "  -d DEPTH      bounces traced after the first hit (default 4, at\n"
+	 "                most 63)\n"
+	 "  -k WEIGHT     prune branches of paths weighing less than WEIGHT\n"
+	 "                (default 0.01)\n"
+	 "  -r            prune them by Russian roulette instead, which is\n"
+	 "                unbiased but noisy\n"
+	 "  -t THREADS    threads (default one per processor or $RT_THREADS)\n"
+	 "  -e X,Y,Z      camera position (default 0,0,8)\n"
+	 "  -l X,Y,Z      point looked at (default 0,0,0)\n"
+	 "  -u X,Y,Z      up direction (default 0,1,0)\n"
+	 "  -w WIDTH      half width of the image plane (default 6)\n"
+	 "  -f DISTANCE   distance to the image plane (default 8)\n"
+	 "  -p            orthographic rather than perspective projection\n"
+	 "  -a BASE,MAX   supersample adaptively with BASE to MAX samples\n"
+	 "                per pixel (at most 256)\n"
+	 "  -x NAME=FILE  also write channel NAME (depth, normal, object or\n"
+	 "                rays) to FILE as floats\n"
+	 "  -S SOCKET     have the server listening on SOCKET render it\n"
+	 "                (without -x)\n"
+	 "  -P PRIORITY   priority on the server, where higher runs first\n"
+	 "                (default 0)\n"
+	 "  -W HOST:PORT,...  split it between worker.bin processes at\n"
+	 "                these addresses (without -x or -S)\n", name);
+}
+
+int parse_point(const char *s, double *p)
+{
+  return sscanf(s, "%lf,%lf,%lf", &p[0], &p[1], &p[2]) == 3 ? 0 : -1;
+}
+
+int parse_channel(const char *name)
+{
+  if(!strcmp(name, "depth")) return FB_DEPTH;
+  if(!strcmp(name, "normal")) return FB_NORMAL;
+  if(!strcmp(name, "object")) return FB_OBJECT;
+  if(!strcmp(name, "rays")) return FB_RAYS;
+  return 0;
+}
+
+int write_image(FrameBuffer &fb, const char *output)
+{
+  size_t len = strlen(output);
+  return len > 4 && !strcmp(output + len - 4, ".pfm") ? fb.WritePFM(output)
+    : fb.WritePPM(output);
+}
+
+int submit(const char *path, const renderJob &job_, const char *output)
+{
+  // the server has its own working directory, so send the scene's
+  // absolute path
+  renderJob job = job_;
+  char *scene = realpath(job_.scene, 0);
+  if(!scene || strlen(scene) >= JOB_PATH)
+    {
+      printf("submit(): Cannot resolve %s!\n", job_.scene);
+      free(scene);
+      return -1;
+    }
+  strcpy(job.scene, scene);
+  free(scene);
+  int fd = connect_unix(path);
+  if(fd == -1) return -1;
+  char line[JOB_LINE];
+  format_job(job, line);
+  if(write_all(fd, line, strlen(line)))
+    {
+      printf("submit(): Cannot send the job!\n");
+      close(fd);
+      return -1;
+    }
+  // report progress until the image arrives
+  double seconds;
+  long long rays;
+  while(read_line(fd, line, sizeof(line)) > 0)
+    {
+      int ahead;
+      if(sscanf(line, "QUEUED %d", &ahead) == 1)
+	printf("queued behind %d jobs\n", ahead);
+      else if(!strcmp(line, "RUNNING\n")) printf("rendering\n");
+      else if(sscanf(line, "DONE %lf %lld", &seconds, &rays) == 2)
+	{
+	  FILE *fp = fdopen(fd, "r");
+	  FrameBuffer fb(1, 1);
+	  int ret = fb.ReadPFM(fp);
+	  fclose(fp);
+	  if(ret) return -1;
+	  printf("rendered %dx%d in %.3f s: %lld primary rays (%.0f/s)\n",
+		 job.width, job.height, seconds, rays, rays / seconds);
+	  return write_image(fb, output);
+	}
+      else
+	{
+	  printf("submit(): %s", line);
+	  break;
+	}
+    }
+  close(fd);
+  return -1;
+}
+
+int distribute(char *workers, const renderJob &job, int threads,
+	       const char *output)
+{
+  coordinator coord;
+  for(char *address = strtok(workers, ","); address;
+      address = strtok(0, ","))
+    if(coord.add_worker(address))
+      {
+	printf("distribute(): Bad worker address %s\n", address);
+	return 1;
+      }
+  double start = now();
+  FrameBuffer fb(job.width, job.height);
+  renderer rend(threads);
+  if(coord.render(job, &fb, rend)) return 1;
+  double elapsed = now() - start;
+  printf("rendered %dx%d on %d workers in %.3f s: %lld primary rays "
+	 "(%.0f/s)\n", job.width, job.height, coord.num_alive(), elapsed,
+	 coord.get_rays(), coord.get_rays() / elapsed);
+  return write_image(fb, output) ? 1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+  const char *output = "out.ppm", *extra_file[4], *server = 0;
+  char *worker_list = 0;
+  int threads = 0, extra[4], num_extra = 0, channels = FB_RAYS, opt;
+  renderJob job;
+  default_job(job);
+  while((opt = getopt(argc, argv, "o:s:d:k:rt:e:l:u:w:f:pa:x:S:P:W:h")) != -1)
+    {
+      int bad = 0;
+      switch(opt)
+	{
+	case 'o': output = optarg; break;
+	case 's':
+	  bad = sscanf(optarg, "%dx%d", &job.width, &job.height) != 2
+	    || job.width < 1 || job.height < 1;
+	  break;
+	case 'd': job.max_depth = atoi(optarg); break;
+	case 'k': job.min_weight = atof(optarg); break;
+	case 'r': job.roulette = 1; break;
+	case 't': threads = atoi(optarg); break;
+	case 'e': bad = parse_point(optarg, job.eye); break;
+	case 'l': bad = parse_point(optarg, job.focus); break;
+	case 'u': bad = parse_point(optarg, job.up); break;
+	case 'w': job.plane_width = atof(optarg); break;
+	case 'f': job.plane_depth = atof(optarg); break;
+	case 'p': job.perspective = 0; break;
+	case 'a':
+	  if(sscanf(optarg, "%d,%d", &job.base_samples,
+		    &job.max_samples) < 2)
+	    job.max_samples = job.base_samples;
+	  break;
+	case 'x':
+	  {
+	    const char *eq = strchr(optarg, '=');
+	    char name[16];
+	    bad = !eq || eq - optarg >= (int)sizeof(name) || num_extra == 4;
+	    if(bad) break;
+	    memcpy(name, optarg, eq - optarg);
+	    name[eq - optarg] = 0;
+	    extra[num_extra] = parse_channel(name);
+	    extra_file[num_extra] = eq + 1;
+	    bad = !extra[num_extra];
+	    channels |= extra[num_extra++];
+	    break;
+	  }
+	case 'S': server = optarg; break;
+	case 'P': job.priority = atoi(optarg); break;
+	case 'W': worker_list = optarg; break;
+	default: bad = 1; break;
+	}
+      if(bad)
+	{
+	  usage(argv[0]);
+	  return 1;
+	}
+    }
+  if(optind != argc - 1 || strlen(argv[optind]) >= JOB_PATH
+     || (server && num_extra) || (worker_list && (num_extra || server)))
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  strcpy(job.scene, argv[optind]);
+  if(!valid_job(job))
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  if(server) return submit(server, job, output) ? 1 : 0;
+  if(worker_list) return distribute(worker_list, job, threads, output);
+
+  double start = now();
+  scene scn;
+  if(scn.load(job.scene)) return 1;
+  scn.sync_tree();
+  double loaded = now();
+
+  FrameBuffer fb(job.width, job.height);
+  fb.SetChannels(channels);
+  renderer rend(threads);
+  apply_job(job, rend);
+  rend.render(&scn, &fb);
+  double elapsed = now() - loaded;
+
+  // the rays channel counts shadow and secondary rays as well
+  unsigned long long rays = 0;
+  for(int y = 0; y < job.height; y++)
+    for(int x = 0; x < job.width; x++)
+      rays += fb.GetInfo(x, y).rays;
+  printf("loaded %s in %.3f s\n", job.scene, loaded - start);
+  printf("rendered %dx%d on %d threads in %.3f s: %lld primary rays "
+	 "(%.0f/s), %llu in all (%.0f/s)\n", job.width, job.height,
+	 rend.get_pool()->size(), elapsed, rend.get_rays(),
+	 rend.get_rays() / elapsed, rays, rays / elapsed);
+
+  if(write_image(fb, output)) return 1;
+  for(int i = 0; i < num_extra; i++)
+    if(fb.WritePFM(extra_file[i], extra[i])) return 1;
+  return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef _RENDER_HH
+#define _RENDER_HH 1
+
+#include "scene.hh"
+#include "job_queue.hh"
+
+// print the command line options
+void usage(const char *name);
+
+// parse "x,y,z" into p[0..2], returning -1 if it isn't three numbers
+int parse_point(const char *s, double *p);
+
+// name an extra channel of a FrameBuffer, returning its FB_* flag, or
+// 0 if there is none by that name
+int parse_channel(const char *name);
+
+// write fb to output, as floats if its name ends in .pfm
+int write_image(FrameBuffer &fb, const char *output);
+
+// have the server listening on the Unix socket at path render job,
+// reporting its progress, and write the image to output
+int submit(const char *path, const renderJob &job, const char *output);
+
+// render job on the worker.bin processes listed in workers (as
+// "host:port,..."), on threads of this process where they fail, and
+// write the image to output; returns the exit status
+int distribute(char *workers, const renderJob &job, int threads,
+	       const char *output);
+
+// Here's the main
+int main(int argc, char* argv[]);
+
+#endif /* _RENDER_HH */
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "render_server.hh"
+#include "net.hh"
+
+// a client connection handed to its thread
+struct clientArg
+{
+  render_server *server;
+  int fd;
+};
+
+// wall clock time in seconds
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+// ############################## render_server ##############################
+render_server::render_server(int threads)
+{
+  fd = -1;
+  rend = new renderer(threads);
+  scenes = new residentScene[MAX_SCENES];
+  num_scenes = 0;
+  uses = 0;
+}
+
+render_server::~render_server()
+{
+  if(fd != -1) close(fd);
+  for(int i = 0; i < num_scenes; i++)
+    delete scenes[i].scn;
+  delete[] scenes;
+  delete rend;
+}
+
+int render_server::listen(const char *path)
+{
+  fd = listen_unix(path);
+  return fd == -1 ? -1 : 0;
+}
+
+void render_server::run()
+{
+  // a client hanging up shouldn't take the server down
+  signal(SIGPIPE, SIG_IGN);
+  pthread_t thread;
+  if(pthread_create(&thread, 0, render_main, this))
+    {
+      printf("render_server::run(): Cannot start rendering thread!\n");
+      return;
+    }
+  for(;;)
+    {
+      int client = accept(fd, 0, 0);
+      if(client == -1)
+	{
+	  if(errno == EINTR) continue;
+	  printf("render_server::run(): Cannot accept: %s\n", strerror(errno));
+	  return;
+	}
+      clientArg *arg = new clientArg;
+      arg->server = this;
+      arg->fd = client;
+      if(pthread_create(&thread, 0, client_main, arg))
+	{
+	  printf("render_server::run(): Cannot start client thread!\n");
+	  close(client);
+	  delete arg;
+	  continue;
+	}
+      pthread_detach(thread);
+    }
+}
+
+scene *render_server::get_scene(const char *path)
+{
+  struct stat st;
+  if(stat(path, &st))
+    {
+      printf("render_server::get_scene(): Cannot find %s!\n", path);
+      return 0;
+    }
+  int i;
+  for(i = 0; i < num_scenes; i++)
+    if(!strcmp(scenes[i].path, path)) break;
+  if(i < num_scenes && scenes[i].mtime == st.st_mtime
+     && !scenes[i].scn->meshes_changed())
+    {
+      scenes[i].jobs++;
+      scenes[i].used = ++uses;
+      return scenes[i].scn;
+    }
+  scene *scn = new scene();
+  if(scn->load(path))
+    {
+      delete scn;
+      return 0;
+    }
+  scn->sync_tree();
+  if(i == num_scenes && num_scenes == MAX_SCENES)
+    {
+      // make room in place of the least recently used
+      i = 0;
+      for(int j = 1; j < num_scenes; j++)
+	if(scenes[j].used < scenes[i].used) i = j;
+      printf("Unloading %s\n", scenes[i].path);
+      delete scenes[i].scn;
+      strcpy(scenes[i].path, path);
+    }
+  else if(i == num_scenes)
+    {
+      num_scenes++;
+      strcpy(scenes[i].path, path);
+    }
+  else
+    {
+      printf("Reloading %s\n", path);
+      delete scenes[i].scn;
+    }
+  scenes[i].mtime = st.st_mtime;
+  scenes[i].scn = scn;
+  scenes[i].jobs = 1;
+  scenes[i].used = ++uses;
+  return scn;
+}
+
+void *render_server::render_main(void *arg)
+{
+  ((render_server *)arg)->render_jobs();
+  return 0;
+}
+
+void render_server::render_jobs()
+{
+  for(;;)
+    {
+      renderJob *job = queue.pop();
+      double start = now();
+      scene *scn = get_scene(job->scene);
+      if(!scn)
+	{
+	  queue.finish(job, JOB_FAILED);
+	  continue;
+	}
+      FrameBuffer *fb = new FrameBuffer(job->width, job->height);
+      apply_job(*job, *rend);
+      rend->reset_rays();
+      rend->render(scn, fb);
+      job->fb = fb;
+      job->seconds = now() - start;
+      job->rays = rend->get_rays();
+      printf("Rendered %dx%d of %s in %.3f s (%d queued)\n", job->width,
+	     job->height, job->scene, job->seconds, queue.size());
+      queue.finish(job, JOB_DONE);
+    }
+}
+
+void *render_server::client_main(void *arg_)
+{
+  clientArg *arg = (clientArg *)arg_;
+  arg->server->serve(arg->fd);
+  close(arg->fd);
+  delete arg;
+  return 0;
+}
+
+void render_server::serve(int client)
+{
+  char line[JOB_LINE];
+  renderJob *job = new renderJob;
+  if(read_line(client, line, sizeof(line)) <= 0 || parse_job(line, *job))
+    {
+      const char *msg = "ERROR malformed job\n";
+      write_all(client, msg, strlen(msg));
+      delete job;
+      return;
+    }
+  snprintf(line, sizeof(line), "QUEUED %d\n", queue.push(job));
+  write_all(client, line, strlen(line));
+  // the job is the queue's until finished, even if the client leaves
+  int state = queue.wait(job, JOB_QUEUED);
+  if(state == JOB_RUNNING)
+    {
+      write_all(client, "RUNNING\n", 8);
+      state = queue.wait(job, JOB_RUNNING);
+    }
+  if(state == JOB_FAILED)
+    {
+      snprintf(line, sizeof(line), "ERROR cannot load %s\n", job->scene);
+      write_all(client, line, strlen(line));
+    }
+  else
+    {
+      snprintf(line, sizeof(line), "DONE %.6f %lld\n", job->seconds,
+	       job->rays);
+      FILE *fp = fdopen(dup(client), "w");
+      if(fp && !write_all(client, line, strlen(line)))
+	job->fb->WritePFM(fp);
+      if(fp) fclose(fp);
+    }
+  delete job->fb;
+  delete job;
+}
@@ -0,0 +1,56 @@
+#ifndef _RENDER_SERVER_HH
+#define _RENDER_SERVER_HH 1
+
+#include <time.h>
+#include "job_queue.hh"
+
+// a scene kept loaded between jobs
+struct residentScene
+{
+  char path[JOB_PATH];
+  time_t mtime; // of the file when loaded
+  scene *scn;
+  int jobs; // rendered from it so far
+  long long used; // when last rendered, counting every job's scene
+};
+
+// most scenes kept loaded at once, the least recently used going
+// first to make room
+#define MAX_SCENES 8
+
+// Long-running service which renders jobs sent over a Unix socket.
+// Each client sends one job line and is answered with lines of
+// progress: "QUEUED n" (n jobs ahead of it), "RUNNING", and then either
+// "ERROR message" or "DONE seconds rays" followed by the image as a
+// color PFM.  Jobs are rendered one at a time, highest priority first,
+// on a pool of threads, and scenes stay loaded (with their meshes) for
+// later jobs until their files change.
+class render_server
+{
+public:
+  // render on n threads, or on one per processor if n is 0
+  render_server(int threads = 0);
+  ~render_server();
+  // listen on the Unix socket at path, returning -1 on failure
+  int listen(const char *path);
+  // accept and serve clients until killed
+  void run();
+protected:
+  int fd;
+  job_queue queue;
+  renderer *rend;
+  residentScene *scenes;
+  int num_scenes;
+  long long uses; // scenes fetched for jobs so far
+  // find the scene at path, loading it if it isn't resident or it or
+  // one of its meshes has changed, and return 0 if it can't be loaded
+  scene *get_scene(const char *path);
+  // render queued jobs forever
+  void render_jobs();
+  // serve the client connected on fd
+  void serve(int client);
+  static void *render_main(void *arg);
+  static void *client_main(void *arg);
+};
+
+#endif /* _RENDER_SERVER_HH */
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "render_worker.hh"
+#include "accel_cache.hh"
+#include "net.hh"
+
+// largest file a coordinator may send
+#define MAX_FILE (256LL << 20)
+
+// wall clock time in seconds
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+// whether name is a hash in hex, with an extension or none, and so
+// can't lead out of the cache
+static int cache_name(const char *name, unsigned long long &hash)
+{
+  int n = 0;
+  if(sscanf(name, "%16llx%n", &hash, &n) != 1 || n != 16) return 0;
+  if(!name[16]) return 1;
+  if(name[16] != '.' || !name[17]) return 0;
+  for(const char *p = name + 17; *p; p++)
+    if(!(*p >= 'a' && *p <= 'z') && !(*p >= '0' && *p <= '9')) return 0;
+  return 1;
+}
+
+// whether file is one a coordinator has sent, and so may be read by a
+// scene (see scene::load)
+static int cached_file(const char *file)
+{
+  unsigned long long hash;
+  return cache_name(file, hash) && !access(file, R_OK);
+}
+
+// answer an error and give up on the connection
+static int fail(int client, const char *msg)
+{
+  char line[256];
+  snprintf(line, sizeof(line), "ERROR %s\n", msg);
+  printf("%s", line);
+  write_all(client, line, strlen(line));
+  return -1;
+}
+
+// ############################## render_worker ##############################
+render_worker::render_worker(int threads)
+{
+  fd = -1;
+  rend = new renderer(threads);
+  scn = 0;
+  scene_name[0] = 0;
+}
+
+render_worker::~render_worker()
+{
+  if(fd != -1) close(fd);
+  delete scn;
+  delete rend;
+}
+
+int render_worker::listen(const char *address, int port)
+{
+  fd = listen_tcp(address, port);
+  return fd == -1 ? -1 : 0;
+}
+
+void render_worker::run()
+{
+  // a coordinator hanging up shouldn't take the worker down
+  signal(SIGPIPE, SIG_IGN);
+  for(;;)
+    {
+      int client = accept(fd, 0, 0);
+      if(client == -1)
+	{
+	  if(errno == EINTR) continue;
+	  printf("render_worker::run(): Cannot accept: %s\n", strerror(errno));
+	  return;
+	}
+      int on = 1;
+      setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      serve(client);
+      close(client);
+    }
+}
+
+void render_worker::serve(int client)
+{
+  char line[JOB_LINE];
+  renderJob job;
+  FrameBuffer *fb = 0;
+  int bands = 0;
+  while(read_line(client, line, sizeof(line)) > 0)
+    {
+      int y0, y1;
+      if(!strncmp(line, "FILE ", 5))
+	{
+	  if(receive_file(client, line)) break;
+	}
+      else if(!strncmp(line, "JOB ", 4))
+	{
+	  if(parse_job(line + 4, job))
+	    {
+	      fail(client, "malformed job");
+	      break;
+	    }
+	  if(load_scene(job))
+	    {
+	      fail(client, "cannot load the scene");
+	      break;
+	    }
+	  delete fb;
+	  fb = new FrameBuffer(job.width, job.height);
+	  apply_job(job, *rend);
+	  if(write_all(client, "READY\n", 6)) break;
+	}
+      else if(fb && sscanf(line, "BAND %d %d", &y0, &y1) == 2 && y0 >= 0
+	      && y0 < y1 && y1 <= job.height && !(y0 % TILE_SIZE))
+	{
+	  if(render_band(client, fb, y0, y1)) break;
+	  bands++;
+	}
+      else
+	{
+	  fail(client, "unknown request");
+	  break;
+	}
+    }
+  if(fb)
+    printf("Rendered %d bands of %dx%d\n", bands, job.width, job.height);
+  delete fb;
+}
+
+int render_worker::receive_file(int client, const char *line)
+{
+  char name[64];
+  long long size;
+  unsigned long long hash;
+  if(sscanf(line, "FILE %63s %lld", name, &size) != 2 || size < 0
+     || size > MAX_FILE || !cache_name(name, hash))
+    return fail(client, "malformed file");
+  if(!access(name, R_OK)) return write_all(client, "HAVE\n", 5);
+  if(write_all(client, "NEED\n", 5)) return -1;
+  char *data = (char *)malloc(size ? size : 1);
+  if(!data) return fail(client, "out of memory");
+  if(read_all(client, data, size))
+    {
+      free(data);
+      return -1;
+    }
+  if(accel_cache::hash_bytes(data, size) != hash)
+    {
+      free(data);
+      return fail(client, "file doesn't match its hash");
+    }
+  // write it under another name first, so that a worker killed midway
+  // doesn't leave a truncated file to be trusted later
+  char tmp[80];
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", name, (int)getpid());
+  FILE *fp = fopen(tmp, "wb");
+  int ret = !fp || fwrite(data, 1, size, fp) != (size_t)size;
+  free(data);
+  if((fp && fclose(fp)) || ret || rename(tmp, name))
+    {
+      unlink(tmp);
+      return fail(client, "cannot store file");
+    }
+  printf("Stored %s (%lld bytes)\n", name, size);
+  return write_all(client, "HAVE\n", 5);
+}
+
+int render_worker::load_scene(const renderJob &job)
+{
+  // scenes are named after hashes of their contents, meshes included,
+  // so one of the same name is the same scene
+  if(scn && !strcmp(scene_name, job.scene)) return 0;
+  delete scn;
+  scene_name[0] = 0;
+  scn = 0;
+  // read nothing but the files in the cache
+  if(!cached_file(job.scene)) return -1;
+  scn = new scene();
+  if(scn->load(job.scene, cached_file))
+    {
+      delete scn;
+      scn = 0;
+      return -1;
+    }
+  scn->sync_tree();
+  strcpy(scene_name, job.scene);
+  return 0;
+}
+
+int render_worker::render_band(int client, FrameBuffer *fb, int y0, int y1)
+{
+  double start = now();
+  rend->reset_rays();
+  rend->render_rows(scn, fb, y0, y1);
+  int width = fb->GetWidth();
+  float *rows = new float[(size_t)3 * width * (y1 - y0)], *p = rows;
+  for(int y = y0; y < y1; y++)
+    for(int x = 0; x < width; x++, p += 3)
+      {
+	const float *c = fb->ColorAt(x, y);
+	p[0] = c[0];
+	p[1] = c[1];
+	p[2] = c[2];
+      }
+  char line[128];
+  snprintf(line, sizeof(line), "DONE %d %d %.6f %lld\n", y0, y1,
+	   now() - start, rend->get_rays());
+  int ret = write_all(client, line, strlen(line))
+    || write_all(client, rows, (size_t)3 * width * (y1 - y0) * sizeof(float));
+  delete[] rows;
+  return ret ? -1 : 0;
+}
@@ -0,0 +1,47 @@
+#ifndef _RENDER_WORKER_HH
+#define _RENDER_WORKER_HH 1
+
+#include "job_queue.hh"
+
+// Process which renders bands of frames for a coordinator over TCP.
+// A coordinator connects and sends lines of requests:
+//   "FILE name size"  offers a file of the scene, named after the hash
+//                     of its contents; answered "HAVE" if it is
+//                     already cached, or "NEED", after which size bytes
+//                     of it follow and are answered "HAVE" once stored
+//   "JOB job"         sets the frame, as a job line naming a cached
+//                     scene; answered "READY" once it is loaded
+//   "BAND y0 y1"      renders rows [y0,y1) of the frame; answered
+//                     "DONE y0 y1 seconds rays" followed by the rows
+//                     as floats, red, green and blue for each pixel
+// and anything going wrong is answered "ERROR message" and ends the
+// connection.  Files are cached in the working directory, and the
+// last scene stays loaded for the next coordinator.  Scenes may only
+// name files in the cache, so nothing else is read.
+class render_worker
+{
+public:
+  // render on n threads, or on one per processor if n is 0
+  render_worker(int threads = 0);
+  ~render_worker();
+  // listen on port of the interface with address (or of any if it is
+  // 0), returning -1 on failure
+  int listen(const char *address, int port);
+  // serve coordinators, one at a time, until killed
+  void run();
+protected:
+  int fd;
+  renderer *rend;
+  scene *scn;
+  char scene_name[JOB_PATH]; // of the loaded scene
+  // serve the coordinator connected on fd
+  void serve(int client);
+  // answer "FILE name size", returning -1 if it can't be stored
+  int receive_file(int client, const char *line);
+  // load the scene of job unless it is loaded already
+  int load_scene(const renderJob &job);
+  // render the band [y0,y1) of fb and send it back
+  int render_band(int client, FrameBuffer *fb, int y0, int y1);
+};
+
+#endif /* _RENDER_WORKER_HH */
@@ -0,0 +1,318 @@
+#include <math.h>
+#include "renderer.hh"
+
+// pixels on a side of the blocks whose samples are traced together
+#define SAMPLE_BLOCK 4
+
+// hash pixel (x,y) and a sample number to a number in [0,1), so that
+// jitter is the same whichever thread traces the pixel
+static double jitter(unsigned int x, unsigned int y, unsigned int k)
+{
+  unsigned int h = x * 0x8da6b343u ^ y * 0xd8163841u ^ k * 0xcb1ab31fu;
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  h *= 0x846ca68bu;
+  h ^= h >> 16;
+  return (h >> 8) / 16777216.0;
+}
+
+// luminance of a color as displayed
+static double luminance(const Color &c)
+{
+  double r = c.r < 0 ? 0 : c.r > 1 ? 1 : c.r,
+    g = c.g < 0 ? 0 : c.g > 1 ? 1 : c.g,
+    b = c.b < 0 ? 0 : c.b > 1 ? 1 : c.b;
+  return 0.2126 * r + 0.7152 * g + 0.0722 * b;
+}
+
+// ############################## renderer ##############################
+renderer::renderer(int threads)
+{
+  pool = new thread_pool(threads);
+  inv = matrix::identity();
+  width = height = 6.0;
+  depth = 8.0;
+  perspective = 1;
+  packets = 1;
+  limits = scene::default_limits();
+  stride = 1;
+  skip = 0;
+  base_samples = max_samples = 1;
+  threshold = SAMPLE_THRESHOLD;
+  rays = new long long[pool->size()];
+  reset_rays();
+  scn = 0;
+  fb = 0;
+  tiles_x = first_tile = 0;
+}
+
+renderer::~renderer()
+{
+  delete pool;
+  delete[] rays;
+}
+
+void renderer::set_camera(const matrix &inv_, double width_, double depth_,
+			  int perspective_)
+{
+  inv = inv_;
+  width = width_;
+  depth = depth_;
+  perspective = perspective_;
+}
+
+void renderer::set_packets(int packets_)
+{
+  packets = packets_;
+}
+
+void renderer::set_max_depth(int max_depth)
+{
+  limits.max_depth = max_depth;
+}
+
+void renderer::set_pruning(double min_weight, int roulette)
+{
+  limits.min_weight = min_weight;
+  limits.roulette = roulette;
+}
+
+void renderer::set_pass(int stride_, int skip_)
+{
+  stride = stride_ > 1 ? stride_ : 1;
+  skip = skip_;
+}
+
+void renderer::set_samples(int base, int max, double threshold_)
+{
+  base_samples = base > 1 ? base : 1;
+  max_samples = max > base_samples ? max : base_samples;
+  threshold = threshold_;
+}
+
+long long renderer::get_rays() const
+{
+  long long n = 0;
+  for(int i = 0; i < pool->size(); i++)
+    n += rays[i];
+  return n;
+}
+
+void renderer::reset_rays()
+{
+  for(int i = 0; i < pool->size(); i++)
+    rays[i] = 0;
+}
+
+thread_pool *renderer::get_pool()
+{
+  return pool;
+}
+
+int renderer::num_tiles(FrameBuffer *fb_) const
+{
+  int samples_x = (fb_->GetWidth() + stride - 1) / stride,
+    samples_y = (fb_->GetHeight() + stride - 1) / stride;
+  return ((samples_x + TILE_SIZE - 1) / TILE_SIZE)
+    * ((samples_y + TILE_SIZE - 1) / TILE_SIZE);
+}
+
+void renderer::render(const scene *scn_, FrameBuffer *fb_)
+{
+  render(scn_, fb_, 0, num_tiles(fb_));
+}
+
+void renderer::render(const scene *scn_, FrameBuffer *fb_, int first,
+		      int last)
+{
+  scn = scn_;
+  fb = fb_;
+  height = width * fb->GetHeight() / fb->GetWidth();
+  tiles_x = ((fb->GetWidth() + stride - 1) / stride + TILE_SIZE - 1)
+    / TILE_SIZE;
+  first_tile = first;
+  pool->run(this, last - first);
+  scn = 0;
+  fb = 0;
+}
+
+void renderer::render_rows(const scene *scn_, FrameBuffer *fb_, int y0,
+			   int y1)
+{
+  int across = ((fb_->GetWidth() + stride - 1) / stride + TILE_SIZE - 1)
+    / TILE_SIZE, rows = TILE_SIZE * stride,
+    last = (fb_->GetHeight() + rows - 1) / rows;
+  y1 = (y1 + rows - 1) / rows;
+  render(scn_, fb_, y0 / rows * across, (y1 < last ? y1 : last) * across);
+}
+
+void renderer::run(int item, int thread)
+{
+  int samples_x = (fb->GetWidth() + stride - 1) / stride,
+    samples_y = (fb->GetHeight() + stride - 1) / stride;
+  item += first_tile;
+  int x0 = item % tiles_x * TILE_SIZE, y0 = item / tiles_x * TILE_SIZE,
+    x1 = x0 + TILE_SIZE, y1 = y0 + TILE_SIZE;
+  if(x1 > samples_x) x1 = samples_x;
+  if(y1 > samples_y) y1 = samples_y;
+  if(stride == 1 && !skip && max_samples > 1)
+    render_tile_adaptive(x0, y0, x1, y1, thread);
+  else render_tile(x0, y0, x1, y1, thread);
+}
+
+void renderer::cast_ray(const matrix &inv, double depth, int perspective,
+			double x, double y, point &orig, point &dir)
+{
+  if(perspective)
+    {
+      // choose a ray extending from the camera origin
+      orig = inv * point(0,0,0);
+      dir = inv * vector(x, y, - depth);
+    }
+  else
+    {
+      // choose a ray perpendicular to image plane
+      orig = inv * point(x, y, 0);
+      dir = inv * vector(0,0,-depth);
+    }
+}
+
+void renderer::render_tile(int x0, int y0, int x1, int y1, int thread)
+{
+  int w = fb->GetWidth(), h = fb->GetHeight(),
+    block = packets ? PACKET_DIM : 1, x[PACKET_SIZE], y[PACKET_SIZE];
+  point orig[PACKET_SIZE], dir[PACKET_SIZE];
+  Color color[PACKET_SIZE];
+  // only gather what the buffer has channels for
+  pixelInfo info_buf[PACKET_SIZE], *info = fb->GetChannels() ? info_buf : 0;
+  // trace each block of samples as one packet
+  for(int i0 = x0; i0 < x1; i0 += block)
+    for(int j0 = y0; j0 < y1; j0 += block)
+      {
+	int n = 0;
+	for(int j = j0; j < j0 + block && j < y1; j++)
+	  for(int i = i0; i < i0 + block && i < x1; i++)
+	    {
+	      x[n] = i * stride;
+	      y[n] = j * stride;
+	      if(skip && x[n] % skip == 0 && y[n] % skip == 0) continue;
+	      cast_ray(inv, depth, perspective,
+		       2 * width * (double)x[n] / w - width,
+		       2 * height * (double)y[n] / h - height,
+		       orig[n], dir[n]);
+	      n++;
+	    }
+	if(!n) continue;
+	rays[thread] += n;
+	if(packets) scn->ray_trace(n, orig, dir, 1.0, limits, color, info);
+	else color[0] = scn->ray_trace(orig[0], dir[0], 1.0, limits, info);
+	for(int k = 0; k < n; k++)
+	  fill(x[k], y[k], color[k], info ? &info[k] : 0);
+      }
+}
+
+void renderer::render_tile_adaptive(int x0, int y0, int x1, int y1,
+				    int thread)
+{
+  pixelSamples px[TILE_SIZE * TILE_SIZE];
+  // cleared, as the compiler can't tell that the loops below fill
+  // every entry add_samples reads
+  int todo[TILE_SIZE * TILE_SIZE] = { 0 }, count = 0, row = x1 - x0;
+  // list the pixels a block at a time, so that the samples traced
+  // together in a packet are close
+  for(int j0 = y0; j0 < y1; j0 += SAMPLE_BLOCK)
+    for(int i0 = x0; i0 < x1; i0 += SAMPLE_BLOCK)
+      for(int j = j0; j < j0 + SAMPLE_BLOCK && j < y1; j++)
+	for(int i = i0; i < i0 + SAMPLE_BLOCK && i < x1; i++)
+	  {
+	    pixelSamples &p = px[(j - y0) * row + i - x0];
+	    p.sum = Color();
+	    p.lum = p.lum2 = 0;
+	    p.n = p.mixed = 0;
+	    todo[count++] = (j - y0) * row + i - x0;
+	  }
+  add_samples(px, x0, y0, row, todo, count, base_samples, thread);
+
+  // spend the rest of the budget where the samples disagree, within a
+  // pixel or with those of a neighbour
+  for(int j = 0; j < y1 - y0; j++)
+    for(int i = 0; i < row; i++)
+      {
+	pixelSamples &p = px[j * row + i];
+	double var = p.n > 1 ? (p.lum2 - p.lum * p.lum / p.n) / (p.n - 1) : 0;
+	if(var > threshold * threshold) p.mixed = 1;
+	for(int d = 0; d < 2; d++)
+	  {
+	    if(d ? j + 1 == y1 - y0 : i + 1 == row) continue;
+	    pixelSamples &q = px[d ? (j + 1) * row + i : j * row + i + 1];
+	    if(p.info.object != q.info.object
+	       || fabs(p.lum / p.n - q.lum / q.n) > 2 * threshold)
+	      p.mixed = q.mixed = 1;
+	  }
+      }
+  int refine = 0;
+  for(int k = 0; k < count; k++)
+    if(px[todo[k]].mixed) todo[refine++] = todo[k];
+  add_samples(px, x0, y0, row, todo, refine, max_samples - base_samples,
+	      thread);
+
+  for(int j = y0; j < y1; j++)
+    for(int i = x0; i < x1; i++)
+      {
+	const pixelSamples &p = px[(j - y0) * row + i - x0];
+	fb->SetPixel(i, j, p.sum * (1.0 / p.n));
+	if(fb->GetChannels()) fb->SetInfo(i, j, p.info);
+      }
+}
+
+void renderer::add_samples(pixelSamples *px, int x0, int y0, int row,
+			   const int *todo, int count, int n, int thread)
+{
+  int grid = (int)sqrt((double)n), w = fb->GetWidth(), h = fb->GetHeight(),
+    owner[PACKET_SIZE], m = 0;
+  point orig[PACKET_SIZE], dir[PACKET_SIZE];
+  Color color[PACKET_SIZE];
+  pixelInfo info[PACKET_SIZE];
+  if(grid < 1) return;
+  for(int k = 0; k < count; k++)
+    {
+      int x = x0 + todo[k] % row, y = y0 + todo[k] / row, first = px[todo[k]].n;
+      // one jittered sample in each cell of a grid over the pixel
+      for(int s = 0; s < grid * grid; s++)
+	{
+	  double sx = x + (s % grid + jitter(x, y, 2 * (first + s))) / grid,
+	    sy = y + (s / grid + jitter(x, y, 2 * (first + s) + 1)) / grid;
+	  cast_ray(inv, depth, perspective, 2 * width * sx / w - width,
+		   2 * height * sy / h - height, orig[m], dir[m]);
+	  owner[m++] = todo[k];
+	  if(m < (packets ? PACKET_SIZE : 1)
+	     && (k + 1 < count || s + 1 < grid * grid))
+	    continue;
+	  rays[thread] += m;
+	  if(packets) scn->ray_trace(m, orig, dir, 1.0, limits, color, info);
+	  else color[0] = scn->ray_trace(orig[0], dir[0], 1.0, limits, info);
+	  for(int i = 0; i < m; i++)
+	    {
+	      pixelSamples &p = px[owner[i]];
+	      double l = luminance(color[i]);
+	      if(!p.n) p.info = info[i];
+	      else
+		{
+		  if(info[i].object != p.info.object) p.mixed = 1;
+		  p.info.rays += info[i].rays;
+		}
+	      p.sum += color[i];
+	      p.lum += l;
+	      p.lum2 += l * l;
+	      p.n++;
+	    }
+	  m = 0;
+	}
+    }
+}
+
+void renderer::fill(int x, int y, Color c, const pixelInfo *info)
+{
+  fb->FillRect(x, y, x + stride, y + stride, c, info);
+}
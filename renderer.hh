@@ -0,0 +1,102 @@
+#ifndef _RENDERER_HH
+#define _RENDERER_HH 1
+
+#include "scene.hh"
+#include "frame_buffer.hh"
+#include "thread_pool.hh"
+
+// side of the square tiles (in samples) a pass is split into
+#define TILE_SIZE 16
+// default sample budget of adaptive supersampling: samples taken in
+// every pixel, samples allowed in pixels found to need more, and the
+// standard deviation of luminance over a pixel which calls for more
+#define BASE_SAMPLES 4
+#define MAX_SAMPLES 20
+#define SAMPLE_THRESHOLD 0.005
+
+// samples of a pixel being supersampled
+struct pixelSamples
+{
+  Color sum;
+  double lum, lum2; // sums of the luminance and its square
+  int n;
+  int mixed; // whether samples hit different surfaces
+  pixelInfo info; // the first sample's hit, and the rays of them all
+};
+
+// Ray traces a scene into a FrameBuffer, handing its tiles to a pool
+// of threads.  Only const methods of the scene are used, so it must
+// not be changed while rendering.
+class renderer : public pool_job
+{
+public:
+  // render on n threads, or on one per processor if n is 0
+  renderer(int threads = 0);
+  ~renderer();
+  // set the camera: inv maps camera to world coordinates, and the
+  // image plane spans [-width,width] across at distance depth (and as
+  // far as the frame's shape allows up and down)
+  void set_camera(const matrix &inv, double width, double depth,
+		  int perspective);
+  // trace primary rays in packets or singly
+  void set_packets(int packets);
+  // set the number of bounces traced after the first hit
+  void set_max_depth(int max_depth);
+  // cut short branches of paths weighing less than min_weight, by
+  // Russian roulette if roulette is set (see traceLimits)
+  void set_pruning(double min_weight, int roulette);
+  // trace every stride'th pixel in each direction, filling the block
+  // of pixels each stands for, but skip those traced by an earlier
+  // pass of stride skip (if skip is nonzero)
+  void set_pass(int stride, int skip);
+  // supersample a pass of stride 1: take base stratified samples in
+  // every pixel, and up to max in those whose samples hit different
+  // surfaces or vary in luminance by more than threshold.  Only one
+  // sample is taken in each pixel if max is 1.
+  void set_samples(int base, int max, double threshold = SAMPLE_THRESHOLD);
+  // count of primary rays traced since the last call to reset_rays
+  long long get_rays() const;
+  void reset_rays();
+  // render the whole pass of scn into fb
+  void render(const scene *scn, FrameBuffer *fb);
+  // render tiles [first,last) of the pass
+  void render(const scene *scn, FrameBuffer *fb, int first, int last);
+  // render the tiles of the pass covering rows [y0,y1) of fb, where y0
+  // is a multiple of TILE_SIZE times the stride
+  void render_rows(const scene *scn, FrameBuffer *fb, int y0, int y1);
+  // number of tiles in a pass over fb
+  int num_tiles(FrameBuffer *fb) const;
+  thread_pool *get_pool();
+  // calculate the ray through (x,y) on the image plane
+  static void cast_ray(const matrix &inv, double depth, int perspective,
+		       double x, double y, point &orig, point &dir);
+  // render tile i
+  void run(int item, int thread);
+protected:
+  thread_pool *pool;
+  matrix inv;
+  double width, depth;
+  double height; // half height of the image plane for the frame
+  int perspective, packets;
+  traceLimits limits;
+  int stride, skip;
+  int base_samples, max_samples;
+  double threshold;
+  long long *rays; // primary rays traced by each thread
+  // the frame being rendered
+  const scene *scn;
+  FrameBuffer *fb;
+  int tiles_x, first_tile;
+  // trace the samples [x0,x1) x [y0,y1) of the pass
+  void render_tile(int x0, int y0, int x1, int y1, int thread);
+  // supersample the pixels [x0,x1) x [y0,y1)
+  void render_tile_adaptive(int x0, int y0, int x1, int y1, int thread);
+  // add n stratified samples (rounded down to a square) to each of
+  // the count pixels listed in todo, which index px by row from (x0,y0)
+  void add_samples(pixelSamples *px, int x0, int y0, int row,
+		   const int *todo, int count, int n, int thread);
+  // set the block of pixels sample (x,y) stands for
+  void fill(int x, int y, Color c, const pixelInfo *info);
+};
+
+#endif /* _RENDERER_HH */
@@ -2,7 +2,50 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <float.h>
 #include "scene.hh"
+#include "thread_pool.hh"
+
+// rebuild the top-level hierarchy once refitting has made it this
+// much more expensive to traverse than when it was built
+#define REBUILD_RATIO 1.5
+
+// kinds of intersection test made against each surface
+#define HIT_FINE 0 // nearest hit, with vertex and normal
+#define HIT_COARSE 1 // nearest hit on the bounding volume
+#define HIT_ANY 2 // any hit at all
+
+// a mesh as named by a scene file, to be loaded
+struct meshEntry
+{
+  char file[255];
+  double scale, rot_x, rot_y, rot_z, trans_x, trans_y, trans_z;
+};
+
+// Loads the meshes of a scene, one item apiece.  Meshes sharing a file
+// wait for whichever loads it first (see geometry::acquire).
+class mesh_loader : public pool_job
+{
+public:
+  mesh *meshes;
+  const meshEntry *entry;
+  int *ret;
+  void run(int i, int)
+  {
+    const meshEntry &e = entry[i];
+    ret[i] = meshes[i].load(e.file, e.scale, e.rot_x, e.rot_y, e.rot_z,
+			    e.trans_x, e.trans_y, e.trans_z);
+  }
+};
+
+// the nearest surface hit so far
+struct sceneHit
+{
+  point orig, dir;
+  int mode;
+  int surface;
+  point vertex, normal;
+};
 
 scene::scene()
 {
@@ -11,6 +54,9 @@ scene::scene()
   meshes = 0;
   num_lights = num_spheres = num_meshes = num_surfaces = 0;
   selected = -1;
+  top = 0;
+  tree_version = 0;
+  light_bvh = 0;
 }
 
 scene::scene(const char *filename)
@@ -20,6 +66,9 @@ scene::scene(const char *filename)
   meshes = 0;
   num_lights = num_spheres = num_meshes = num_surfaces = 0;
   selected = -1;
+  top = 0;
+  tree_version = 0;
+  light_bvh = 0;
   load(filename);
 }
 
@@ -28,7 +77,7 @@ scene::~scene()
   unload();
 }
 
-int scene::load(const char *filename)
+int scene::load(const char *filename, int (*allow)(const char *file))
 {
   unload();
   int ret = 0;
@@ -44,9 +93,9 @@ int scene::load(const char *filename)
   spheres = new sphere[num_spheres];
   meshes = new mesh[num_meshes];
 
-  char mesh_file[255];
-  int ltype;
-  double scale_, rot_x, rot_y, rot_z, trans_x, trans_y, trans_z,
+  meshEntry *entry = new meshEntry[num_meshes];
+  int ltype, loaded = 0;
+  double scale_, trans_x, trans_y, trans_z,
     r_ambient, g_ambient, b_ambient, r_diffuse, g_diffuse, b_diffuse,
     r_specular, g_specular, b_specular, k_ambient, k_diffuse, k_specular,
     shininess, index, k_reflective, k_refractive;
@@ -66,6 +115,15 @@ int scene::load(const char *filename)
       lights[i] = light(ltype, point(trans_x, trans_y, trans_z),
 			Color(r_ambient, g_ambient, b_ambient));
     }
+  // many point lights are lit through a tree over them
+  int point_lights = 0;
+  for(int i = 0; i < num_lights; i++)
+    if(lights[i].pos.get_w()) point_lights++;
+  if(point_lights > LIGHT_TREE_MIN)
+    {
+      light_bvh = new light_tree();
+      light_bvh->build(lights, num_lights);
+    }
   for(int i = 0; i < num_spheres; i++)
     {
       if(feof(fp))
@@ -82,13 +140,14 @@ int scene::load(const char *filename)
 	 &k_ambient, &k_diffuse, &k_specular, &shininess, &index,
 	 &k_reflective, &k_refractive
 	);
-      spheres[i].set_lighting
-	(
-	 Color(r_ambient, g_ambient, b_ambient) * k_ambient,
-	 Color(r_diffuse, g_diffuse, b_diffuse) * k_diffuse,
-	 Color(r_specular, g_specular, b_specular) * k_specular,
-	 shininess, index, k_reflective, k_refractive
-	);
+      spheres[i].set_material
+	(&materials, materials.add(material
+	 (
+	  Color(r_ambient, g_ambient, b_ambient) * k_ambient,
+	  Color(r_diffuse, g_diffuse, b_diffuse) * k_diffuse,
+	  Color(r_specular, g_specular, b_specular) * k_specular,
+	  shininess, index, k_reflective, k_refractive
+	 )));
       spheres[i].scale(scale_, scale_, scale_);
       spheres[i].translate(trans_x, trans_y, trans_z);
     }
@@ -99,34 +158,63 @@ int scene::load(const char *filename)
 	  ret = -1;
 	  break;
 	}
+      meshEntry &e = entry[loaded++];
+      e.file[0] = 0;
       fscanf
 	(
-	 fp, "M %s %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf\n",
-	 mesh_file, &scale_, &rot_x, &rot_y, &rot_z, &trans_x, &trans_y,
-	 &trans_z, &r_ambient, &g_ambient, &b_ambient, &r_diffuse,
-	 &g_diffuse, &b_diffuse, &r_specular, &g_specular, &b_specular,
-	 &k_ambient, &k_diffuse, &k_specular, &shininess, &index,
-	 &k_reflective, &k_refractive
-	);
-      meshes[i].set_lighting
-	(
-	 Color(r_ambient, g_ambient, b_ambient) * (k_ambient),
-	 Color(r_diffuse, g_diffuse, b_diffuse) * (k_diffuse),
-	 Color(r_specular, g_specular, b_specular) * (k_specular),
-	 shininess, index, k_reflective, k_refractive
+	 fp, "M %254s %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf\n",
+	 e.file, &e.scale, &e.rot_x, &e.rot_y, &e.rot_z, &e.trans_x,
+	 &e.trans_y, &e.trans_z, &r_ambient, &g_ambient, &b_ambient,
+	 &r_diffuse, &g_diffuse, &b_diffuse, &r_specular, &g_specular,
+	 &b_specular, &k_ambient, &k_diffuse, &k_specular, &shininess,
+	 &index, &k_reflective, &k_refractive
 	);
-      ret |= meshes[i].load
-	(mesh_file, scale_, rot_x, rot_y, rot_z, trans_x, trans_y, trans_z);
+      meshes[i].set_material
+	(&materials, materials.add(material
+	 (
+	  Color(r_ambient, g_ambient, b_ambient) * (k_ambient),
+	  Color(r_diffuse, g_diffuse, b_diffuse) * (k_diffuse),
+	  Color(r_specular, g_specular, b_specular) * (k_specular),
+	  shininess, index, k_reflective, k_refractive
+	 )));
     }
+  fclose(fp);
+  for(int i = 0; allow && i < loaded; i++)
+    if(!allow(entry[i].file))
+      {
+	printf("scene::load(): Refusing to read %s!\n", entry[i].file);
+	loaded = 0;
+	ret = -1;
+      }
+
+  // read the meshes in parallel, as reading and building hierarchies
+  // for each is independent of the rest
+  int *mesh_ret = new int[num_meshes];
+  mesh_loader job;
+  job.meshes = meshes;
+  job.entry = entry;
+  job.ret = mesh_ret;
+  if(loaded > 1)
+    {
+      thread_pool pool;
+      pool.run(&job, loaded);
+    }
+  else if(loaded) job.run(0, 0);
+  for(int i = 0; i < loaded; i++)
+    ret |= mesh_ret[i];
+  delete[] mesh_ret;
+  delete[] entry;
+  build_tree();
   return ret;
 }
 
-point scene::reflect(point incoming, point normal)
+point scene::reflect(point incoming, point normal) const
 {
   return incoming - normal * (2 * (incoming * normal));
 }
 
-point scene::refract(point incoming, point normal, double n1, double n2)
+point scene::refract(point incoming, point normal, double n1,
+		     double n2) const
 {
   double IdotN = normal * incoming;
   point tangent = (incoming - normal * IdotN) * (n2 / n1);
@@ -152,9 +240,74 @@ void scene::unload()
       delete[] meshes;
       meshes = 0;
     }
+  if(top)
+    {
+      delete top;
+      top = 0;
+    }
+  if(tree_version)
+    {
+      delete[] tree_version;
+      tree_version = 0;
+    }
+  materials.clear();
+  if(light_bvh)
+    {
+      delete light_bvh;
+      light_bvh = 0;
+    }
   num_lights = num_spheres = num_meshes = num_surfaces = 0;
 }
 
+void scene::build_tree()
+{
+  if(!top) top = new bvh();
+  if(tree_version) delete[] tree_version;
+  tree_version = new unsigned int[num_surfaces];
+  double (*min)[3] = new double[num_surfaces][3],
+    (*max)[3] = new double[num_surfaces][3];
+  for(int i = 0; i < num_surfaces; i++)
+    {
+      get_surface(i)->world_bounds(min[i], max[i]);
+      tree_version[i] = get_surface(i)->get_version();
+    }
+  top->build(num_surfaces, min, max, 1);
+  delete[] min;
+  delete[] max;
+}
+
+void scene::update_tree(int i)
+{
+  double min[3], max[3];
+  if(!top || !get_surface(i)) return;
+  // nothing to do if the surface hasn't moved
+  if(tree_version[i] == get_surface(i)->get_version()) return;
+  tree_version[i] = get_surface(i)->get_version();
+  get_surface(i)->world_bounds(min, max);
+  top->update(i, min, max);
+  if(top->degradation() > REBUILD_RATIO) top->rebuild();
+}
+
+void scene::sync_tree()
+{
+  for(int i = 0; i < num_surfaces; i++)
+    update_tree(i);
+}
+
+int scene::meshes_changed() const
+{
+  // copies of a mesh are usually listed together, so check each file
+  // once per run of them
+  const geometry *last = 0;
+  for(int i = 0; i < num_meshes; i++)
+    {
+      const geometry *geom = meshes[i].get_geometry();
+      if(geom && geom != last && geom->changed()) return 1;
+      last = geom;
+    }
+  return 0;
+}
+
 surface * scene::get_surface(int i)
 {
   if(i < 0 || i >= num_surfaces) return 0;
@@ -162,104 +315,436 @@ surface * scene::get_surface(int i)
   return meshes + i - num_spheres;
 }
 
+const surface * scene::get_surface(int i) const
+{
+  if(i < 0 || i >= num_surfaces) return 0;
+  if(i < num_spheres) return spheres + i;
+  return meshes + i - num_spheres;
+}
+
 // transform object about global axes
 void scene::rotate(double theta, double vx, double vy, double vz)
 {
-  if(get_surface(selected)) get_surface(selected)->rotate(theta, vx, vy, vz);
+  if(get_surface(selected))
+    {
+      get_surface(selected)->rotate(theta, vx, vy, vz);
+      update_tree(selected);
+    }
 }
 
 void scene::scale(double sx, double sy, double sz)
 {
-  if(get_surface(selected)) get_surface(selected)->scale(sx,sy,sz);
+  if(get_surface(selected))
+    {
+      get_surface(selected)->scale(sx,sy,sz);
+      update_tree(selected);
+    }
 }
 
 void scene::translate(double tx, double ty, double tz)
 {
-  if(get_surface(selected)) get_surface(selected)->translate(tx,ty,tz);
+  if(get_surface(selected))
+    {
+      get_surface(selected)->translate(tx,ty,tz);
+      update_tree(selected);
+    }
 }
 
 // transform object about local axes
 void scene::rotate_local(double theta, double vx, double vy, double vz)
 {
-  if(get_surface(selected)) get_surface(selected)->rotate_local(theta, vx, vy, vz);
+  if(get_surface(selected))
+    {
+      get_surface(selected)->rotate_local(theta, vx, vy, vz);
+      update_tree(selected);
+    }
 }
 
 void scene::scale_local(double sx, double sy, double sz)
 {
-  if(get_surface(selected)) get_surface(selected)->scale_local(sx,sy,sz);
+  if(get_surface(selected))
+    {
+      get_surface(selected)->scale_local(sx,sy,sz);
+      update_tree(selected);
+    }
 }
 
 void scene::translate_local(double tx, double ty, double tz)
 {
-  if(get_surface(selected)) get_surface(selected)->translate_local(tx,ty,tz);
+  if(get_surface(selected))
+    {
+      get_surface(selected)->translate_local(tx,ty,tz);
+      update_tree(selected);
+    }
 }
 
-void scene::intersection(point orig, point dir)
+int scene::nearest(point orig, point dir, int coarse, double &t,
+		   point &vertex, point &normal) const
+{
+  if(!top) return -1;
+  bvhRay ray;
+  sceneHit hit;
+  hit.orig = orig;
+  hit.dir = dir;
+  hit.mode = coarse ? HIT_COARSE : HIT_FINE;
+  hit.surface = -1;
+  bvh::make_ray(ray, orig, dir);
+  t = top->intersect(this, ray, &hit);
+  if(t == -1.0) return -1;
+  vertex = hit.vertex;
+  normal = hit.normal;
+  return hit.surface;
+}
+
+double scene::intersect_primitive(int prim, const bvhRay &, double tmax,
+				  void *data) const
 {
-  int closest = -1;
-  double distance, t;
+  sceneHit *hit = (sceneHit *)data;
+  point vert, norm;
+  // any value other than -1 ends an occlusion query
+  if(hit->mode == HIT_ANY)
+    return get_surface(prim)->occluded(hit->orig, hit->dir, tmax) ? tmax
+      : -1.0;
+  double t = hit->mode == HIT_COARSE
+    ? get_surface(prim)->intersect(hit->orig, hit->dir)
+    : get_surface(prim)->fine_intersect(hit->orig, hit->dir, vert, norm);
+  if(t == -1.0 || t >= tmax) return -1.0;
+  hit->surface = prim;
+  hit->vertex = vert;
+  hit->normal = norm;
+  return t;
+}
 
-  // find closest object which intersects ray
-  for(int i = 0; i < num_surfaces; i++)
+void scene::intersect_packet(int prim, ray_packet &packet, int first,
+			     int last, void *) const
+{
+  get_surface(prim)->trace_packet(packet, prim, first, last);
+}
+
+void scene::nearest(ray_packet &packet) const
+{
+  if(top) packet.intersect(*top, this, 0);
+}
+
+int scene::occluded(point orig, point dir, double tmax) const
+{
+  if(!top) return 0;
+  bvhRay ray;
+  sceneHit hit;
+  hit.orig = orig;
+  hit.dir = dir;
+  hit.mode = HIT_ANY;
+  bvh::make_ray(ray, orig, dir);
+  return top->occluded(this, ray, tmax, &hit);
+}
+
+int scene::shadowed(point vertex, const light &l) const
+{
+  // point lights are only blocked by surfaces closer than the light
+  if(l.pos.get_w())
     {
-      t = get_surface(i)->intersect(orig, dir);
-      if(t != -1 && (closest == -1 || t < distance) )
-	{
-	  distance = t;
-	  closest = i;
-	}
+      point to_light = l.pos - vertex;
+      double dist = to_light.norm();
+      return occluded(vertex, to_light / dist, dist);
     }
+  point dir = l.pos;
+  return occluded(vertex, dir.normalize(), DBL_MAX);
+}
+
+void scene::intersection(point orig, point dir)
+{
+  double t;
+  point vert, norm;
+
+  // find closest object which intersects ray
+  int closest = nearest(orig, dir, 1, t, vert, norm);
 
   // select said object
   if(closest != -1) select(closest);
 }
 
-// only do a lighting calculation for now
-Color scene::ray_trace(point orig, point dir, double index, int depth)
+// describe a ray's first hit (if any) at distance t
+static void set_info(pixelInfo *info, int hit, double t, const point &norm,
+		     unsigned int rays)
+{
+  info->depth = hit != -1 ? t : 0;
+  info->normal[0] = hit != -1 ? norm.get_x() : 0;
+  info->normal[1] = hit != -1 ? norm.get_y() : 0;
+  info->normal[2] = hit != -1 ? norm.get_z() : 0;
+  info->object = hit;
+  info->rays = rays;
+}
+
+// a seed for the random choices along a path, fixed by its primary
+// ray so that a frame renders the same on any thread or machine
+static unsigned long long path_seed(point orig, point dir)
 {
-  int closest = -1;
-  double distance, t;
+  double ray[6] = { orig[0], orig[1], orig[2], dir[0], dir[1], dir[2] };
+  return accel_cache::hash_bytes(ray, sizeof(ray));
+}
+
+// uniform in [0,1), by splitmix64
+static double next_random(unsigned long long &seed)
+{
+  unsigned long long z = (seed += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z ^= z >> 31;
+  return (z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+traceLimits scene::default_limits()
+{
+  traceLimits limits;
+  limits.max_depth = 4;
+  limits.min_weight = MIN_WEIGHT;
+  limits.roulette = 0;
+  return limits;
+}
+
+Color scene::ray_trace(point orig, point dir, double index,
+		       const traceLimits &limits, pixelInfo *info) const
+{
+  double t;
   Color color;
-  point vert, norm, vert0, norm0;
+  point vert, norm;
   dir.normalize();
 
   // find closest object which intersects ray
-  for(int i = 0; i < num_surfaces; i++)
+  int closest = nearest(orig, dir, 0, t, vert, norm);
+  unsigned int rays = 1;
+
+  // we've hit a surface
+  if(closest != -1)
+    {
+      const surface *s = get_surface(closest);
+      color = shade(s, lighting(s, dir, vert, norm, rays), dir, vert,
+		    norm, index, limits, rays);
+    }
+
+  if(info) set_info(info, closest, t, norm, rays);
+  return color;
+}
+
+void scene::ray_trace(int n, const point *orig, const point *dir,
+		      double index, const traceLimits &limits, Color *color,
+		      pixelInfo *info) const
+{
+  ray_packet packet;
+  point dirs[PACKET_SIZE], vert[PACKET_SIZE], norm[PACKET_SIZE];
+  unsigned int rays[PACKET_SIZE];
+  int order[PACKET_SIZE], lit = 0;
+  if(n > PACKET_SIZE) n = PACKET_SIZE;
+  packet.reset(n);
+  for(int i = 0; i < n; i++)
     {
-      t = get_surface(i)->fine_intersect(orig, dir, vert0, norm0);
-      if(t != -1 && (closest == -1 || t < distance) )
+      dirs[i] = dir[i];
+      dirs[i].normalize();
+      packet.set_ray(i, orig[i], dirs[i]);
+    }
+  packet.prepare();
+  nearest(packet);
+
+  for(int i = 0; i < n; i++)
+    {
+      const surface *s = get_surface(packet.surface[i]);
+      rays[i] = 1;
+      if(!s)
 	{
-	  distance = t;
-	  closest = i;
-	  vert = vert0;
-	  norm = norm0;
+	  color[i] = Color();
+	  if(info) set_info(&info[i], -1, 0, norm[i], rays[i]);
 	}
+      else if(s->packet_hit(packet, i, orig[i], dirs[i], vert[i], norm[i]))
+	color[i] = ray_trace(orig[i], dir[i], index, limits,
+			     info ? &info[i] : 0);
+      else order[lit++] = i;
+    }
+  // the hits are lit in batches, then secondary rays are traced one at
+  // a time
+  for(int k = 0; k < lit; k += SHADE_BATCH)
+    lighting(packet.surface, order + k,
+	     lit - k < SHADE_BATCH ? lit - k : SHADE_BATCH, dirs, vert, norm,
+	     color, rays);
+  for(int k = 0; k < lit; k++)
+    {
+      int i = order[k];
+      color[i] = shade(get_surface(packet.surface[i]), color[i], dirs[i],
+		       vert[i], norm[i], index, limits, rays[i]);
+      if(info)
+	set_info(&info[i], packet.surface[i], packet.t[i], norm[i], rays[i]);
     }
+}
 
-  // we've hit a surface
-  if(closest != -1)
+Color scene::shade(const surface *s, Color color, point dir, point vert,
+		   point norm, double index, const traceLimits &limits,
+		   unsigned int &rays) const
+{
+  traceItem stack[TRACE_STACK];
+  int waiting = 0;
+  unsigned long long seed = path_seed(vert, dir);
+  // jobs deeper than the stack are refused (see valid_job), and this
+  // only keeps other callers within it
+  int depth = limits.max_depth < MAX_TRACE_DEPTH ? limits.max_depth
+    : MAX_TRACE_DEPTH;
+  branch(stack, waiting, s, dir, vert, norm, index, 1.0, depth, limits,
+	 seed);
+
+  // follow the branches depth first, so that the stack holds at most
+  // one waiting sibling for each bounce
+  while(waiting > 0)
     {
-      surface *s = get_surface(closest);
-      // calculate ambient illumination
-      color = s->phong_ambient();
-      for(int i = 0; i < num_lights; i++)
-	// calculate local illumination
-	color += s->phong(dir, lights[i], depth, vert, norm);
-      if(depth > 0)
+      traceItem item = stack[--waiting];
+      double t;
+      item.dir.normalize();
+      int hit = nearest(item.orig, item.dir, 0, t, vert, norm);
+      rays++;
+      if(hit == -1) continue;
+      s = get_surface(hit);
+      color += lighting(s, item.dir, vert, norm, rays) * item.weight;
+      branch(stack, waiting, s, item.dir, vert, norm, item.index,
+	     item.weight, item.depth, limits, seed);
+    }
+  return color;
+}
+
+Color scene::lighting(const surface *s, point dir, point vert, point norm,
+		      unsigned int &rays) const
+{
+  const material &m = s->get_material();
+  // calculate ambient illumination
+  Color color = m.phong_ambient();
+  if(light_bvh) light_cut(m, dir, vert, norm, color, rays);
+  for(int i = 0; i < num_lights; i++)
+    {
+      if(light_bvh && lights[i].pos.get_w()) continue;
+      // calculate local illumination, only casting a shadow ray if the
+      // light could contribute
+      Color c = m.phong(dir, lights[i], vert, norm);
+      if((c.r || c.g || c.b) && (rays++, !shadowed(vert, lights[i])))
+	color += c;
+    }
+  return color;
+}
+
+void scene::lighting(const int *hit, int *order, int n, const point *dir,
+		     const point *vert, const point *norm, Color *color,
+		     unsigned int *rays) const
+{
+  // sort the hits by material, keeping their order within each
+  int id[SHADE_BATCH];
+  for(int k = 0; k < n; k++)
+    id[k] = get_surface(hit[order[k]])->get_material_id();
+  for(int k = 1; k < n; k++)
+    {
+      int i = order[k], m = id[k], j = k;
+      for(; j > 0 && id[j - 1] > m; j--)
 	{
-	  double k;
-	  if( (k = s->reflection()) )
-	    color += ray_trace(vert, reflect(dir, norm), index, depth - 1) * k;
-	  if( (k = s->refraction()) )
-	    {
-	      point next_dir = refract(dir, norm, index, s->index());
-	      if(next_dir.nonzero())
-		color += ray_trace(vert, next_dir, s->index(), depth -1) * k;
-	    }
+	  order[j] = order[j - 1];
+	  id[j] = id[j - 1];
 	}
+      order[j] = i;
+      id[j] = m;
     }
 
-  return color;
+  shadeBatch batch;
+  for(int k = 0; k < n; k++)
+    {
+      int i = order[k];
+      // as phong() takes them, the view normalized and the normal
+      // turned toward it
+      point view = -point(dir[i]).normalize(), normal = norm[i];
+      if(normal * view < 0.0) normal = - normal;
+      batch.vx[k] = vert[i].get_X();
+      batch.vy[k] = vert[i].get_Y();
+      batch.vz[k] = vert[i].get_Z();
+      batch.nx[k] = normal.get_x();
+      batch.ny[k] = normal.get_y();
+      batch.nz[k] = normal.get_z();
+      batch.ex[k] = view.get_x();
+      batch.ey[k] = view.get_y();
+      batch.ez[k] = view.get_z();
+      const material &m = materials.get(id[k]);
+      color[i] = m.phong_ambient();
+      if(light_bvh)
+	light_cut(m, dir[i], vert[i], norm[i], color[i], rays[i]);
+    }
+
+  // each light in turn, over each run of hits sharing a material
+  Color c[SHADE_BATCH];
+  for(int l = 0; l < num_lights; l++)
+    {
+      if(light_bvh && lights[l].pos.get_w()) continue;
+      for(int first = 0, last; first < n; first = last)
+	{
+	  last = first + 1;
+	  while(last < n && id[last] == id[first]) last++;
+	  materials.get(id[first]).phong(lights[l], batch, first, last, c);
+	}
+      for(int k = 0; k < n; k++)
+	{
+	  int i = order[k];
+	  if((c[k].r || c[k].g || c[k].b)
+	     && (rays[i]++, !shadowed(vert[i], lights[l])))
+	    color[i] += c[k];
+	}
+    }
+}
+
+void scene::light_cut(const material &m, point dir, point vert, point norm,
+		      Color &color, unsigned int &rays) const
+{
+  // point lights, by way of the lights and clusters chosen for the hit,
+  // each casting one shadow ray
+  const light *chosen[MAX_CUT];
+  Color estimate[MAX_CUT];
+  int n = light_bvh->select(m, dir, vert, norm, chosen, estimate);
+  for(int i = 0; i < n; i++)
+    {
+      const Color &c = estimate[i];
+      if((c.r || c.g || c.b) && (rays++, !shadowed(vert, *chosen[i])))
+	color += c;
+    }
+}
+
+void scene::branch(traceItem *stack, int &waiting, const surface *s,
+		   point dir, point vert, point norm, double index,
+		   double weight, int depth, const traceLimits &limits,
+		   unsigned long long &seed) const
+{
+  if(depth <= 0) return;
+  traceItem item[2];
+  int n = 0;
+  double k;
+  // refraction goes first, so that reflection is traced first
+  if( (k = s->refraction()) )
+    {
+      point next_dir = refract(dir, norm, index, s->index());
+      if(next_dir.nonzero())
+	{
+	  item[n].dir = next_dir;
+	  item[n].index = s->index();
+	  item[n++].weight = weight * k;
+	}
+    }
+  if( (k = s->reflection()) )
+    {
+      item[n].dir = reflect(dir, norm);
+      item[n].index = index;
+      item[n++].weight = weight * k;
+    }
+  for(int i = 0; i < n; i++)
+    {
+      if(item[i].weight < limits.min_weight)
+	{
+	  if(!limits.roulette
+	     || next_random(seed) * limits.min_weight >= item[i].weight)
+	    continue;
+	  item[i].weight = limits.min_weight;
+	}
+      item[i].orig = vert;
+      item[i].depth = depth - 1;
+      stack[waiting++] = item[i];
+    }
 }
 
 matrix scene::get_state()
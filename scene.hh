@@ -3,16 +3,48 @@
 
 #include "mesh.hh"
 #include "sphere.hh"
+#include "bvh.hh"
+#include "light_tree.hh"
 
-class scene: public model
+// branches of a path weighing less than this are pruned by default
+#define MIN_WEIGHT 0.01
+// most branches waiting to be traced from one primary hit, and so the
+// most bounces which may be traced, as depth first tracing leaves one
+// sibling waiting for each bounce and the last two together
+#define TRACE_STACK 64
+#define MAX_TRACE_DEPTH (TRACE_STACK - 1)
+
+// How far secondary rays are followed.  A branch weighs the product of
+// the reflection() and refraction() coefficients along its path, and
+// its color counts for that fraction of the pixel.
+struct traceLimits
+{
+  // bounces traced after the first hit, at most MAX_TRACE_DEPTH
+  int max_depth;
+  double min_weight; // branches lighter than this are cut short
+  // cut them by Russian roulette rather than dropping them: each goes
+  // on with probability weight / min_weight, weighing min_weight
+  int roulette;
+};
+
+// a branch of a path waiting to be traced
+struct traceItem
+{
+  point orig, dir;
+  double index, weight;
+  int depth; // bounces left after this one
+};
+
+class scene: public model, public bvh_client
 {
 public:
   scene();
   // preload scene from a file
   scene(const char *filename);
   ~scene();
-  // load scene from a file
-  int load(const char *filename);
+  // load scene from a file, failing before reading any mesh if allow
+  // (when given) returns 0 for one's file name
+  int load(const char *filename, int (*allow)(const char *file) = 0);
   // transform object about global axes
   void rotate(double theta, double vx, double vy, double vz);
   void scale(double sx, double sy, double sz);
@@ -23,10 +55,37 @@ public:
   void translate_local(double tx, double ty, double tz);
   // select the nearest model (if any) which intersects a given ray
   void intersection(point orig, point dir);
-  // perform a ray-tracing step (if depth = 0, just calculate local lighting)
-  Color ray_trace(point orig, point dir, double index, int depth);
+  // ray trace a path within limits (if max_depth = 0, just calculate
+  // local lighting), describing the first hit and the rays traced in
+  // *info (if info isn't 0)
+  Color ray_trace(point orig, point dir, double index,
+		  const traceLimits &limits, pixelInfo *info = 0) const;
+  // ray trace n coherent rays (at most PACKET_SIZE), finding their
+  // first hits as a packet, and set their colors and (if info isn't 0)
+  // the info of each
+  void ray_trace(int n, const point *orig, const point *dir, double index,
+		 const traceLimits &limits, Color *color,
+		 pixelInfo *info = 0) const;
+  // the limits render.bin and the viewer trace with by default
+  static traceLimits default_limits();
+  // find the nearest surface hit by a ray, or -1 if none is
+  int nearest(point orig, point dir, int coarse, double &t, point &vertex,
+	      point &normal) const;
+  // find the nearest surface hit by each ray of a packet
+  void nearest(ray_packet &packet) const;
+  // intersect a ray with a single surface
+  double intersect_primitive(int prim, const bvhRay &ray, double tmax,
+			     void *data) const;
+  // intersect rays of a packet with a single surface
+  void intersect_packet(int prim, ray_packet &packet, int first, int last,
+			void *data) const;
   // get transformation matrices
   matrix get_state();
+  // refit the hierarchy over any surfaces which have moved since it
+  // was last updated
+  void sync_tree();
+  // whether any mesh file has changed since the scene was loaded
+  int meshes_changed() const;
 protected:
   light * lights;
   int num_lights;
@@ -36,13 +95,52 @@ protected:
   int num_meshes;
   int num_surfaces;
   int selected; // selected object
+  bvh *top; // hierarchy over the world bounds of each surface
+  unsigned int *tree_version; // version of each surface in the hierarchy
+  light_tree *light_bvh; // hierarchy over the point lights, if many
+  material_table materials; // shared by the surfaces, by index
   // reflect and refract
-  point reflect(point incoming, point normal);
-  point refract(point incoming, point normal, double n1, double n2);
+  point reflect(point incoming, point normal) const;
+  point refract(point incoming, point normal, double n1, double n2) const;
   // clean up
   void unload();
+  // rebuild the hierarchy over the surfaces' current bounds
+  void build_tree();
+  // refit the hierarchy if surface i has moved, rebuilding it only if
+  // its quality has degraded too far
+  void update_tree(int i);
+  // determine whether any surface blocks a ray nearer than tmax
+  int occluded(point orig, point dir, double tmax) const;
+  // determine whether vertex is hidden from a light
+  int shadowed(point vertex, const light &l) const;
+  // trace the branches leaving a primary hit on surface s (lit by
+  // color) depth first within limits, adding their light to color and
+  // the shadow and secondary rays traced to rays
+  Color shade(const surface *s, Color color, point dir, point vertex,
+	      point normal, double index, const traceLimits &limits,
+	      unsigned int &rays) const;
+  // local lighting of a hit, counting shadow rays in rays
+  Color lighting(const surface *s, point dir, point vertex, point normal,
+		 unsigned int &rays) const;
+  // light hits order[0..n) (at most SHADE_BATCH) of rays along dir as
+  // one batch, hit i being on surface hit[i], setting color[i] and
+  // counting shadow rays in rays[i].  order is sorted by material.
+  void lighting(const int *hit, int *order, int n, const point *dir,
+		const point *vertex, const point *normal, Color *color,
+		unsigned int *rays) const;
+  // add the lighting of the point lights the light tree chooses for a
+  // hit of material m to color
+  void light_cut(const material &m, point dir, point vertex, point normal,
+		 Color &color, unsigned int &rays) const;
+  // push the reflected and refracted branches leaving a hit of the
+  // given weight, unless they are too deep or too light
+  void branch(traceItem *stack, int &waiting, const surface *s,
+	      point dir, point vertex, point normal, double index,
+	      double weight, int depth, const traceLimits &limits,
+	      unsigned long long &seed) const;
   // fetch specified surface
   surface * get_surface(int i);
+  const surface * get_surface(int i) const;
   // propegate changing of axes to children
   void on_set_axes();
   void on_unset_axes();
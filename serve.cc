@@ -0,0 +1,42 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "serve.hh"
+
+static const char *socket_path;
+
+void on_signal(int)
+{
+  unlink(socket_path);
+  _exit(0);
+}
+
+int main(int argc, char* argv[])
+{
+  int threads = 0, opt;
+  while((opt = getopt(argc, argv, "t:h")) != -1)
+    if(opt == 't') threads = atoi(optarg);
+    else
+      {
+	printf("usage: %s [-t THREADS] SOCKET\n", argv[0]);
+	return 1;
+      }
+  if(optind != argc - 1)
+    {
+      printf("usage: %s [-t THREADS] SOCKET\n", argv[0]);
+      return 1;
+    }
+  // log each job as it finishes, even into a pipe
+  setvbuf(stdout, 0, _IOLBF, 0);
+  socket_path = argv[optind];
+  render_server server(threads);
+  if(server.listen(socket_path)) return 1;
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  printf("Listening on %s\n", socket_path);
+  server.run();
+  unlink(socket_path);
+  return 1;
+}
@@ -0,0 +1,12 @@
+#ifndef _SERVE_HH
+#define _SERVE_HH 1
+
+#include "render_server.hh"
+
+// remove the socket and exit on SIGINT or SIGTERM
+void on_signal(int sig);
+
+// Here's the main
+int main(int argc, char* argv[]);
+
+#endif /* _SERVE_HH */
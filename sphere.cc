@@ -6,12 +6,6 @@
 
 sphere::sphere() {}
 
-sphere::sphere(Color ambient_, Color diffuse_, Color specular_,
-	       double shininess_, double refractive_index_,
-	       double reflective_weight_, double refractive_weight_)
-  : surface(ambient_, diffuse_, specular_, shininess_,
-	    refractive_index_, reflective_weight_, refractive_weight_) {}
-
 void sphere::select()
 {
   set_color(1,1,0);
@@ -21,21 +15,36 @@ void sphere::deselect()
   set_color(0,0,1);
 }
 
-double sphere::intersect(point orig, point dir)
+double sphere::intersect(point orig, point dir) const
 {
   point vertex;
   vector normal;
   return do_intersect(orig, dir, vertex, normal, 0);
 }
 
-double sphere::fine_intersect(point orig, point dir, point &vertex, point &normal)
+double sphere::fine_intersect(point orig, point dir, point &vertex,
+			      point &normal) const
 {
   return do_intersect(orig, dir, vertex, normal, 1);
 }
 
-double sphere::do_intersect(point orig, point dir, point &vertex, point &normal, int store)
+int sphere::occluded(point orig, point dir, double tmax) const
+{
+  point vertex;
+  vector normal;
+  double t = do_intersect(orig, dir, vertex, normal, 0);
+  return t != -1.0 && t < tmax;
+}
+
+void sphere::local_bounds(point &min, point &max) const
+{
+  min = point(-1,-1,-1);
+  max = point(1,1,1);
+}
+
+double sphere::do_intersect(point orig, point dir, point &vertex,
+			    point &normal, int store) const
 {
-  matrix inv_state = state.inverse();
   // translate to object coordinates
   orig = inv_state * orig;
   dir = inv_state * dir;
@@ -69,7 +78,7 @@ double sphere::do_intersect(point orig, point dir, point &vertex, point &normal,
       // set vertex and normal based on intersection
       point v = orig + dir * t;
       vertex = state * v;
-      normal = (state * vector(v)).normalize();
+      normal = (normal_state * vector(v)).normalize();
     }
   return t;
 }
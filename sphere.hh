@@ -9,18 +9,19 @@ class sphere : public surface
 {
 public:
   sphere();
-  sphere(Color ambient, Color diffuse, Color specular,
-	 double shininess, double refractive_index,
-	 double reflective_weight, double refractive_weight);
   void select();
   void deselect();
   // intersect a ray with sphere
-  double intersect(point orig, point dir);
+  double intersect(point orig, point dir) const;
   // intersect a ray with sphere and set vertex and normal
-  double fine_intersect(point orig, point dir, point &vertex, point &normal);
+  double fine_intersect(point orig, point dir, point &vertex,
+			point &normal) const;
+  int occluded(point orig, point dir, double tmax) const;
+  void local_bounds(point &min, point &max) const;
 protected:
   // intersect a ray with sphere.  Set vertex and normal if store is true
-  double do_intersect(point orig, point dir, point &vertex, point &normal, int store);
+  double do_intersect(point orig, point dir, point &vertex, point &normal,
+		      int store) const;
   void do_render();
 };
 
@@ -1,94 +1,82 @@
 #include <math.h>
 #include "surface.hh"
 
-/* ############################ light ############################ */
-light::light()
-{
-  pos = point();
-  color = Color();
-}
-
-light::light(int type, point pos_, Color color_)
+/* ########################### surface ########################### */
+surface::surface() : model(0,0,1)
 {
-  pos = point(pos_);
-  pos[3] = type;
-  color = color_;
+  materials = 0;
+  material_id = 0;
 }
 
-
-/* ########################### surface ########################### */
-surface::surface() : model(0,0,1)
+void surface::set_material(const material_table *materials_, int id)
 {
-  ambient = diffuse = specular = Color(1.0, 1.0, 1.0);
-  shininess = refractive_index = reflective_weight = refractive_weight = 0.0;
+  materials = materials_;
+  material_id = id;
 }
 
-surface::surface(Color ambient_, Color diffuse_, Color specular_,
-		 double shininess_, double refractive_index_,
-		 double reflective_weight_, double refractive_weight_)
-  : model(0,0,1)
+int surface::get_material_id() const
 {
-  ambient = ambient_;
-  diffuse = diffuse_;
-  specular = specular_;
-  shininess = shininess_;
-  refractive_index = refractive_index_;
-  reflective_weight = reflective_weight_;
-  refractive_weight = refractive_weight_;
+  return material_id;
 }
 
-void surface::set_lighting(Color ambient_, Color diffuse_, Color specular_,
-			   double shininess_, double refractive_index_,
-			  double reflective_weight_, double refractive_weight_)
+const material &surface::get_material() const
 {
-  ambient = ambient_;
-  diffuse = diffuse_;
-  specular = specular_;
-  shininess = shininess_;
-  refractive_index = refractive_index_;
-  reflective_weight = reflective_weight_;
-  refractive_weight = refractive_weight_;
+  static const material white;
+  return materials ? materials->get(material_id) : white;
 }
 
 double surface::index() const
 {
-  return refractive_index;
+  return get_material().refractive_index;
 }
 
 double surface::reflection() const
 {
-  return reflective_weight;
+  return get_material().reflective_weight;
 }
 
 double surface::refraction() const
 {
-  return refractive_weight;
+  return get_material().refractive_weight;
 }
 
-Color surface::phong_ambient() const
+void surface::world_bounds(double *min, double *max) const
 {
-  return ambient * Color(0.3, 0.3, 0.3);
+  point lmin, lmax;
+  local_bounds(lmin, lmax);
+  // transform each corner of the local box and take their extent
+  for(int i = 0; i < 8; i++)
+    {
+      point p = state * point(i & 1 ? lmax.get_X() : lmin.get_X(),
+			      i & 2 ? lmax.get_Y() : lmin.get_Y(),
+			      i & 4 ? lmax.get_Z() : lmin.get_Z());
+      double c[3] = { p.get_X(), p.get_Y(), p.get_Z() };
+      for(int k = 0; k < 3; k++)
+	{
+	  if(!i || c[k] < min[k]) min[k] = c[k];
+	  if(!i || c[k] > max[k]) max[k] = c[k];
+	}
+    }
 }
 
-Color surface::phong(point dir, light l, int depth, point vertex, point normal)
+void surface::trace_packet(ray_packet &packet, int id, int first,
+			   int last) const
 {
-  point lightdir = (l.pos[3] ? l.pos - vertex : l.pos).normalize(),
-    view = -dir.normalize();
-  if(normal * view < 0.0) normal = - normal;
-  double NdotL = normal * lightdir;
-  Color color;
-  if(NdotL > 0.0)
+  point vertex, normal;
+  for(int i = first; i < last && i < packet.size(); i++)
     {
-      // calculate diffuse lighting
-      color = diffuse * l.color * NdotL;
-
-      // calculate specular highlights
-      // calculate halfway vector, L+V
-      point halfway = (lightdir + view).normalize();
-      float NdotH = normal * halfway;
-      if(NdotH > 0.0)
-	color += specular * l.color
-	  * pow(NdotH, shininess);
+      double t = fine_intersect(packet.get_orig(i), packet.get_dir(i),
+				vertex, normal);
+      if(t != -1.0 && t >= packet.tmin && t < packet.t[i])
+	{
+	  packet.t[i] = t;
+	  packet.surface[i] = id;
+	}
     }
-  return color;
+}
+
+int surface::packet_hit(const ray_packet &, int, point orig, point dir,
+			point &vertex, point &normal) const
+{
+  return fine_intersect(orig, dir, vertex, normal) == -1.0 ? -1 : 0;
 }
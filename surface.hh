@@ -3,27 +3,17 @@
 
 #include "model.hh"
 #include "frame_buffer.hh"
-
-class light
-{
-public:
-  light();
-  light(int type, point pos, Color color);
-  // location of light if a point, direction if a vector
-  point pos;
-  Color color;
-};
+#include "ray_packet.hh"
+#include "material.hh"
 
 class surface : public model
 {
 public:
   surface();
-  surface(Color ambient, Color diffuse, Color specular,
-	  double shininess, double refractive_index,
-	  double reflective_weight, double refractive_weight);
-  void set_lighting(Color ambient, Color diffuse, Color specular,
-		    double shininess, double refractive_index,
-		    double reflective_weight, double refractive_weight);
+  // use material id of a table (until then, plain white)
+  void set_material(const material_table *materials, int id);
+  int get_material_id() const;
+  const material &get_material() const;
   // change color to reflect selected status
   virtual void select() = 0;
   virtual void deselect() = 0;
@@ -33,25 +23,33 @@ public:
   double reflection() const;
   double refraction() const;
   // determine in a coarse manner where ray intersects the object
-  virtual double intersect(point orig, point dir) = 0;
+  virtual double intersect(point orig, point dir) const = 0;
   // determine a fine-grained intersection of ray and object, setting
   // vertex to the world-coordinate location of intersection, and
   // normal to the world-coordinate normal at that point
-  virtual double fine_intersect(point orig, point dir, point &vertex, point &normal) = 0;
-  // lighting calculations
-  Color phong_ambient() const;
-  // calculate non-ambient local illumination, as well as reflection
-  // and refraction vectors if depth > 0
-  Color phong(point dir, light l, int depth, point vertex, point normal);
+  virtual double fine_intersect(point orig, point dir, point &vertex,
+				point &normal) const = 0;
+  // determine whether the ray hits the object anywhere nearer than
+  // tmax, stopping at the first hit found and without calculating
+  // where it is
+  virtual int occluded(point orig, point dir, double tmax) const = 0;
+  // intersect rays [first,last) of a world-coordinate packet with the
+  // object, recording id as the surface of any nearer hits.  By default
+  // the rays are intersected one at a time.
+  virtual void trace_packet(ray_packet &packet, int id, int first,
+			    int last) const;
+  // set vertex and normal for the hit of ray i of a packet, given the
+  // ray in full precision, returning -1 if it can't be found
+  virtual int packet_hit(const ray_packet &packet, int i, point orig,
+			 point dir, point &vertex, point &normal) const;
+  // get the object-coordinate bounding box
+  virtual void local_bounds(point &min, point &max) const = 0;
+  // get the world-coordinate bounding box
+  void world_bounds(double *min, double *max) const;
 protected:
   void init();
-  Color ambient;
-  Color diffuse;
-  Color specular;
-  double shininess;
-  double refractive_index;
-  double reflective_weight;
-  double refractive_weight;
+  const material_table *materials;
+  int material_id;
 };
 
 #endif /* _SURFACE_HH */
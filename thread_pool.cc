@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "thread_pool.hh"
+
+// items of pool jobs the calling thread is in the middle of
+static __thread int running;
+
+// ############################## thread_pool ##############################
+thread_pool::thread_pool(int n)
+{
+  if(n <= 0)
+    {
+      const char *env = getenv("RT_THREADS");
+      n = env ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+  if(n <= 0) n = 1;
+  num_threads = num_deques = n;
+  job = 0;
+  generation = 0;
+  remaining = 0;
+  quit = 0;
+  steals = 0;
+  pthread_mutex_init(&lock, 0);
+  pthread_cond_init(&start, 0);
+  pthread_cond_init(&done, 0);
+  deques = new poolDeque[n];
+  for(int i = 0; i < n; i++)
+    {
+      pthread_mutex_init(&deques[i].lock, 0);
+      deques[i].front = deques[i].back = 0;
+      deques[i].pool = this;
+      deques[i].thread = i;
+    }
+  // the caller of run acts as thread 0
+  threads = new pthread_t[n];
+  for(int i = 1; i < n; i++)
+    if(pthread_create(&threads[i], 0, thread_main, &deques[i]))
+      {
+	printf("thread_pool::thread_pool(): Cannot start thread %d!\n", i);
+	num_threads = i;
+	break;
+      }
+}
+
+thread_pool::~thread_pool()
+{
+  pthread_mutex_lock(&lock);
+  quit = 1;
+  pthread_cond_broadcast(&start);
+  pthread_mutex_unlock(&lock);
+  for(int i = 1; i < num_threads; i++)
+    pthread_join(threads[i], 0);
+  // including the deques of any threads which failed to start
+  for(int i = 0; i < num_deques; i++)
+    pthread_mutex_destroy(&deques[i].lock);
+  pthread_cond_destroy(&start);
+  pthread_cond_destroy(&done);
+  pthread_mutex_destroy(&lock);
+  delete[] threads;
+  delete[] deques;
+}
+
+int thread_pool::size() const
+{
+  return num_threads;
+}
+
+long long thread_pool::get_steals() const
+{
+  return steals;
+}
+
+void thread_pool::run(pool_job *job_, int items)
+{
+  if(items <= 0) return;
+  pthread_mutex_lock(&lock);
+  job = job_;
+  remaining = items;
+  // deal the items out in contiguous runs, so that each thread starts
+  // on neighbouring tiles
+  for(int i = 0; i < num_threads; i++)
+    {
+      pthread_mutex_lock(&deques[i].lock);
+      deques[i].front = (long long)items * i / num_threads;
+      deques[i].back = (long long)items * (i + 1) / num_threads;
+      pthread_mutex_unlock(&deques[i].lock);
+    }
+  generation++;
+  pthread_cond_broadcast(&start);
+  pthread_mutex_unlock(&lock);
+
+  work(0);
+
+  pthread_mutex_lock(&lock);
+  while(remaining)
+    pthread_cond_wait(&done, &lock);
+  job = 0;
+  pthread_mutex_unlock(&lock);
+}
+
+int thread_pool::busy()
+{
+  return running > 0;
+}
+
+int thread_pool::take(int t)
+{
+  int item = -1;
+  poolDeque &own = deques[t];
+  pthread_mutex_lock(&own.lock);
+  if(own.front < own.back) item = own.front++;
+  pthread_mutex_unlock(&own.lock);
+  // steal from the back of another deque, leaving its owner the
+  // items next to the ones it is working on
+  for(int i = 1; item == -1 && i < num_threads; i++)
+    {
+      poolDeque &victim = deques[(t + i) % num_threads];
+      pthread_mutex_lock(&victim.lock);
+      if(victim.front < victim.back)
+	{
+	  item = --victim.back;
+	  __sync_fetch_and_add(&steals, 1);
+	}
+      pthread_mutex_unlock(&victim.lock);
+    }
+  return item;
+}
+
+void thread_pool::work(int t)
+{
+  int item;
+  while((item = take(t)) != -1)
+    {
+      running++;
+      job->run(item, t);
+      running--;
+      pthread_mutex_lock(&lock);
+      if(--remaining == 0) pthread_cond_signal(&done);
+      pthread_mutex_unlock(&lock);
+    }
+}
+
+void *thread_pool::thread_main(void *arg)
+{
+  poolDeque *own = (poolDeque *)arg;
+  thread_pool *pool = own->pool;
+  int seen = 0;
+  pthread_mutex_lock(&pool->lock);
+  while(1)
+    {
+      while(pool->generation == seen && !pool->quit)
+	pthread_cond_wait(&pool->start, &pool->lock);
+      if(pool->quit) break;
+      seen = pool->generation;
+      pthread_mutex_unlock(&pool->lock);
+      pool->work(own->thread);
+      pthread_mutex_lock(&pool->lock);
+    }
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
@@ -0,0 +1,67 @@
+#ifndef _THREAD_POOL_HH
+#define _THREAD_POOL_HH 1
+
+#include <pthread.h>
+
+// work handed to a thread_pool, as a number of independent items
+class pool_job
+{
+public:
+  virtual ~pool_job() {}
+  // do item i on the given thread (0 being the caller of run)
+  virtual void run(int item, int thread) = 0;
+};
+
+class thread_pool;
+
+// double-ended queue of the items [front,back) belonging to one
+// thread.  Its owner takes items from the front, and idle threads
+// steal from the back.
+struct poolDeque
+{
+  pthread_mutex_t lock;
+  int front, back;
+  thread_pool *pool; // the pool and thread owning the deque
+  int thread;
+};
+
+// Fixed set of threads which run the items of a job.  Items are dealt
+// out to the threads' deques in contiguous runs, and a thread whose
+// deque runs dry steals from the back of the others'.
+class thread_pool
+{
+public:
+  // start a pool of n threads (including the caller), or of one per
+  // processor (or $RT_THREADS) if n is 0
+  thread_pool(int n = 0);
+  ~thread_pool();
+  int size() const;
+  // run every item of job, returning once all are done
+  void run(pool_job *job, int items);
+  // count of items taken from another thread's deque
+  long long get_steals() const;
+  // whether the calling thread is running an item of some pool's job,
+  // in which case it should do any work of its own on itself rather
+  // than start yet more threads
+  static int busy();
+protected:
+  int num_threads; // threads started, counting the caller of run
+  pthread_t *threads;
+  poolDeque *deques;
+  int num_deques; // deques made, one per thread asked for
+  // state of the current job, guarded by lock
+  pthread_mutex_t lock;
+  pthread_cond_t start, done;
+  pool_job *job;
+  int generation; // incremented for each job
+  int remaining; // items not yet finished
+  int quit;
+  long long steals;
+  // take the next item for thread t, or return -1 if none are left
+  int take(int t);
+  // run items on thread t until none are left
+  void work(int t);
+  static void *thread_main(void *arg);
+};
+
+#endif /* _THREAD_POOL_HH */
@@ -0,0 +1,70 @@
+#ifndef _TRIANGLE_HH
+#define _TRIANGLE_HH 1
+
+#include <stdint.h>
+#include "bvh.hh"
+
+// a triangle as the indices of its vertices, each less than the
+// number of vertices (checked by whoever reads them)
+struct faceStruct
+{
+  uint32_t v1,v2,v3;
+};
+
+// A triangle as needed by the intersection kernel: its first vertex
+// and the edges leaving it.  Records are stored contiguously in face
+// order.
+struct triRecord
+{
+  float v0[3];
+  float e1[3];
+  float e2[3];
+  float pad[1];
+} __attribute__((aligned(16)));
+
+// fill in a record from the three vertices of a triangle
+inline void make_triangle(triRecord &tri, const double *a, const double *b,
+			  const double *c)
+{
+  for(int k = 0; k < 3; k++)
+    {
+      tri.v0[k] = a[k];
+      tri.e1[k] = b[k] - a[k];
+      tri.e2[k] = c[k] - a[k];
+    }
+  tri.pad[0] = 0.0f;
+}
+
+// Moller-Trumbore intersection of a ray with a triangle record.
+// Return the ray parameter if it lies in [tmin,tmax) and set the
+// barycentric coordinates u and v, or return -1.
+inline double intersect_triangle(const triRecord &tri, const bvhRay &ray,
+				 double tmin, double tmax, double &u,
+				 double &v)
+{
+  const double *d = ray.dir;
+  double e1[3] = { tri.e1[0], tri.e1[1], tri.e1[2] },
+    e2[3] = { tri.e2[0], tri.e2[1], tri.e2[2] },
+    tvec[3] = { ray.orig[0] - tri.v0[0], ray.orig[1] - tri.v0[1],
+		ray.orig[2] - tri.v0[2] };
+  // pvec = dir x edge2
+  double pvec[3] = { d[1] * e2[2] - d[2] * e2[1],
+		     d[2] * e2[0] - d[0] * e2[2],
+		     d[0] * e2[1] - d[1] * e2[0] };
+  double det = e1[0] * pvec[0] + e1[1] * pvec[1] + e1[2] * pvec[2];
+  // reject rays nearly parallel to the triangle
+  if(det > -1e-6 && det < 1e-6) return -1.0;
+  double inv_det = 1.0 / det;
+  u = (tvec[0] * pvec[0] + tvec[1] * pvec[1] + tvec[2] * pvec[2]) * inv_det;
+  if(u < 0.0 || u > 1.0) return -1.0;
+  // qvec = tvec x edge1
+  double qvec[3] = { tvec[1] * e1[2] - tvec[2] * e1[1],
+		     tvec[2] * e1[0] - tvec[0] * e1[2],
+		     tvec[0] * e1[1] - tvec[1] * e1[0] };
+  v = (d[0] * qvec[0] + d[1] * qvec[1] + d[2] * qvec[2]) * inv_det;
+  if(v < 0.0 || u + v > 1.0) return -1.0;
+  double t = (e2[0] * qvec[0] + e2[1] * qvec[1] + e2[2] * qvec[2]) * inv_det;
+  return t >= tmin && t < tmax ? t : -1.0;
+}
+
+#endif /* _TRIANGLE_HH */
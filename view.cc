@@ -1,6 +1,8 @@
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include "view.hh"
 
 extern int window_width, window_height;
@@ -8,6 +10,13 @@ extern int window_width, window_height;
 #define FB_SIZE 64
 #define PROJECTION 0x1 /* 0 = orthographic, 1 = perspective */
 #define ORIGIN 0x2 /* 0 = object, 1 = world */
+#define PACKETS 0x4 /* 0 = single rays, 1 = packets of primary rays */
+#define PROGRESSIVE 0x8 /* 0 = whole frames, 1 = progressive refinement */
+#define ANTIALIAS 0x10 /* 0 = one sample per pixel, 1 = supersampling */
+// stride of the first, coarse pass of progressive refinement
+#define COARSE_STRIDE 8
+// tiles traced per idle callback, for each thread
+#define IDLE_TILES 2
 
 // ############################## view ##############################
 
@@ -15,12 +24,16 @@ view::view() : FrameBuffer(FB_SIZE, FB_SIZE)
 {
   ax = new axes(0,1,0);
   scn = new scene();
-  bf = 0;
+  rend = new renderer();
+  bf = PACKETS | PROGRESSIVE | ANTIALIAS;
+  stale = 1;
+  stride = next_tile = smooth = 0;
+  read_budget();
   width = 6.0;
   depth = 8.0;
   near = 0.5;
   far = 20.0;
-  state = matrix::look_at(point(0,0,8),point(0,0,0),vector(0,1,0));
+  set_state(matrix::look_at(point(0,0,8),point(0,0,0),vector(0,1,0)));
   perspective();
 }
 
@@ -28,17 +41,22 @@ view::view(const char *filename) : FrameBuffer(FB_SIZE, FB_SIZE)
 {
   ax = new axes(0,1,0);
   scn = new scene(filename);
-  bf = 0;
+  rend = new renderer();
+  bf = PACKETS | PROGRESSIVE | ANTIALIAS;
+  stale = 1;
+  stride = next_tile = smooth = 0;
+  read_budget();
   width = 6.0;
   depth = 8.0;
   near = 0.5;
   far = 20.0;
-  state = matrix::look_at(point(0,0,8),point(0,0,0),vector(0,1,0));
+  set_state(matrix::look_at(point(0,0,8),point(0,0,0),vector(0,1,0)));
   perspective();
 }
 
 view::~view()
 {
+  delete rend;
   delete scn;
 }
 
@@ -79,12 +97,84 @@ int view::refresh()
   return bf & PROJECTION;
 }
 
+int view::toggle_packets()
+{
+  bf ^= PACKETS;
+  printf("Tracing primary rays %s\n", bf & PACKETS ? "in packets" : "singly");
+  return bf & PACKETS;
+}
+
+int view::toggle_progressive()
+{
+  bf ^= PROGRESSIVE;
+  printf("Progressive refinement %s\n", bf & PROGRESSIVE ? "on" : "off");
+  return bf & PROGRESSIVE;
+}
+
+int view::toggle_antialias()
+{
+  bf ^= ANTIALIAS;
+  printf("Supersampling %s\n", bf & ANTIALIAS ? "on" : "off");
+  return bf & ANTIALIAS;
+}
+
+int view::next_channel()
+{
+  // only the channel shown is kept
+  int channel = display ? (display << 1) & FB_CHANNELS : FB_DEPTH;
+  SetChannels(channel);
+  set_display(channel);
+  printf("Showing %s\n", channel == FB_DEPTH ? "depth"
+	 : channel == FB_NORMAL ? "normals" : channel == FB_OBJECT ? "objects"
+	 : channel == FB_RAYS ? "rays traced" : "color");
+  return channel;
+}
+
+void view::invalidate()
+{
+  stale = 1;
+  stride = smooth = 0;
+}
+
+int view::refining() const
+{
+  return (bf & PROGRESSIVE) && !stale && stride;
+}
+
+int view::refine()
+{
+  if(!refining()) return 0;
+  // each pass traces the pixels which the coarser ones skipped, and
+  // the last supersamples them all
+  if(smooth)
+    {
+      rend->set_pass(1, 0);
+      rend->set_samples(base_samples, max_samples);
+    }
+  else
+    {
+      rend->set_pass(stride, 2 * stride);
+      rend->set_samples(1, 1);
+    }
+  int tiles = rend->num_tiles(this),
+    last = next_tile + IDLE_TILES * rend->get_pool()->size();
+  if(last > tiles) last = tiles;
+  rend->render(scn, this, next_tile, last);
+  next_tile = last;
+  if(next_tile < tiles) return 0;
+  if(smooth) stride = smooth = 0;
+  else if(stride == 1 && (bf & ANTIALIAS)) smooth = 1;
+  else stride /= 2;
+  next_tile = 0;
+  return 1;
+}
+
 int view::snap()
 {
-  point loc = state.inverse() * point(),
+  point loc = inv_state * point(),
     focus = bf & ORIGIN ? scn->get_state() * point() : point();
-  vector up = state.inverse() * vector(0,1,0);
-  state = matrix::look_at(loc, focus, up);
+  vector up = inv_state * vector(0,1,0);
+  set_state(matrix::look_at(loc, focus, up));
   return bf ^= ORIGIN;
 }
 
@@ -139,16 +229,28 @@ void view::move_far_plane(double delta)
 
 void view::select(int x, int y)
 {
-  x = 2 * width * (double)x / window_width - width;
-  y = width - 2 * width * (double)y / window_height;
+  // the image plane is as tall as the renderer makes it for the buffer
+  double height = width * GetHeight() / GetWidth();
   point orig, dir;
-  cast_ray(x, y, orig, dir);
+  cast_ray(2 * width * (double)x / window_width - width,
+	   height - 2 * height * (double)y / window_height, orig, dir);
   scn->intersection(orig, dir);
 }
 
 void view::render_from_buffer()
 {
-  fill_buffer();
+  if(!(bf & PROGRESSIVE)) fill_buffer();
+  else if(stale)
+    {
+      // show a coarse image at once, and leave the rest to refine()
+      start_frame();
+      rend->set_pass(COARSE_STRIDE, 0);
+      rend->set_samples(1, 1);
+      rend->render(scn, this);
+      stale = 0;
+      stride = COARSE_STRIDE / 2;
+      next_tile = 0;
+    }
   render_buffer();
 }
 
@@ -172,38 +274,40 @@ void view::on_unset_box()
   if(scn) scn->unset_box();
 }
 
+void view::start_frame()
+{
+  scn->sync_tree();
+  rend->set_camera(inv_state, width, depth, bf & PROJECTION);
+  rend->set_packets(bf & PACKETS);
+}
+
 void view::fill_buffer()
 {
-  point orig, dir;
-  for(int i = 0; i < GetWidth(); i++)
-    for(int j = 0; j < GetHeight(); j++)
-      {
-	double u = 2 * width * (double)i / GetWidth() - width,
-	  v = 2 * width * (double)j / GetHeight() - width;
-	cast_ray(u, v, orig, dir);
-	SetPixel( i, j, scn->ray_trace(orig, dir, 1.0, 4) );
-      }
+  start_frame();
+  rend->set_pass(1, 0);
+  if(bf & ANTIALIAS) rend->set_samples(base_samples, max_samples);
+  else rend->set_samples(1, 1);
+  rend->render(scn, this);
+}
+
+void view::read_budget()
+{
+  const char *env = getenv("RT_SAMPLES");
+  base_samples = BASE_SAMPLES;
+  max_samples = MAX_SAMPLES;
+  if(env && sscanf(env, "%d,%d", &base_samples, &max_samples) < 2)
+    max_samples = base_samples;
 }
 
 void view::cast_ray(double x, double y, point &orig, point &dir)
 {
-  matrix inv_state = state.inverse();
-  if(bf & PROJECTION)
-    {
-      // choose a ray extending from the camera origin
-      orig = inv_state * point(0,0,0);
-      dir = inv_state * vector(x, y, - depth);
-    }
-  else
-    {
-      // choose a ray perpendicular to image plane
-      orig = inv_state * point(x, y, 0);
-      dir = inv_state * vector(0,0,-depth);
-    }
+  renderer::cast_ray(inv_state, depth, bf & PROJECTION, x, y, orig, dir);
 }
 
 
 // ############################## orbital_view ##############################
+const double orbital_view::rate = 3.1415927 / 40;
+
 orbital_view::orbital_view()
 {
   r = 20;
@@ -3,6 +3,7 @@
 
 #include "scene.hh"
 #include "frame_buffer.hh"
+#include "renderer.hh"
 
 class view: public model, public FrameBuffer
 {
@@ -20,6 +21,22 @@ public:
   int refresh(); // refresh projection and return type
   // snap to world or object origin
   int snap();
+  // toggle tracing primary rays in packets and return new setting
+  int toggle_packets();
+  // toggle progressive refinement and return new setting
+  int toggle_progressive();
+  // toggle adaptive supersampling and return new setting
+  int toggle_antialias();
+  // show the next of color and the extra channels, and return it
+  int next_channel();
+  // note that the camera or scene has changed, abandoning the current
+  // image and any refinement of it
+  void invalidate();
+  // trace part of the next refinement pass, returning 1 if the pass
+  // was finished (and should be displayed)
+  int refine();
+  // determine whether any refinement passes remain
+  int refining() const;
   // adjust width or depth of image plane
   void inc_width();
   void dec_width();
@@ -33,9 +50,16 @@ public:
   void render_from_buffer();
 protected:
   scene *scn;
+  renderer *rend; // traces scn on a pool of threads
   int bf; // bitfield used to store boolean variables
   double width, depth; // radius of the image plane and distance from camera
   double near, far; // near and far viewing planes
+  // progressive refinement: the image needs to be started over, the
+  // stride of the next pass (0 once finished), and its next tile
+  int stale, stride, next_tile;
+  int smooth; // the next pass supersamples the full-resolution image
+  // sample budget of supersampling, set by $RT_SAMPLES as "base,max"
+  int base_samples, max_samples;
   // propagate state changes of axes
   void on_set_axes();
   void on_unset_axes();
@@ -44,6 +68,10 @@ protected:
   // render the scene
   virtual void do_render();
   void fill_buffer();
+  // prepare the renderer and scene for tracing the current view
+  void start_frame();
+  // set the sample budget from the environment
+  void read_budget();
   // calculate ray from pixel coordinates
   void cast_ray(double x, double y, point &orig, point &dir);
 };
@@ -60,7 +88,7 @@ protected:
   double r; // radial coordinate
   double theta; // polar angle
   double phi; // azimuthal angle
-  static const double rate = 3.1415927 / 40;
+  static const double rate;
   // render the scene
   void do_render();
 };
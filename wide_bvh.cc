@@ -0,0 +1,477 @@
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wide_bvh.hh"
+#include "lanes.hh"
+
+#define EPSILON 1e-6f
+#define STACK_SIZE 1024
+
+// ############################## build ##############################
+// quantize the interval [lo,hi] onto the grid origin + q * scale
+static void quantize(float origin, float scale, double lo, double hi,
+		     unsigned char &qlo, unsigned char &qhi)
+{
+  int a = (int)floor((lo - origin) / scale),
+    b = (int)ceil((hi - origin) / scale);
+  if(a < 0) a = 0;
+  if(b > 255) b = 255;
+  // make sure float rounding keeps the quantized box conservative
+  while(a > 0 && origin + a * scale > lo) a--;
+  while(b < 255 && origin + b * scale < hi) b++;
+  qlo = a;
+  qhi = b;
+}
+
+template<int W>
+struct collapser
+{
+  const bvhNode *bin;
+  const bvh *tree;
+  const triRecord *tri;
+  wideNode<W> *nodes;
+  int num_nodes;
+  triBlock<W> *blocks;
+  int num_blocks;
+
+  double area(int b) const
+  {
+    double dx = bin[b].max[0] - bin[b].min[0],
+      dy = bin[b].max[1] - bin[b].min[1], dz = bin[b].max[2] - bin[b].min[2];
+    return dx * dy + dy * dz + dz * dx;
+  }
+
+  // copy the triangles of a binary leaf into blocks, returning the
+  // encoded child entry
+  int make_leaf(int b)
+  {
+    int first = num_blocks, count = bin[b].count,
+      nblocks = (count + W - 1) / W;
+    float nan = nanf("");
+    for(int i = 0; i < nblocks * W; i++)
+      {
+	triBlock<W> &blk = blocks[first + i / W];
+	int lane = i % W;
+	if(i >= count)
+	  {
+	    for(int k = 0; k < 3; k++)
+	      blk.v0[k][lane] = blk.e1[k][lane] = blk.e2[k][lane] = nan;
+	    blk.id[lane] = -1;
+	    continue;
+	  }
+	int prim = tree->primitive(bin[b].offset + i);
+	for(int k = 0; k < 3; k++)
+	  {
+	    blk.v0[k][lane] = tri[prim].v0[k];
+	    blk.e1[k][lane] = tri[prim].e1[k];
+	    blk.e2[k][lane] = tri[prim].e2[k];
+	  }
+	blk.id[lane] = prim;
+      }
+    num_blocks += nblocks;
+    return ~(first << 3 | (nblocks - 1));
+  }
+
+  // make a wide node out of the subtree under binary node b
+  int make_node(int b)
+  {
+    int node = num_nodes++, kids[W], n = 0;
+    if(bin[b].count) kids[n++] = b;
+    else
+      {
+	kids[n++] = bin[b].offset;
+	kids[n++] = bin[b].offset + 1;
+      }
+    // open the largest interior child until the node is full
+    while(n < W)
+      {
+	int best = -1;
+	for(int i = 0; i < n; i++)
+	  if(!bin[kids[i]].count
+	     && (best == -1 || area(kids[i]) > area(kids[best])))
+	    best = i;
+	if(best == -1) break;
+	int c = kids[best];
+	kids[best] = bin[c].offset;
+	kids[n++] = bin[c].offset + 1;
+      }
+
+    wideNode<W> &nd = nodes[node];
+    double lo[3], hi[3];
+    for(int k = 0; k < 3; k++)
+      {
+	lo[k] = DBL_MAX;
+	hi[k] = -DBL_MAX;
+	for(int i = 0; i < n; i++)
+	  {
+	    if(bin[kids[i]].min[k] < lo[k]) lo[k] = bin[kids[i]].min[k];
+	    if(bin[kids[i]].max[k] > hi[k]) hi[k] = bin[kids[i]].max[k];
+	  }
+	float origin = (float)lo[k], scale = 1.0f;
+	if(origin > lo[k]) origin = nextafterf(origin, -FLT_MAX);
+	// smallest power of two whose grid spans the node
+	if(hi[k] > origin)
+	  scale = ldexpf(1.0f, (int)ceil(log2((hi[k] - origin) / 255)));
+	while(origin + 255 * scale < hi[k]) scale *= 2;
+	nd.origin[k] = origin;
+	nd.scale[k] = scale;
+      }
+    for(int i = 0; i < W; i++)
+      {
+	if(i >= n)
+	  {
+	    // an inverted box can never be hit
+	    nd.child[i] = 0;
+	    for(int k = 0; k < 3; k++)
+	      {
+		nd.qmin[k][i] = 255;
+		nd.qmax[k][i] = 0;
+	      }
+	    continue;
+	  }
+	for(int k = 0; k < 3; k++)
+	  quantize(nd.origin[k], nd.scale[k], bin[kids[i]].min[k],
+		   bin[kids[i]].max[k], nd.qmin[k][i], nd.qmax[k][i]);
+      }
+    for(int i = 0; i < n; i++)
+      nd.child[i] = bin[kids[i]].count ? make_leaf(kids[i])
+	: make_node(kids[i]);
+    return node;
+  }
+};
+
+// ############################ traversal ############################
+// Find the nearest hit, or with ANY set, stop at the first hit found
+// without ordering children or keeping hit attributes.
+template<class S, int W, int ANY>
+static double traverse(const wideNode<W> *nodes, const triBlock<W> *blocks,
+		       const bvhRay &ray, double tmin_, double tmax_,
+		       int &prim, double &u_out, double &v_out)
+{
+  typedef typename S::vf vf;
+  vf o[3], d[3], inv[3];
+  int neg[3];
+  for(int k = 0; k < 3; k++)
+    {
+      o[k] = S::set1((float)ray.orig[k]);
+      d[k] = S::set1((float)ray.dir[k]);
+      // division by zero deliberately produces an infinity
+      inv[k] = S::set1(1.0f / (float)ray.dir[k]);
+      neg[k] = signbit((float)ray.dir[k]);
+    }
+  float tmax = tmax_ < FLT_MAX ? (float)tmax_ : FLT_MAX;
+  vf tmin = S::set1((float)tmin_), eps = S::set1(EPSILON),
+    zero = S::set1(0.0f), one = S::set1(1.0f);
+  float tbuf[W] __attribute__((aligned(32))),
+    ubuf[W] __attribute__((aligned(32))),
+    vbuf[W] __attribute__((aligned(32)));
+  int stack[STACK_SIZE], sp = 0, hit = -1;
+  float dist[STACK_SIZE];
+  double u_hit = 0.0, v_hit = 0.0;
+
+  stack[sp] = 0;
+  dist[sp++] = 0.0f;
+  while(sp)
+    {
+      sp--;
+      if(dist[sp] > tmax) continue;
+      int c = stack[sp];
+      if(c >= 0)
+	{
+	  // slab test against all child boxes at once
+	  const wideNode<W> &nd = nodes[c];
+	  vf tn = zero, tf = S::set1(tmax);
+	  for(int k = 0; k < 3; k++)
+	    {
+	      vf org = S::set1(nd.origin[k]), scl = S::set1(nd.scale[k]);
+	      vf near = S::add(org, S::mul(S::bytes(neg[k] ? nd.qmax[k]
+						    : nd.qmin[k]), scl)),
+		far = S::add(org, S::mul(S::bytes(neg[k] ? nd.qmin[k]
+						  : nd.qmax[k]), scl));
+	      tn = S::max(S::mul(S::sub(near, o[k]), inv[k]), tn);
+	      tf = S::min(S::mul(S::sub(far, o[k]), inv[k]), tf);
+	    }
+	  int bits = S::mask(S::le(tn, tf));
+	  if(!bits) continue;
+	  if(ANY)
+	    {
+	      while(bits)
+		{
+		  int i = __builtin_ctz(bits);
+		  bits &= bits - 1;
+		  stack[sp] = nd.child[i];
+		  dist[sp++] = 0.0f;
+		}
+	      continue;
+	    }
+	  S::store(tbuf, tn);
+	  // push hit children farthest first so the nearest pops next
+	  int base = sp;
+	  while(bits)
+	    {
+	      int i = __builtin_ctz(bits);
+	      bits &= bits - 1;
+	      int j = sp++;
+	      while(j > base && dist[j - 1] < tbuf[i])
+		{
+		  stack[j] = stack[j - 1];
+		  dist[j] = dist[j - 1];
+		  j--;
+		}
+	      stack[j] = nd.child[i];
+	      dist[j] = tbuf[i];
+	    }
+	  continue;
+	}
+
+      // test each block of triangles in the leaf
+      c = ~c;
+      for(int b = c >> 3, end = (c >> 3) + (c & 7) + 1; b < end; b++)
+	{
+	  const triBlock<W> &blk = blocks[b];
+	  vf e1[3], e2[3], tv[3], pv[3], qv[3];
+	  for(int k = 0; k < 3; k++)
+	    {
+	      e1[k] = S::load(blk.e1[k]);
+	      e2[k] = S::load(blk.e2[k]);
+	      tv[k] = S::sub(o[k], S::load(blk.v0[k]));
+	    }
+	  // pvec = dir x edge2
+	  pv[0] = S::sub(S::mul(d[1], e2[2]), S::mul(d[2], e2[1]));
+	  pv[1] = S::sub(S::mul(d[2], e2[0]), S::mul(d[0], e2[2]));
+	  pv[2] = S::sub(S::mul(d[0], e2[1]), S::mul(d[1], e2[0]));
+	  vf det = S::add(S::add(S::mul(e1[0], pv[0]), S::mul(e1[1], pv[1])),
+			  S::mul(e1[2], pv[2]));
+	  vf inv_det = S::div(one, det);
+	  vf u = S::mul(S::add(S::add(S::mul(tv[0], pv[0]),
+				      S::mul(tv[1], pv[1])),
+			       S::mul(tv[2], pv[2])), inv_det);
+	  // qvec = tvec x edge1
+	  qv[0] = S::sub(S::mul(tv[1], e1[2]), S::mul(tv[2], e1[1]));
+	  qv[1] = S::sub(S::mul(tv[2], e1[0]), S::mul(tv[0], e1[2]));
+	  qv[2] = S::sub(S::mul(tv[0], e1[1]), S::mul(tv[1], e1[0]));
+	  vf v = S::mul(S::add(S::add(S::mul(d[0], qv[0]),
+				      S::mul(d[1], qv[1])),
+			       S::mul(d[2], qv[2])), inv_det);
+	  vf t = S::mul(S::add(S::add(S::mul(e2[0], qv[0]),
+				      S::mul(e2[1], qv[1])),
+			       S::mul(e2[2], qv[2])), inv_det);
+	  vf m = S::land(S::gt(S::abs(det), eps), S::ge(u, zero));
+	  m = S::land(m, S::ge(v, zero));
+	  m = S::land(m, S::le(S::add(u, v), one));
+	  m = S::land(m, S::ge(t, tmin));
+	  m = S::land(m, S::lt(t, S::set1(tmax)));
+	  int bits = S::mask(m);
+	  if(!bits) continue;
+	  S::store(tbuf, t);
+	  if(ANY) return tbuf[__builtin_ctz(bits)];
+	  S::store(ubuf, u);
+	  S::store(vbuf, v);
+	  while(bits)
+	    {
+	      int i = __builtin_ctz(bits);
+	      bits &= bits - 1;
+	      if(tbuf[i] < tmax)
+		{
+		  tmax = tbuf[i];
+		  hit = blk.id[i];
+		  u_hit = ubuf[i];
+		  v_hit = vbuf[i];
+		}
+	    }
+	}
+    }
+  if(hit == -1) return -1.0;
+  prim = hit;
+  u_out = u_hit;
+  v_out = v_hit;
+  return tmax;
+}
+
+// ############################## wide_bvh ##############################
+wide_bvh::wide_bvh()
+{
+  width = 0;
+  nodes = blocks = 0;
+  num_nodes = num_blocks = 0;
+  attached = 0;
+}
+
+wide_bvh::~wide_bvh()
+{
+  deinit();
+}
+
+void wide_bvh::deinit()
+{
+  if(nodes && !attached) free(nodes);
+  if(blocks && !attached) free(blocks);
+  attached = 0;
+  nodes = blocks = 0;
+  num_nodes = num_blocks = 0;
+}
+
+template<int W>
+static void collapse(const bvh &tree, const triRecord *tri,
+		     void *&nodes, int &num_nodes, void *&blocks,
+		     int &num_blocks, int num_prims)
+{
+  collapser<W> c;
+  c.bin = tree.get_nodes();
+  c.tree = &tree;
+  c.tri = tri;
+  c.nodes = 0;
+  c.blocks = 0;
+  c.num_nodes = c.num_blocks = 0;
+  if(posix_memalign((void **)&c.nodes, 64, sizeof(wideNode<W>) * tree.size())
+     || posix_memalign((void **)&c.blocks, 64,
+		       sizeof(triBlock<W>) * num_prims))
+    {
+      free(c.nodes);
+      nodes = blocks = 0;
+      return;
+    }
+  c.make_node(0);
+  nodes = c.nodes;
+  num_nodes = c.num_nodes;
+  blocks = c.blocks;
+  num_blocks = c.num_blocks;
+}
+
+void wide_bvh::build(const bvh &tree, const triRecord *tri, int width_)
+{
+  deinit();
+  width = width_ == 8 ? 8 : 4;
+  if(!tree.size()) return;
+  // every leaf holds at least one primitive, so there are no more
+  // blocks than primitives
+  int num_prims = 0;
+  for(int i = 0; i < tree.size(); i++)
+    num_prims += tree.get_nodes()[i].count;
+  if(width == 8)
+    collapse<8>(tree, tri, nodes, num_nodes, blocks, num_blocks, num_prims);
+  else
+    collapse<4>(tree, tri, nodes, num_nodes, blocks, num_blocks, num_prims);
+}
+
+void wide_bvh::attach(int width_, void *nodes_, int num_nodes_,
+		      void *blocks_, int num_blocks_)
+{
+  deinit();
+  width = width_;
+  nodes = nodes_;
+  num_nodes = num_nodes_;
+  blocks = blocks_;
+  num_blocks = num_blocks_;
+  attached = 1;
+}
+
+template<int W>
+static int valid_nodes(const wideNode<W> *nodes, int num_nodes,
+		       const triBlock<W> *blocks, int num_blocks, int faces)
+{
+  // children follow their parents, so depths can be found in order.
+  // Opening a node at depth d leaves at most d * (W - 1) + W entries
+  // on the traversal stack.
+  int *depth = new int[num_nodes], ret = 1;
+  for(int i = 0; i < num_nodes; i++)
+    depth[i] = 0;
+  for(int i = 0; i < num_nodes && ret; i++)
+    {
+      if(depth[i] * (W - 1) + W > STACK_SIZE) ret = 0;
+      for(int j = 0; j < W && ret; j++)
+	{
+	  // unused lanes have inverted boxes and are never followed
+	  int live = 1;
+	  for(int k = 0; k < 3; k++)
+	    if(nodes[i].qmin[k][j] > nodes[i].qmax[k][j]) live = 0;
+	  int c = nodes[i].child[j];
+	  if(!live) continue;
+	  if(c >= 0)
+	    {
+	      if(c <= i || c >= num_nodes) ret = 0;
+	      else if(depth[c] < depth[i] + 1) depth[c] = depth[i] + 1;
+	    }
+	  else if((~c >> 3) + (~c & 7) + 1 > num_blocks) ret = 0;
+	}
+    }
+  delete[] depth;
+  for(int b = 0; b < num_blocks && ret; b++)
+    for(int j = 0; j < W; j++)
+      if(blocks[b].id[j] < -1 || blocks[b].id[j] >= faces) ret = 0;
+  return ret;
+}
+
+int wide_bvh::valid(int width_, const void *nodes_, int num_nodes_,
+		    const void *blocks_, int num_blocks_, int faces)
+{
+  if(num_nodes_ < 1 || num_blocks_ < 0) return 0;
+  if(width_ == 8)
+    return valid_nodes<8>((const wideNode<8> *)nodes_, num_nodes_,
+			  (const triBlock<8> *)blocks_, num_blocks_, faces);
+  return valid_nodes<4>((const wideNode<4> *)nodes_, num_nodes_,
+			(const triBlock<4> *)blocks_, num_blocks_, faces);
+}
+
+int wide_bvh::get_width() const
+{
+  return width;
+}
+
+const void *wide_bvh::get_nodes() const
+{
+  return nodes;
+}
+
+int wide_bvh::get_num_nodes() const
+{
+  return num_nodes;
+}
+
+const void *wide_bvh::get_blocks() const
+{
+  return blocks;
+}
+
+int wide_bvh::get_num_blocks() const
+{
+  return num_blocks;
+}
+
+int wide_bvh::node_size(int width_)
+{
+  return width_ == 8 ? sizeof(wideNode<8>) : sizeof(wideNode<4>);
+}
+
+int wide_bvh::block_size(int width_)
+{
+  return width_ == 8 ? sizeof(triBlock<8>) : sizeof(triBlock<4>);
+}
+
+double wide_bvh::intersect(const bvhRay &ray, double tmin, double tmax,
+			   int &prim, double &u, double &v) const
+{
+  if(!nodes) return -1.0;
+  if(width == 8)
+    return traverse<lanes8, 8, 0>((const wideNode<8> *)nodes,
+				  (const triBlock<8> *)blocks, ray, tmin, tmax,
+				  prim, u, v);
+  return traverse<lanes4, 4, 0>((const wideNode<4> *)nodes,
+				(const triBlock<4> *)blocks, ray, tmin, tmax,
+				prim, u, v);
+}
+
+int wide_bvh::occluded(const bvhRay &ray, double tmin, double tmax) const
+{
+  int prim;
+  double u, v;
+  if(!nodes) return 0;
+  if(width == 8)
+    return traverse<lanes8, 8, 1>((const wideNode<8> *)nodes,
+				  (const triBlock<8> *)blocks, ray, tmin, tmax,
+				  prim, u, v) != -1.0;
+  return traverse<lanes4, 4, 1>((const wideNode<4> *)nodes,
+				(const triBlock<4> *)blocks, ray, tmin, tmax,
+				prim, u, v) != -1.0;
+}
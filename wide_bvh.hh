@@ -0,0 +1,77 @@
+#ifndef _WIDE_BVH_HH
+#define _WIDE_BVH_HH 1
+
+#include "bvh.hh"
+#include "triangle.hh"
+
+// Node of a width-way hierarchy.  Child boxes are quantized to eight
+// bits per plane on a grid of origin + q * scale, and each node is
+// padded out to whole cache lines.
+template<int W> struct wideNode
+{
+  float origin[3];
+  float scale[3]; // always a power of two
+  // non-negative entries index a child node; negative entries are
+  // leaves, storing ~(first block << 3 | (blocks - 1))
+  int child[W];
+  unsigned char qmin[3][W];
+  unsigned char qmax[3][W];
+} __attribute__((aligned(64)));
+
+// W triangles laid out for testing in parallel.  Unused lanes hold
+// NaN vertices, which never report a hit.
+template<int W> struct triBlock
+{
+  float v0[3][W];
+  float e1[3][W];
+  float e2[3][W];
+  int id[W];
+} __attribute__((aligned(32)));
+
+// hierarchy of width 4 or 8, traversed with SSE/AVX slab tests and
+// leaf triangle tests
+class wide_bvh
+{
+public:
+  wide_bvh();
+  ~wide_bvh();
+  // collapse a binary hierarchy whose primitives are the triangles
+  // tri[i] into one of the given width (4 or 8)
+  void build(const bvh &tree, const triRecord *tri, int width);
+  // use nodes and blocks owned by someone else (e.g., a mapped cache
+  // file) in place of building
+  void attach(int width, void *nodes, int num_nodes, void *blocks,
+	      int num_blocks);
+  // whether nodes and blocks from outside (e.g., a cache file) form a
+  // hierarchy of the given width over faces triangles which is safe
+  // to traverse
+  static int valid(int width, const void *nodes, int num_nodes,
+		   const void *blocks, int num_blocks, int faces);
+  int get_width() const;
+  // raw storage, for writing to a cache
+  const void *get_nodes() const;
+  int get_num_nodes() const;
+  const void *get_blocks() const;
+  int get_num_blocks() const;
+  // size in bytes of a node and a triangle block of the given width
+  static int node_size(int width);
+  static int block_size(int width);
+  // find the nearest triangle hit with ray parameter in [tmin,tmax),
+  // returning the parameter and setting prim and the barycentric
+  // coordinates u and v, or returning -1 if nothing is hit
+  double intersect(const bvhRay &ray, double tmin, double tmax, int &prim,
+		   double &u, double &v) const;
+  // return 1 as soon as any triangle is found with ray parameter in
+  // [tmin,tmax), or 0 if there are none
+  int occluded(const bvhRay &ray, double tmin, double tmax) const;
+protected:
+  int width;
+  void *nodes;
+  int num_nodes;
+  void *blocks;
+  int num_blocks;
+  int attached; // nodes and blocks are not ours to free
+  void deinit();
+};
+
+#endif /* _WIDE_BVH_HH */
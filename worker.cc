@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "worker.hh"
+
+static void usage(const char *name)
+{
+  printf("usage: %s [-t THREADS] [-d DIR] [-b ADDRESS] PORT\n"
+	 "  -t THREADS    threads (default one per processor or $RT_THREADS)\n"
+	 "  -d DIR        cache scenes and meshes sent to it in DIR\n"
+	 "                (default .rtworker)\n"
+	 "  -b ADDRESS    listen on the interface with ADDRESS, or on every\n"
+	 "                one if it is * (default 127.0.0.1, so only this\n"
+	 "                machine can connect)\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+  const char *dir = ".rtworker", *address = "127.0.0.1";
+  int threads = 0, opt;
+  while((opt = getopt(argc, argv, "t:d:b:h")) != -1)
+    if(opt == 't') threads = atoi(optarg);
+    else if(opt == 'd') dir = optarg;
+    else if(opt == 'b') address = strcmp(optarg, "*") ? optarg : 0;
+    else
+      {
+	usage(argv[0]);
+	return 1;
+      }
+  if(optind != argc - 1 || atoi(argv[optind]) <= 0)
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  // scenes name their meshes relative to the cache
+  mkdir(dir, 0777);
+  if(chdir(dir))
+    {
+      printf("Cannot use %s: %s\n", dir, strerror(errno));
+      return 1;
+    }
+  setvbuf(stdout, 0, _IOLBF, 0);
+  render_worker worker(threads);
+  if(worker.listen(address, atoi(argv[optind]))) return 1;
+  printf("Listening on %s:%s\n", address ? address : "*", argv[optind]);
+  worker.run();
+  return 1;
+}
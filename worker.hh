@@ -0,0 +1,9 @@
+#ifndef _WORKER_HH
+#define _WORKER_HH 1
+
+#include "render_worker.hh"
+
+// Here's the main
+int main(int argc, char* argv[]);
+
+#endif /* _WORKER_HH */